@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "../src/channel.h"
+#include "../src/channel_pool.h"
+#include "../src/broadcast.h"
+#include "../src/common.h"
+
+/*
+* one producer and one consumer on different cores (when the machine
+* has more than one) pass BENCH_COUNT messages through a queue,
+* the throughput is mostly bounded by the cache lines the two sides
+* share.
+* the heap benchmark measures the priority queue alone.
+*/
+#define BENCH_COUNT 2000000
+#define BENCH_QUEUE_SIZE 1024
+#define BENCH_BATCH 32
+
+typedef struct {
+    queue_t * q;
+    int cpu;
+    int batch;
+} bench_arg_t;
+
+static void _pin(int cpu){
+#ifdef __linux__
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpu < 2) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+static double _now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void * _bench_producer(void * data){
+    bench_arg_t * arg = (bench_arg_t*)data;
+    _pin(arg->cpu);
+    long i, buf[BENCH_BATCH];
+    unsigned int k;
+    if(arg->batch){
+        for(i = 0; i < BENCH_COUNT; i += k){
+            unsigned int j, n = BENCH_COUNT - i < BENCH_BATCH ?
+                BENCH_COUNT - i : BENCH_BATCH;
+            for(j = 0; j < n; j++) buf[j] = i + j;
+            queue_put_many(arg->q, buf, n, &k);
+        }
+    }else
+        for(i = 0; i < BENCH_COUNT; i++)
+            queue_put(arg->q, &i);
+    return NULL;
+}
+
+void * _bench_consumer(void * data){
+    bench_arg_t * arg = (bench_arg_t*)data;
+    _pin(arg->cpu);
+    long i, v, sum = 0, buf[BENCH_BATCH];
+    unsigned int j, k;
+    if(arg->batch){
+        for(i = 0; i < BENCH_COUNT; i += k){
+            queue_take_many(arg->q, buf, BENCH_BATCH, &k);
+            for(j = 0; j < k; j++) sum += buf[j];
+        }
+    }else
+        for(i = 0; i < BENCH_COUNT; i++){
+            queue_take(arg->q, &v);
+            sum += v;
+        }
+    if(sum != (long)BENCH_COUNT * (BENCH_COUNT - 1) / 2)
+        fprintf(stderr, "bench: wrong checksum\n");
+    return NULL;
+}
+
+static void _bench(const char * name,
+        queue_t * (*ctor)(unsigned int, size_t), int batch)
+{
+    queue_t * q = ctor(BENCH_QUEUE_SIZE, sizeof(long));
+    bench_arg_t p = {q, 0, batch}, c = {q, 1, batch};
+    pthread_t tp, tc;
+    double t = _now();
+    pthread_create(&tc, NULL, &_bench_consumer, &c);
+    pthread_create(&tp, NULL, &_bench_producer, &p);
+    pthread_join(tp, NULL);
+    pthread_join(tc, NULL);
+    t = _now() - t;
+    printf("%-6s %-6s %10.2f Mmsg/s\n", name, batch ? "batch" : "single",
+            BENCH_COUNT / t / 1e6);
+    queue_free(q);
+}
+
+/*
+* fills a priority queue of BENCH_HEAP_COUNT elements of size bytes
+* with random priorities below range then empties it, on a single
+* thread
+*/
+#define BENCH_HEAP_COUNT 100000
+#define BENCH_LEVELS 64
+
+static void _bench_priority(const char * name, priority_queue_t * q,
+        size_t size, int range)
+{
+    char * buf = calloc(1, size);
+    int i;
+    srand(1);
+    double t = _now();
+    for(i = 0; i < BENCH_HEAP_COUNT; i++)
+        priority_queue_put(q, buf, rand() % range);
+    for(i = 0; i < BENCH_HEAP_COUNT; i++)
+        priority_queue_take(q, buf);
+    t = _now() - t;
+    printf("%-6s %-6zu %10.2f Mmsg/s\n", name, size,
+            2 * BENCH_HEAP_COUNT / t / 1e6);
+    free(buf);
+    priority_queue_free(q);
+}
+
+static void _bench_heap(size_t size, unsigned int arity){
+    char name[8];
+    snprintf(name, sizeof(name), "heap%u", arity);
+    _bench_priority(name, priority_queue_new_dary(BENCH_HEAP_COUNT, size,
+                arity), size, RAND_MAX);
+}
+
+static void _bench_bucketed(size_t size){
+    _bench_priority("heap4", priority_queue_new_dary(BENCH_HEAP_COUNT,
+                size, 4), size, BENCH_LEVELS);
+    _bench_priority("bucket", priority_queue_new_bucketed(BENCH_HEAP_COUNT,
+                size, BENCH_LEVELS), size, BENCH_LEVELS);
+}
+
+/*
+* creates BENCH_LIVE queues of BENCH_QUEUE_SIZE ints, puts and takes
+* one element in each and frees them, BENCH_ROUNDS times, on a single
+* thread. with a pool the queues come from its arenas
+*/
+#define BENCH_LIVE 64
+#define BENCH_ROUNDS 2000
+
+static void _bench_create(const char * name, queue_pool_t * pool){
+    queue_t * q[BENCH_LIVE];
+    int r, i, v = 0;
+    double t = _now();
+    for(r = 0; r < BENCH_ROUNDS; r++){
+        for(i = 0; i < BENCH_LIVE; i++){
+            q[i] = pool ? queue_pool_get(pool) :
+                queue_new(BENCH_QUEUE_SIZE, sizeof(int));
+            queue_put(q[i], &v);
+        }
+        for(i = 0; i < BENCH_LIVE; i++){
+            queue_take(q[i], &v);
+            queue_free(q[i]);
+        }
+    }
+    t = _now() - t;
+    printf("%-6s %10.2f Mqueues/s\n", name,
+            BENCH_ROUNDS * BENCH_LIVE / t / 1e6);
+    if(pool) queue_pool_free(pool);
+}
+
+/*
+* messages of random lengths from 20 to BENCH_MSG_MAX bytes, either
+* in a queue of variable length messages or padded to BENCH_MSG_MAX
+* in a fixed size queue, both rings take BENCH_RING_BYTES
+*/
+#define BENCH_MSG_COUNT 200000
+#define BENCH_MSG_MAX 512
+#define BENCH_RING_BYTES (256*1024)
+
+typedef struct {
+    queue_t * q;
+    int bytes;
+} bench_bytes_t;
+
+void * _bench_bytes_producer(void * data){
+    bench_bytes_t * arg = (bench_bytes_t*)data;
+    char buf[BENCH_MSG_MAX] = {0};
+    int i;
+    srand(2);
+    for(i = 0; i < BENCH_MSG_COUNT; i++){
+        size_t len = 20 + rand() % (BENCH_MSG_MAX - 19);
+        if(arg->bytes)
+            queue_put_bytes(arg->q, buf, len);
+        else
+            queue_put(arg->q, buf);
+    }
+    return NULL;
+}
+
+static void _bench_bytes(const char * name, int bytes){
+    queue_t * q = bytes ? queue_new_bytes(BENCH_RING_BYTES) :
+        queue_new(BENCH_RING_BYTES / BENCH_MSG_MAX, BENCH_MSG_MAX);
+    char buf[BENCH_MSG_MAX];
+    size_t len;
+    bench_bytes_t p = {q, bytes};
+    pthread_t tp;
+    int i;
+    double t = _now();
+    pthread_create(&tp, NULL, &_bench_bytes_producer, &p);
+    for(i = 0; i < BENCH_MSG_COUNT; i++)
+        if(bytes)
+            queue_take_bytes(q, buf, sizeof(buf), &len);
+        else
+            queue_take(q, buf);
+    pthread_join(tp, NULL);
+    t = _now() - t;
+    printf("%-9s %10.2f Mmsg/s\n", name, BENCH_MSG_COUNT / t / 1e6);
+    queue_free(q);
+}
+
+/*
+* one producer hands every message to BENCH_FANOUT consumers, either
+* with a put per consumer queue or with one put in a broadcast
+*/
+#define BENCH_FANOUT 4
+
+typedef struct {
+    broadcast_t * b;
+    queue_t ** q;
+} bench_fanout_t;
+
+void * _bench_fanout_producer(void * data){
+    bench_fanout_t * f = (bench_fanout_t*)data;
+    long i;
+    int k;
+    for(i = 0; i < BENCH_COUNT; i++){
+        if(f->b)
+            broadcast_put(f->b, &i);
+        else
+            for(k = 0; k < BENCH_FANOUT; k++)
+                queue_put(f->q[k], &i);
+    }
+    return NULL;
+}
+
+static void _bench_fanout(const char * name, int broadcast){
+    queue_t * q[BENCH_FANOUT];
+    bench_arg_t c[BENCH_FANOUT];
+    pthread_t tp, tc[BENCH_FANOUT];
+    bench_fanout_t f = {NULL, q};
+    int k;
+    if(broadcast)
+        f.b = broadcast_new(BENCH_QUEUE_SIZE, sizeof(long),
+                BROADCAST_BLOCK);
+    for(k = 0; k < BENCH_FANOUT; k++){
+        q[k] = broadcast ? broadcast_subscribe(f.b) :
+            queue_new(BENCH_QUEUE_SIZE, sizeof(long));
+        c[k].q = q[k];
+        c[k].cpu = k + 1;
+        c[k].batch = 1;
+    }
+    double t = _now();
+    for(k = 0; k < BENCH_FANOUT; k++)
+        pthread_create(&tc[k], NULL, &_bench_consumer, &c[k]);
+    pthread_create(&tp, NULL, &_bench_fanout_producer, &f);
+    pthread_join(tp, NULL);
+    for(k = 0; k < BENCH_FANOUT; k++)
+        pthread_join(tc[k], NULL);
+    t = _now() - t;
+    printf("%-9s x%d %10.2f Mmsg/s\n", name, BENCH_FANOUT,
+            BENCH_COUNT / t / 1e6);
+    for(k = 0; k < BENCH_FANOUT; k++)
+        queue_free(q[k]);
+    if(f.b) broadcast_free(f.b);
+}
+
+/*
+* BENCH_TASKS empty tasks submitted from outside the pool, through the
+* injection queue, then as a binary tree of tasks submitting their
+* children from the workers, through the deques, for 1 up to
+* BENCH_WORKERS workers. the deques should scale with the workers as
+* long as each one has a core of its own.
+*/
+#define BENCH_TASKS (1 << 20)
+#define BENCH_WORKERS 8
+
+typedef struct {
+    channel_pool_t * pool;
+    int depth;
+} bench_task_t;
+
+static bench_task_t _bench_tree[32];
+
+static void _bench_task(void * arg){
+    bench_task_t * b = (bench_task_t*)arg;
+    if(b == NULL || b->depth == 0)
+        return;
+    channel_pool_submit(b->pool, _bench_task, &_bench_tree[b->depth - 1]);
+    channel_pool_submit(b->pool, _bench_task, &_bench_tree[b->depth - 1]);
+}
+
+static void _bench_channel_pool(unsigned int workers){
+    channel_pool_t * pool = channel_pool_new(workers, 0);
+    int i, depth = 19;
+    printf("%u workers\n", workers);
+    double t = _now();
+    for(i = 0; i < BENCH_TASKS; i++)
+        channel_pool_submit(pool, _bench_task, NULL);
+    channel_pool_wait(pool);
+    t = _now() - t;
+    printf("%-8s %10.2f Mtasks/s\n", "inject", BENCH_TASKS / t / 1e6);
+    for(i = 0; i <= depth; i++){
+        _bench_tree[i].pool = pool;
+        _bench_tree[i].depth = i;
+    }
+    t = _now();
+    channel_pool_submit(pool, _bench_task, &_bench_tree[depth]);
+    channel_pool_wait(pool);
+    t = _now() - t;
+    printf("%-8s %10.2f Mtasks/s\n", "deques",
+            ((1 << (depth + 1)) - 1) / t / 1e6);
+    channel_pool_free(pool);
+}
+
+/*
+* the layout the queues use for their two sides: one thread moves its
+* own index and reads the other thread's, either with both indices on
+* the same cache line or each on its own line as in buffer_t.
+* the gap only shows when the two threads run on different cores
+*/
+typedef struct {
+    atomic_size_t head;
+    atomic_size_t tail;
+} bench_packed_t;
+
+typedef struct {
+    atomic_size_t head cache_aligned;
+    atomic_size_t tail cache_aligned;
+} bench_padded_t;
+
+typedef struct {
+    atomic_size_t * mine;
+    atomic_size_t * other;
+    int cpu;
+} bench_side_t;
+
+void * _bench_side(void * data){
+    bench_side_t * s = (bench_side_t*)data;
+    size_t i, seen = 0;
+    _pin(s->cpu);
+    for(i = 0; i < BENCH_COUNT; i++){
+        atomic_store_explicit(s->mine, i, memory_order_release);
+        seen += atomic_load_explicit(s->other, memory_order_acquire);
+    }
+    return (void*)seen;
+}
+
+static void _bench_layout(const char * name, atomic_size_t * head,
+        atomic_size_t * tail)
+{
+    bench_side_t p = {head, tail, 0}, c = {tail, head, 1};
+    pthread_t tp, tc;
+    double t = _now();
+    pthread_create(&tp, NULL, &_bench_side, &p);
+    pthread_create(&tc, NULL, &_bench_side, &c);
+    pthread_join(tp, NULL);
+    pthread_join(tc, NULL);
+    t = _now() - t;
+    printf("%-6s %10.2f Mops/s\n", name, 2 * BENCH_COUNT / t / 1e6);
+}
+
+int main(int argc, char ** argv){
+    (void)argc;
+    (void)argv;
+    int batch;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpu < 2)
+        printf("single cpu: the threads share a core, the numbers "
+                "measure context switches, not cache traffic\n");
+    bench_packed_t packed = {0};
+    bench_padded_t padded = {0};
+    _bench_layout("packed", &packed.head, &packed.tail);
+    _bench_layout("padded", &padded.head, &padded.tail);
+    unsigned int arity;
+    for(batch = 0; batch < 2; batch++){
+        _bench("fifo", queue_new, batch);
+        _bench("spsc", queue_new_spsc, batch);
+        _bench("mpmc", queue_new_mpmc, batch);
+    }
+    for(arity = 2; arity <= 8; arity *= 2){
+        _bench_heap(sizeof(int), arity);
+        _bench_heap(256, arity);
+    }
+    printf("%d priorities:\n", BENCH_LEVELS);
+    _bench_bucketed(sizeof(int));
+    _bench_bucketed(256);
+    _bench_create("new", NULL);
+    _bench_create("pool", queue_pool_new(BENCH_QUEUE_SIZE, sizeof(int),
+                BENCH_LIVE));
+    unsigned int workers;
+    for(workers = 1; workers <= BENCH_WORKERS; workers *= 2)
+        _bench_channel_pool(workers);
+    _bench_fanout("queues", 0);
+    _bench_fanout("broadcast", 1);
+    _bench_bytes("padded", 0);
+    _bench_bytes("bytes", 1);
+    return 0;
+}
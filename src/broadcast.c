@@ -0,0 +1,351 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include "broadcast.h"
+#include "channel_impl.h"
+
+/*
+* head counts the positions claimed by the puts so far, a subscriber
+* has read every element before its cursor, the element i is in the
+* slot i % n.
+* every slot is a seqlock, its seq is 2*i + 1 while the element i is
+* written and 2*i + 2 once it is, so the subscribers read without any
+* lock and tell a slot not written yet from a slot overwritten since.
+* the elements are copied word by word with relaxed atomics, a copy
+* racing with an overwrite is thrown away.
+* tail caches the cursor of the slowest subscriber for
+* BROADCAST_BLOCK, it is only computed again, under mutex, by a put
+* that finds the ring full. subscribe and unsubscribe take the mutex
+* too, and subs_lock for writing: puts hold it for reading while they
+* wake up the subscribers and run their callbacks.
+*/
+typedef struct {
+    _Atomic uint64_t seq;
+    _Atomic uint64_t words[];
+}broadcast_slot_t;
+
+struct broadcast_st {
+    pthread_mutex_t mutex;
+    pthread_rwlock_t subs_lock;
+    broadcast_policy_t policy;
+    unsigned int n;
+    size_t size;
+    // size of a slot, the element is rounded up to whole words
+    size_t stride;
+    char * ring;
+    atomic_int closed;
+    unsigned int count;
+    // linked through pool_next
+    queue_t * subs;
+    _Atomic uint64_t head cache_aligned;
+    _Atomic uint64_t tail cache_aligned;
+    event_t full cache_aligned;
+};
+
+#define _broadcast_words(size) (((size) + 7) / 8)
+#define _broadcast_slot(b, i) \
+    ((broadcast_slot_t*)((b)->ring + ((i) % (b)->n)*(b)->stride))
+
+broadcast_t * broadcast_new(unsigned int n, size_t size,
+        broadcast_policy_t policy)
+{
+    broadcast_t * b;
+    unsigned int i;
+    if(n == 0 || size == 0)
+        return NULL;
+    if(posix_memalign((void**)&b, CACHE_LINE_SIZE, sizeof(broadcast_t)))
+        return NULL;
+    memset(b, 0, sizeof(broadcast_t));
+    b->stride = sizeof(broadcast_slot_t) + 8*_broadcast_words(size);
+    if(posix_memalign((void**)&b->ring, CACHE_LINE_SIZE, (size_t)n*b->stride))
+        goto error_ring;
+    if(pthread_mutex_init(&(b->mutex), NULL))
+        goto error_mutex;
+    if(pthread_rwlock_init(&(b->subs_lock), NULL))
+        goto error_rwlock;
+    if(event_init(&(b->full)))
+        goto error_event;
+    b->policy = policy;
+    b->n = n;
+    b->size = size;
+    for(i = 0; i < n; i++)
+        atomic_init(&_broadcast_slot(b, i)->seq, 0);
+    atomic_init(&b->head, 0);
+    atomic_init(&b->tail, 0);
+    atomic_init(&b->closed, 0);
+    return b;
+error_event:
+    pthread_rwlock_destroy(&(b->subs_lock));
+error_rwlock:
+    pthread_mutex_destroy(&(b->mutex));
+error_mutex:
+    free(b->ring);
+error_ring:
+    free(b);
+    return NULL;
+}
+
+queue_t * broadcast_subscribe(broadcast_t * b){
+    queue_t * q;
+    if(posix_memalign((void**)&q, CACHE_LINE_SIZE, sizeof(queue_t)))
+        return NULL;
+    memset(q, 0, sizeof(queue_t));
+    q->type = QUEUE_BROADCAST;
+    if(_queue_ctrl_init(&(q->ctrl)) != 0){
+        free(q);
+        return NULL;
+    }
+    q->broadcast = b;
+    atomic_init(&q->lagged, 0);
+    pthread_rwlock_wrlock(&(b->subs_lock));
+    pthread_mutex_lock(&(b->mutex));
+    /*
+    * the puts that claimed a position before head with an older tail
+    * only overwrite elements q never reads
+    */
+    atomic_init(&q->cursor, atomic_load(&b->head));
+    if(atomic_load(&b->closed))
+        atomic_store(&q->ctrl.closed, 1);
+    q->pool_next = b->subs;
+    b->subs = q;
+    b->count++;
+    pthread_mutex_unlock(&(b->mutex));
+    pthread_rwlock_unlock(&(b->subs_lock));
+    return q;
+}
+
+// the mutex must be held
+static void _broadcast_min_cursor(broadcast_t * b){
+    queue_t * q;
+    uint64_t tail = atomic_load(&b->head), cursor;
+    for(q = b->subs; q; q = q->pool_next)
+        if((cursor = atomic_load(&q->cursor)) < tail)
+            tail = cursor;
+    atomic_store(&b->tail, tail);
+}
+
+// nobody else uses a subscriber being freed
+void _broadcast_unsubscribe(queue_t * q){
+    broadcast_t * b = q->broadcast;
+    queue_t ** p;
+    pthread_rwlock_wrlock(&(b->subs_lock));
+    pthread_mutex_lock(&(b->mutex));
+    for(p = &b->subs; *p != q; p = &(*p)->pool_next);
+    *p = q->pool_next;
+    b->count--;
+    //it may have been the slowest one
+    _broadcast_min_cursor(b);
+    pthread_mutex_unlock(&(b->mutex));
+    pthread_rwlock_unlock(&(b->subs_lock));
+    event_notify(&(b->full), EVENT_ALL);
+}
+
+/*
+* returns 1 if the position h can be written, the cursor of the
+* slowest subscriber is computed again when the cached one says the
+* ring is full
+*/
+static int _broadcast_room(broadcast_t * b, uint64_t h){
+    if(b->policy == BROADCAST_OVERWRITE ||
+            h - atomic_load(&b->tail) < b->n)
+        return 1;
+    pthread_mutex_lock(&(b->mutex));
+    _broadcast_min_cursor(b);
+    pthread_mutex_unlock(&(b->mutex));
+    return h - atomic_load(&b->tail) < b->n;
+}
+
+static void _broadcast_write(broadcast_t * b, uint64_t h, void * data){
+    broadcast_slot_t * slot = _broadcast_slot(b, h);
+    uint64_t prev = h >= b->n ? 2*(h - b->n) + 2 : 0;
+    size_t i, words = _broadcast_words(b->size);
+    uint64_t w;
+    //the put of the previous lap may still be writing the slot
+    while(atomic_load_explicit(&slot->seq, memory_order_acquire) < prev)
+        sched_yield();
+    atomic_store_explicit(&slot->seq, 2*h + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for(i = 0; i < words; i++){
+        w = 0;
+        memcpy(&w, (char*)data + 8*i, i + 1 < words ? 8 : b->size - 8*i);
+        atomic_store_explicit(&slot->words[i], w, memory_order_relaxed);
+    }
+    atomic_store_explicit(&slot->seq, 2*h + 2, memory_order_release);
+}
+
+static int _broadcast_put(broadcast_t * b, void * data,
+        const struct timespec * abstime, int block)
+{
+    int err;
+    queue_t * q;
+    uint64_t h = atomic_load(&b->head);
+    while(1){
+        if(atomic_load(&b->closed))
+            return EPIPE;
+        if(_broadcast_room(b, h)){
+            if(atomic_compare_exchange_weak(&b->head, &h, h + 1))
+                break;
+            continue;
+        }
+        if(!block)
+            return EAGAIN;
+        // the subscribers notify full after they moved their cursor
+        unsigned int key = event_prepare_wait(&(b->full));
+        if(_broadcast_room(b, h) || atomic_load(&b->closed)){
+            event_cancel_wait(&(b->full));
+        }else if((err = event_wait(&(b->full), key, abstime)) != 0)
+            return err;
+        h = atomic_load(&b->head);
+    }
+    _broadcast_write(b, h, data);
+    pthread_rwlock_rdlock(&(b->subs_lock));
+    for(q = b->subs; q; q = q->pool_next)
+        _lf_notify_not_empty(q, 1);
+    pthread_rwlock_unlock(&(b->subs_lock));
+    return 0;
+}
+
+int broadcast_put(broadcast_t * b, void * data){
+    return _broadcast_put(b, data, NULL, 1);
+}
+
+int broadcast_try_put(broadcast_t * b, void * data){
+    return _broadcast_put(b, data, NULL, 0);
+}
+
+int broadcast_put_for(broadcast_t * b, void * data, uint64_t nsec){
+    struct timespec ts;
+    queue_deadline(&ts, nsec);
+    return _broadcast_put(b, data, &ts, 1);
+}
+
+int broadcast_put_until(broadcast_t * b, void * data,
+        const struct timespec * deadline)
+{
+    return _broadcast_put(b, data, deadline, 1);
+}
+
+// a position claimed by a put is only used once its element is written
+unsigned int _broadcast_used(queue_t * q){
+    broadcast_t * b = q->broadcast;
+    uint64_t cursor = atomic_load(&q->cursor);
+    uint64_t used = atomic_load(&b->head) - cursor;
+    if(used == 0 || atomic_load_explicit(&_broadcast_slot(b, cursor)->seq,
+                memory_order_acquire) < 2*cursor + 2)
+        return 0;
+    return used > b->n ? b->n : (unsigned int)used;
+}
+
+/*
+* copies the element c out of its slot.
+* returns 1 if it was copied, 0 if it is not written yet and -1 if it
+* was overwritten
+*/
+static int _broadcast_copy(broadcast_t * b, uint64_t c, void * data){
+    broadcast_slot_t * slot = _broadcast_slot(b, c);
+    size_t i, words = _broadcast_words(b->size);
+    uint64_t w, seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if(seq != 2*c + 2)
+        return seq < 2*c + 2 ? 0 : -1;
+    for(i = 0; i < words; i++){
+        w = atomic_load_explicit(&slot->words[i], memory_order_relaxed);
+        memcpy((char*)data + 8*i, &w, i + 1 < words ? 8 : b->size - 8*i);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq ?
+        1 : -1;
+}
+
+/*
+* copies up to n elements at the cursor of q then moves the cursor past
+* them, over again if another thread taking from q moved it first. a
+* subscriber left behind skips to the oldest element still in the ring.
+* returns the number of elements copied
+*/
+static unsigned int _broadcast_read(queue_t * q, void * data,
+        unsigned int n)
+{
+    broadcast_t * b = q->broadcast;
+    uint64_t c = atomic_load(&q->cursor), oldest;
+    unsigned int i;
+    int res;
+    while(1){
+        res = 1;
+        for(i = 0; i < n; i++)
+            if((res = _broadcast_copy(b, c + i, (char*)data + i*b->size)) <= 0)
+                break;
+        if(i == 0 && res < 0){
+            oldest = atomic_load(&b->head) - b->n;
+            if(atomic_compare_exchange_weak(&q->cursor, &c, oldest)){
+                atomic_fetch_add(&q->lagged, oldest - c);
+                c = oldest;
+            }
+            continue;
+        }
+        if(i == 0)
+            return 0;
+        if(atomic_compare_exchange_weak(&q->cursor, &c, c + i))
+            break;
+    }
+    // q may have been the slowest subscriber
+    if(b->policy == BROADCAST_BLOCK)
+        event_notify(&(b->full), EVENT_ALL);
+    return i;
+}
+
+/*
+* like the lock free queues, the subscribers never take their own
+* mutex, the waiter registers on the event then checks the ring again
+* before spinning and sleeping. the closed flag is read before the ring, see
+* _lf_queue_take
+*/
+int _broadcast_take(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken, struct timespec * abstime, int block)
+{
+    int err;
+    int closed = _queue_closed(q);
+    while((*taken = _broadcast_read(q, data, n)) == 0){
+        if(closed)
+            return EPIPE;
+        if(!block)
+            return EAGAIN;
+        unsigned int key = event_prepare_wait(&q->ctrl.empty);
+        if(_broadcast_used(q) > 0 || _queue_closed(q)){
+            event_cancel_wait(&q->ctrl.empty);
+        }else if((err = _spin_then_wait(&q->ctrl, &q->ctrl.empty, key,
+                        abstime)) != 0)
+            return err;
+        closed = _queue_closed(q);
+    }
+    return 0;
+}
+
+uint64_t broadcast_lagged(queue_t * q){
+    return atomic_exchange(&q->lagged, 0);
+}
+
+int broadcast_close(broadcast_t * b){
+    queue_t * q;
+    pthread_rwlock_rdlock(&(b->subs_lock));
+    atomic_store(&b->closed, 1);
+    event_notify(&(b->full), EVENT_ALL);
+    for(q = b->subs; q; q = q->pool_next)
+        queue_close(q);
+    pthread_rwlock_unlock(&(b->subs_lock));
+    return 0;
+}
+
+int broadcast_free(broadcast_t * b){
+    pthread_mutex_lock(&(b->mutex));
+    if(b->count){
+        pthread_mutex_unlock(&(b->mutex));
+        return EBUSY;
+    }
+    pthread_mutex_unlock(&(b->mutex));
+    event_destroy(&(b->full));
+    pthread_rwlock_destroy(&(b->subs_lock));
+    pthread_mutex_destroy(&(b->mutex));
+    free(b->ring);
+    free(b);
+    return 0;
+}
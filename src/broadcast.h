@@ -0,0 +1,75 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include "channel.h"
+
+/*
+* one to many channel: every element put in a broadcast is copied
+* once into its ring and read by every subscriber through its own
+* cursor, putting costs the same whatever the number of subscribers.
+* the subscribers are queues, they are read with queue_take,
+* queue_try_take (and their timed versions), queue_take_many and
+* queue_try_take_many, and can be passed to the select functions,
+* the selectors, the callbacks and the eventfds waiting for them not
+* to be empty. puts, reserves and queue_reset return EINVAL on them.
+*/
+typedef struct broadcast_st broadcast_t;
+
+typedef enum{
+    // puts wait for the slowest subscriber to make room
+    BROADCAST_BLOCK = 0,
+    /*
+    * puts never wait, they overwrite the oldest element, subscribers
+    * left behind by more than n elements skip to the oldest element
+    * still in the ring
+    */
+    BROADCAST_OVERWRITE = 1,
+}broadcast_policy_t;
+
+/*
+* allocates a broadcast holding the last n elements of size size.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+broadcast_t * broadcast_new(unsigned int n, size_t size,
+        broadcast_policy_t policy);
+/*
+* returns a new subscriber of b, it receives the elements put after
+* it subscribed. queue_free unsubscribes it.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+queue_t * broadcast_subscribe(broadcast_t * b);
+/*
+* copies data to every subscriber. with BROADCAST_BLOCK the put
+* functions wait until the slowest subscriber took the element n
+* places behind, the try put returns EAGAIN instead.
+* the callbacks of the subscribers run inside the put, with the list
+* of subscribers locked for reading: they may take from the
+* subscribers and put, but calling broadcast_subscribe, or queue_free
+* on a subscriber, of the same broadcast deadlocks.
+* returns 0 when the operation is succesful
+* returns EPIPE if b is closed
+*/
+int broadcast_put(broadcast_t * b, void * data);
+int broadcast_try_put(broadcast_t * b, void * data);
+int broadcast_put_for(broadcast_t * b, void * data, uint64_t nsec);
+int broadcast_put_until(broadcast_t * b, void * data,
+        const struct timespec * deadline);
+/*
+* returns the number of elements the subscriber q missed because they
+* were overwritten since the last call, always 0 with BROADCAST_BLOCK
+*/
+uint64_t broadcast_lagged(queue_t * q);
+/*
+* closes b and every subscriber, their elements left can still be
+* taken, see queue_close.
+* returns 0 when the operation is succesful
+*/
+int broadcast_close(broadcast_t * b);
+/*
+* frees b, its subscribers must have been freed already.
+* returns 0 when the operation is succesful
+* returns EBUSY if b still has subscribers
+*/
+int broadcast_free(broadcast_t * b);
+
+#endif
@@ -1,32 +1,246 @@
 #include <assert.h>
+#include <stddef.h>
+#include <limits.h>
 #include "buffer.h"
+#if defined(__SSE4_1__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-typedef struct {
-    int priority;
-    char value[];
-}heap_node_t;
+
+/*
+* the children of entry i are entries arity*i + 1 to arity*i + arity,
+* prio is shifted by HEAP_PAD ints from a cache line boundary so that
+* each group of children starts on a boundary of its own size
+*/
+#define HEAP_PAD (CACHE_LINE_SIZE/sizeof(int) - 1)
 
 int buffer_init(buffer_t * r_buf, 
 	unsigned int n, size_t size,
         buffer_type_t type){
-    calloc_(r_buf->buffer, n, size);
+    void * mem;
+    int err = aligned_calloc(&mem, n,
+            type == MPMC_BUFFER ? mpmc_stride(size) : size);
+    if(err != 0)
+        return err;
+    return buffer_init_at(r_buf, mem, n, size, type);
+}
+
+int buffer_init_at(buffer_t * r_buf, void * mem,
+        unsigned int n, size_t size, buffer_type_t type)
+{
+    r_buf->buffer = mem;
+    if(type == MPMC_BUFFER){
+        unsigned int i;
+        for(i = 0; i < n; i++)
+            atomic_init(&((mpmc_slot_t*)&r_buf->buffer[i*mpmc_stride(size)])->seq, i);
+    }
     r_buf->type = type;
     r_buf->n = n;
+    r_buf->mask = n > 1 && (n & (n - 1)) == 0 ? n - 1 : 0;
     r_buf->size = size;
     r_buf->start = 0;
     r_buf->end = 0;
     r_buf->used = 0;
+    r_buf->write_reserved = 0;
+    r_buf->read_reserved = 0;
+    r_buf->bytes = 0;
+    r_buf->arity = 0;
+    r_buf->prio = NULL;
+    r_buf->heap_slot = NULL;
+    r_buf->heap_seq = NULL;
+    r_buf->next_seq = 0;
+    r_buf->free_slots = NULL;
+    r_buf->levels = 0;
+    r_buf->bucket_bits = 0;
+    r_buf->bucket_next = NULL;
+    r_buf->bucket_head = NULL;
+    r_buf->bucket_tail = NULL;
+    r_buf->seg_n = 0;
+    r_buf->seg_shift = 0;
+    r_buf->soft = 0;
+    r_buf->seg_count = 0;
+    r_buf->cap = n;
+    r_buf->idx_cap = n;
+    r_buf->seg_head = NULL;
+    r_buf->seg_tail = NULL;
+    r_buf->seg_spare = NULL;
+    r_buf->segs = NULL;
+    atomic_init(&r_buf->prod.head, 0);
+    atomic_init(&r_buf->cons.tail, 0);
+    r_buf->prod.tail_cache = 0;
+    r_buf->cons.head_cache = 0;
+    return 0;
+}
+
+/*
+* segments hold the largest power of two number of elements that fits
+* in SEGMENT_DATA_SIZE, at least one
+*/
+static void _seg_setup(buffer_t * buf, unsigned int soft,
+        unsigned int hard)
+{
+    buf->n = hard ? hard : UINT_MAX;
+    buf->seg_shift = 0;
+    while(((size_t)2 << buf->seg_shift)*buf->size <= SEGMENT_DATA_SIZE &&
+            buf->seg_shift < 16)
+        buf->seg_shift++;
+    buf->seg_n = 1U << buf->seg_shift;
+    buf->soft = soft;
+    buf->cap = 0;
+    buf->idx_cap = 0;
+}
+
+#define _seg_bytes(buf) ((size_t)(buf)->seg_n*(buf)->size)
+// number of segments kept once the buffer is drained
+#define _seg_keep(buf) (((buf)->soft >> (buf)->seg_shift) + \
+        (((buf)->soft & ((buf)->seg_n - 1)) != 0))
+
+int buffer_init_growable(buffer_t * rb, unsigned int soft,
+        unsigned int hard, size_t size)
+{
+    //the elements live in the segments, buffer stays NULL
+    buffer_init_at(rb, NULL, 0, size, RING_BUFFER);
+    _seg_setup(rb, soft, hard);
     return 0;
 }
 
+static segment_t * _seg_get(buffer_t * rb){
+    segment_t * s = rb->seg_spare;
+    if(s != NULL){
+        rb->seg_spare = s->next;
+        s->next = NULL;
+        return s;
+    }
+    if((s = segment_alloc(_seg_bytes(rb))) != NULL)
+        rb->seg_count++;
+    return s;
+}
+
+static void _seg_put(buffer_t * rb, segment_t * s){
+    if(rb->seg_count > _seg_keep(rb)){
+        segment_free(s, _seg_bytes(rb));
+        rb->seg_count--;
+    }else{
+        s->next = rb->seg_spare;
+        rb->seg_spare = s;
+    }
+}
+
+// slot at the write position, NULL if no segment can be allocated
+static char * _seg_write_slot(buffer_t * rb){
+    if(rb->seg_tail == NULL || rb->start == rb->seg_n){
+        segment_t * s = _seg_get(rb);
+        if(s == NULL)
+            return NULL;
+        if(rb->seg_tail == NULL){
+            rb->seg_head = s;
+            rb->end = 0;
+        }else
+            rb->seg_tail->next = s;
+        rb->seg_tail = s;
+        rb->start = 0;
+    }
+    return segment_data(rb->seg_tail) + rb->start*rb->size;
+}
+
+// slot at the read position, the ring must not be empty
+static char * _seg_read_slot(buffer_t * rb){
+    if(rb->end == rb->seg_n){
+        segment_t * s = rb->seg_head;
+        rb->seg_head = s->next;
+        rb->end = 0;
+        _seg_put(rb, s);
+    }
+    return segment_data(rb->seg_head) + rb->end*rb->size;
+}
+
+/*
+* once the ring is empty (and no slot is reserved) the last segment
+* is reused from its start, or given back with soft == 0
+*/
+static void _seg_drained(buffer_t * rb){
+    if(rb->used || rb->write_reserved || rb->read_reserved)
+        return;
+    assert(rb->seg_head == rb->seg_tail);
+    if(_seg_keep(rb) == 0){
+        _seg_put(rb, rb->seg_head);
+        rb->seg_head = rb->seg_tail = NULL;
+    }
+    rb->start = rb->end = 0;
+}
+
+static int _seg_write(buffer_t * rb, void * data){
+    if(rb_available(rb) == 0 || rb->write_reserved)
+        return 0;
+    char * slot = _seg_write_slot(rb);
+    if(slot == NULL)
+        return 0;
+    buffer_copy(slot, data, rb->size);
+    rb->start++;
+    rb->used++;
+    return 1;
+}
+
+static int _seg_take(buffer_t * rb, void * data){
+    if(rb_has_next(rb) == 0 || rb->read_reserved)
+        return 0;
+    buffer_copy(data, _seg_read_slot(rb), rb->size);
+    rb->end++;
+    rb->used--;
+    _seg_drained(rb);
+    return 1;
+}
+
+static unsigned int _seg_write_many(buffer_t * rb, char * data,
+        unsigned int n)
+{
+    unsigned int k = 0, avail = rb->write_reserved ? 0 : rb_available(rb);
+    if(n > avail) n = avail;
+    while(k < n){
+        char * slot = _seg_write_slot(rb);
+        if(slot == NULL)
+            break;
+        unsigned int c = rb->seg_n - rb->start;
+        if(c > n - k) c = n - k;
+        memcpy(slot, data + (size_t)k*rb->size, (size_t)c*rb->size);
+        rb->start += c;
+        rb->used += c;
+        k += c;
+    }
+    return k;
+}
+
+static unsigned int _seg_take_many(buffer_t * rb, char * data,
+        unsigned int n)
+{
+    unsigned int k = 0, avail = rb->read_reserved ? 0 : rb_has_next(rb);
+    if(n > avail) n = avail;
+    while(k < n){
+        char * slot = _seg_read_slot(rb);
+        unsigned int c = rb->seg_n - rb->end;
+        if(c > n - k) c = n - k;
+        memcpy(data + (size_t)k*rb->size, slot, (size_t)c*rb->size);
+        rb->end += c;
+        rb->used -= c;
+        k += c;
+    }
+    if(k) _seg_drained(rb);
+    return k;
+}
+
 int rb_write(buffer_t * rb, void * data, int _priority){
     (void)_priority;
     assert(rb->type == RING_BUFFER);
-    if(rb_available(rb) > 0) {
-	memmove(rb->buffer + rb->start*rb->size,
+    if(rb->seg_n)
+        return _seg_write(rb, data);
+    if(rb_available(rb) > 0 && !rb->write_reserved) {
+	buffer_copy(rb->buffer + rb->start*rb->size,
 		data, rb->size);
         rb->used += 1;
-        rb->start = (rb->start + 1) % rb->n;
+        rb->start = rb_wrap(rb, rb->start, 1);
         return 1;
     }
     return 0;
@@ -34,109 +248,832 @@ int rb_write(buffer_t * rb, void * data, int _priority){
 
 int rb_take(buffer_t * rb, void * data){
     assert(rb->type == RING_BUFFER);
-    if(rb_has_next(rb) > 0){
+    if(rb->seg_n)
+        return _seg_take(rb, data);
+    if(rb_has_next(rb) > 0 && !rb->read_reserved){
         int end = rb->end;
-        rb->end = (rb->end + 1) % rb->n;
+        rb->end = rb_wrap(rb, rb->end, 1);
         rb->used -= 1;
-	memmove(data, rb->buffer + end*rb->size,
+	buffer_copy(data, rb->buffer + end*rb->size,
 		rb->size);
         return 1;
     }
     return 0;
 }
 
+/*
+* copies k elements in or out of the ring starting at slot pos,
+* with one memcpy per contiguous segment
+*/
+static inline void _rb_copy_in(buffer_t * rb, unsigned int pos,
+        char * data, unsigned int k)
+{
+    unsigned int first = rb->n - pos;
+    if(first > k) first = k;
+    memcpy(rb->buffer + pos*rb->size, data, first*rb->size);
+    memcpy(rb->buffer, data + first*rb->size, (k - first)*rb->size);
+}
+
+static inline void _rb_copy_out(buffer_t * rb, unsigned int pos,
+        char * data, unsigned int k)
+{
+    unsigned int first = rb->n - pos;
+    if(first > k) first = k;
+    memcpy(data, rb->buffer + pos*rb->size, first*rb->size);
+    memcpy(data + first*rb->size, rb->buffer, (k - first)*rb->size);
+}
+
+unsigned int rb_write_many(buffer_t * rb, void * data,
+        int * _priorities, unsigned int n)
+{
+    (void)_priorities;
+    assert(rb->type == RING_BUFFER);
+    if(rb->seg_n)
+        return _seg_write_many(rb, data, n);
+    unsigned int k = rb->write_reserved ? 0 : rb_available(rb);
+    if(k > n) k = n;
+    if(k == 0) return 0;
+    _rb_copy_in(rb, rb->start, data, k);
+    rb->used += k;
+    rb->start = rb_wrap(rb, rb->start, k);
+    return k;
+}
+
+unsigned int rb_take_many(buffer_t * rb, void * data, unsigned int n){
+    assert(rb->type == RING_BUFFER);
+    if(rb->seg_n)
+        return _seg_take_many(rb, data, n);
+    unsigned int k = rb->read_reserved ? 0 : rb_has_next(rb);
+    if(k > n) k = n;
+    if(k == 0) return 0;
+    _rb_copy_out(rb, rb->end, data, k);
+    rb->used -= k;
+    rb->end = rb_wrap(rb, rb->end, k);
+    return k;
+}
+
+/*
+* in place access to the ring, only one slot can be reserved on each
+* side at a time, the other writers (or readers) see the ring as full
+* (or empty) until the slot is committed (or released)
+*/
+void * rb_reserve(buffer_t * rb){
+    assert(rb->type == RING_BUFFER);
+    if(rb_available(rb) == 0 || rb->write_reserved)
+        return NULL;
+    if(rb->seg_n){
+        char * slot = _seg_write_slot(rb);
+        rb->write_reserved = slot != NULL;
+        return slot;
+    }
+    rb->write_reserved = 1;
+    return rb->buffer + rb->start*rb->size;
+}
+
+void rb_commit(buffer_t * rb, void * slot){
+    if(rb->seg_n){
+        assert(rb->write_reserved && slot ==
+                segment_data(rb->seg_tail) + rb->start*rb->size);
+        rb->write_reserved = 0;
+        rb->used += 1;
+        rb->start += 1;
+        return;
+    }
+    assert(rb->write_reserved &&
+            slot == rb->buffer + rb->start*rb->size);
+    (void)slot;
+    rb->write_reserved = 0;
+    rb->used += 1;
+    rb->start = rb_wrap(rb, rb->start, 1);
+}
+
+void * rb_peek(buffer_t * rb){
+    assert(rb->type == RING_BUFFER);
+    if(rb_has_next(rb) == 0 || rb->read_reserved)
+        return NULL;
+    rb->read_reserved = 1;
+    if(rb->seg_n)
+        return _seg_read_slot(rb);
+    return rb->buffer + rb->end*rb->size;
+}
+
+void rb_release(buffer_t * rb, void * slot){
+    if(rb->seg_n){
+        assert(rb->read_reserved && slot ==
+                segment_data(rb->seg_head) + rb->end*rb->size);
+        rb->read_reserved = 0;
+        rb->used -= 1;
+        rb->end += 1;
+        _seg_drained(rb);
+        return;
+    }
+    assert(rb->read_reserved &&
+            slot == rb->buffer + rb->end*rb->size);
+    (void)slot;
+    rb->read_reserved = 0;
+    rb->used -= 1;
+    rb->end = rb_wrap(rb, rb->end, 1);
+}
+
+int spsc_write(buffer_t * rb, void * data, int _priority){
+    (void)_priority;
+    assert(rb->type == SPSC_BUFFER);
+    size_t head = atomic_load_explicit(&rb->prod.head,
+            memory_order_relaxed);
+    if(head - rb->prod.tail_cache >= rb->n){
+        rb->prod.tail_cache = atomic_load_explicit(&rb->cons.tail,
+                memory_order_acquire);
+        if(head - rb->prod.tail_cache >= rb->n)
+            return 0;
+    }
+    buffer_copy(rb->buffer + (head % rb->n)*rb->size, data, rb->size);
+    atomic_store_explicit(&rb->prod.head, head + 1,
+            memory_order_release);
+    return 1;
+}
+
+int spsc_take(buffer_t * rb, void * data){
+    assert(rb->type == SPSC_BUFFER);
+    size_t tail = atomic_load_explicit(&rb->cons.tail,
+            memory_order_relaxed);
+    if(rb->cons.head_cache == tail){
+        rb->cons.head_cache = atomic_load_explicit(&rb->prod.head,
+                memory_order_acquire);
+        if(rb->cons.head_cache == tail)
+            return 0;
+    }
+    buffer_copy(data, rb->buffer + (tail % rb->n)*rb->size, rb->size);
+    atomic_store_explicit(&rb->cons.tail, tail + 1,
+            memory_order_release);
+    return 1;
+}
+
+void * spsc_reserve(buffer_t * rb){
+    assert(rb->type == SPSC_BUFFER);
+    size_t head = atomic_load_explicit(&rb->prod.head,
+            memory_order_relaxed);
+    if(head - rb->prod.tail_cache >= rb->n){
+        rb->prod.tail_cache = atomic_load_explicit(&rb->cons.tail,
+                memory_order_acquire);
+        if(head - rb->prod.tail_cache >= rb->n)
+            return NULL;
+    }
+    return rb->buffer + (head % rb->n)*rb->size;
+}
+
+void spsc_commit(buffer_t * rb, void * slot){
+    (void)slot;
+    size_t head = atomic_load_explicit(&rb->prod.head,
+            memory_order_relaxed);
+    atomic_store_explicit(&rb->prod.head, head + 1,
+            memory_order_release);
+}
+
+void * spsc_peek(buffer_t * rb){
+    assert(rb->type == SPSC_BUFFER);
+    size_t tail = atomic_load_explicit(&rb->cons.tail,
+            memory_order_relaxed);
+    if(rb->cons.head_cache == tail){
+        rb->cons.head_cache = atomic_load_explicit(&rb->prod.head,
+                memory_order_acquire);
+        if(rb->cons.head_cache == tail)
+            return NULL;
+    }
+    return rb->buffer + (tail % rb->n)*rb->size;
+}
+
+void spsc_release(buffer_t * rb, void * slot){
+    (void)slot;
+    size_t tail = atomic_load_explicit(&rb->cons.tail,
+            memory_order_relaxed);
+    atomic_store_explicit(&rb->cons.tail, tail + 1,
+            memory_order_release);
+}
+
+unsigned int spsc_write_many(buffer_t * rb, void * data,
+        int * _priorities, unsigned int n)
+{
+    (void)_priorities;
+    assert(rb->type == SPSC_BUFFER);
+    size_t head = atomic_load_explicit(&rb->prod.head,
+            memory_order_relaxed);
+    if(head - rb->prod.tail_cache + n > rb->n)
+        rb->prod.tail_cache = atomic_load_explicit(&rb->cons.tail,
+                memory_order_acquire);
+    unsigned int k = rb->n - (head - rb->prod.tail_cache);
+    if(k > n) k = n;
+    if(k == 0) return 0;
+    _rb_copy_in(rb, head % rb->n, data, k);
+    atomic_store_explicit(&rb->prod.head, head + k,
+            memory_order_release);
+    return k;
+}
+
+unsigned int spsc_take_many(buffer_t * rb, void * data, unsigned int n){
+    assert(rb->type == SPSC_BUFFER);
+    size_t tail = atomic_load_explicit(&rb->cons.tail,
+            memory_order_relaxed);
+    if(rb->cons.head_cache - tail < n)
+        rb->cons.head_cache = atomic_load_explicit(&rb->prod.head,
+                memory_order_acquire);
+    unsigned int k = rb->cons.head_cache - tail;
+    if(k > n) k = n;
+    if(k == 0) return 0;
+    _rb_copy_out(rb, tail % rb->n, data, k);
+    atomic_store_explicit(&rb->cons.tail, tail + k,
+            memory_order_release);
+    return k;
+}
+
+int mpmc_write(buffer_t * rb, void * data, int _priority){
+    (void)_priority;
+    assert(rb->type == MPMC_BUFFER);
+    mpmc_slot_t * slot = mpmc_claim(rb, &rb->prod.head, 0);
+    if(slot == NULL) return 0;
+    buffer_copy(slot->value, data, rb->size);
+    mpmc_publish(slot, 1);
+    return 1;
+}
+
+int mpmc_take(buffer_t * rb, void * data){
+    assert(rb->type == MPMC_BUFFER);
+    mpmc_slot_t * slot = mpmc_claim(rb, &rb->cons.tail, 1);
+    if(slot == NULL) return 0;
+    buffer_copy(data, slot->value, rb->size);
+    mpmc_publish(slot, rb->n - 1);
+    return 1;
+}
+
+void * mpmc_reserve(buffer_t * rb){
+    assert(rb->type == MPMC_BUFFER);
+    mpmc_slot_t * slot = mpmc_claim(rb, &rb->prod.head, 0);
+    return slot ? slot->value : NULL;
+}
+
+void mpmc_commit(buffer_t * rb, void * slot){
+    (void)rb;
+    mpmc_publish((mpmc_slot_t*)((char*)slot - sizeof(mpmc_slot_t)), 1);
+}
+
+void * mpmc_peek(buffer_t * rb){
+    assert(rb->type == MPMC_BUFFER);
+    mpmc_slot_t * slot = mpmc_claim(rb, &rb->cons.tail, 1);
+    return slot ? slot->value : NULL;
+}
+
+void mpmc_release(buffer_t * rb, void * slot){
+    mpmc_publish((mpmc_slot_t*)((char*)slot - sizeof(mpmc_slot_t)),
+            rb->n - 1);
+}
+
+/*
+* slots may be released out of order by concurrent consumers, so
+* MPMC batches are claimed one slot at a time, they still save the
+* notification cost on the queue side
+*/
+unsigned int mpmc_write_many(buffer_t * rb, void * data,
+        int * _priorities, unsigned int n)
+{
+    (void)_priorities;
+    unsigned int k;
+    for(k = 0; k < n; k++)
+        if(!mpmc_write(rb, (char*)data + k*rb->size, 0))
+            break;
+    return k;
+}
+
+unsigned int mpmc_take_many(buffer_t * rb, void * data, unsigned int n){
+    unsigned int k;
+    for(k = 0; k < n; k++)
+        if(!mpmc_take(rb, (char*)data + k*rb->size))
+            break;
+    return k;
+}
+
+/*
+* number of elements in a lock free ring
+* may be called from any thread, the result is only a snapshot
+*/
+unsigned int lf_used(buffer_t * rb){
+    size_t tail = atomic_load_explicit(&rb->cons.tail,
+            memory_order_acquire);
+    size_t head = atomic_load_explicit(&rb->prod.head,
+            memory_order_acquire);
+    //with several consumers tail may move between the two loads
+    if(head - tail > rb->n)
+        return rb->n;
+    return head - tail;
+}
+
+static void _hb_shrink(buffer_t * hb);
+
+void buffer_reset(buffer_t * rb){
+    unsigned int i;
+    assert(!rb->write_reserved && !rb->read_reserved);
+    switch(rb->type){
+    case RING_BUFFER:
+        while(rb->seg_head){
+            segment_t * s = rb->seg_head;
+            rb->seg_head = s->next;
+            _seg_put(rb, s);
+        }
+        rb->seg_tail = NULL;
+        break;
+    case HEAP_BUFFER:
+    case BUCKET_BUFFER:
+        if(rb->seg_n){
+            rb->used = 0;
+            _hb_shrink(rb);
+        }
+        for(i = 0; i < rb->cap; i++)
+            rb->free_slots[i] = i;
+        rb->bucket_bits = 0;
+        break;
+    case MPMC_BUFFER:
+        for(i = 0; i < rb->n; i++)
+            atomic_store(&((mpmc_slot_t*)&rb->buffer[i*mpmc_stride(rb->size)])->seq, i);
+        break;
+    default:
+        break;
+    }
+    rb->used = 0;
+    rb->start = 0;
+    rb->end = 0;
+    rb->bytes = 0;
+    atomic_store(&rb->prod.head, 0);
+    atomic_store(&rb->cons.tail, 0);
+    rb->prod.tail_cache = 0;
+    rb->cons.head_cache = 0;
+}
+
+#define BYTES_WRAP UINT32_MAX
+
+int bytes_init(buffer_t * rb, unsigned int n){
+    void * mem;
+    int err;
+    n = (n + BYTES_ALIGN - 1) & ~(BYTES_ALIGN - 1);
+    if(n < bytes_record(1))
+        return EINVAL;
+    if((err = aligned_calloc(&mem, n, 1)) != 0)
+        return err;
+    return buffer_init_at(rb, mem, n, 1, BYTES_BUFFER);
+}
+
+int bytes_write(buffer_t * rb, const void * data, size_t len){
+    assert(rb->type == BYTES_BUFFER);
+    size_t need = bytes_record(len);
+    unsigned int pad = 0, w;
+    uint32_t header = len;
+    if(len >= BYTES_WRAP || need > rb->n)
+        return 0;
+    if(rb->used == 0)
+        rb->start = rb->end = 0;
+    w = rb->start;
+    if(w + need > rb->n)
+        pad = rb->n - w;
+    if(rb->n - rb->bytes < pad + need)
+        return 0;
+    if(pad){
+        header = BYTES_WRAP;
+        memcpy(rb->buffer + w, &header, sizeof(header));
+        header = len;
+        w = 0;
+    }
+    memcpy(rb->buffer + w, &header, sizeof(header));
+    memcpy(rb->buffer + w + BYTES_HEADER, data, len);
+    w += need;
+    rb->start = w == rb->n ? 0 : w;
+    rb->bytes += pad + need;
+    rb->used++;
+    return 1;
+}
+
+void * bytes_peek(buffer_t * rb, size_t * len){
+    assert(rb->type == BYTES_BUFFER);
+    uint32_t header;
+    if(rb->used == 0 || rb->read_reserved)
+        return NULL;
+    memcpy(&header, rb->buffer + rb->end, sizeof(header));
+    if(header == BYTES_WRAP){
+        rb->bytes -= rb->n - rb->end;
+        rb->end = 0;
+        memcpy(&header, rb->buffer, sizeof(header));
+    }
+    rb->read_reserved = 1;
+    *len = header;
+    return rb->buffer + rb->end + BYTES_HEADER;
+}
+
+void bytes_release(buffer_t * rb){
+    uint32_t header;
+    assert(rb->type == BYTES_BUFFER && rb->read_reserved);
+    memcpy(&header, rb->buffer + rb->end, sizeof(header));
+    size_t need = bytes_record(header);
+    rb->read_reserved = 0;
+    rb->end += need;
+    if(rb->end == rb->n)
+        rb->end = 0;
+    rb->bytes -= need;
+    rb->used--;
+}
+
 void buffer_free(buffer_t * rb){
+    segment_t * s;
+    while((s = rb->seg_head) != NULL || (s = rb->seg_spare) != NULL){
+        if(s == rb->seg_head)
+            rb->seg_head = s->next;
+        else
+            rb->seg_spare = s->next;
+        segment_free(s, _seg_bytes(rb));
+    }
+    while(rb->seg_count > 0 && rb->segs)
+        segment_free(rb->segs[--rb->seg_count], _seg_bytes(rb));
+    free(rb->segs);
+    rb->segs = NULL;
+    rb->seg_tail = NULL;
+    rb->seg_count = 0;
+    rb->seg_n = 0;
     free(rb->buffer);
+    if(rb->prio)
+        free(rb->prio - HEAP_PAD);
+    free(rb->heap_slot);
+    free(rb->heap_seq);
+    free(rb->free_slots);
+    free(rb->bucket_next);
+    free(rb->bucket_head);
+    free(rb->bucket_tail);
     rb->buffer = NULL;
+    rb->prio = NULL;
+    rb->heap_slot = NULL;
+    rb->heap_seq = NULL;
+    rb->free_slots = NULL;
+    rb->bucket_next = NULL;
+    rb->bucket_head = NULL;
+    rb->bucket_tail = NULL;
     rb->type = FREED;
     rb->size = 0;
     rb->n = 0;
+    rb->mask = 0;
     rb->start = 0;
     rb->end = 0;
 }
 
-#define heap_get(hb, i) &(hb)->buffer[(i)*(hb)->size]
+// slot i of a heap (or bucket) buffer
+static inline char * heap_get(buffer_t * hb, unsigned int i){
+    if(hb->seg_n)
+        return segment_data(hb->segs[i >> hb->seg_shift]) +
+            (size_t)(i & (hb->seg_n - 1))*hb->size;
+    return &hb->buffer[(size_t)i*hb->size];
+}
 
 int heap_init(buffer_t * buf, unsigned int n,
-        size_t size)
+        size_t size, unsigned int flags)
+{
+    int err;
+    int * prio;
+    unsigned int arity = flags & ~HEAP_STABLE;
+    if(arity != 2 && arity != 4 && arity != 8)
+        return EINVAL;
+    if((err = buffer_init(buf, n, size, HEAP_BUFFER)) != 0)
+        return err;
+    buf->arity = arity;
+    buf->heap_slot = calloc(n, sizeof(unsigned int));
+    buf->free_slots = calloc(n, sizeof(unsigned int));
+    if(posix_memalign((void**)&prio, CACHE_LINE_SIZE,
+                (n + HEAP_PAD)*sizeof(int)) == 0)
+        buf->prio = prio + HEAP_PAD;
+    if(flags & HEAP_STABLE)
+        buf->heap_seq = calloc(n, sizeof(uint64_t));
+    if(buf->prio == NULL || buf->heap_slot == NULL ||
+            buf->free_slots == NULL ||
+            ((flags & HEAP_STABLE) && buf->heap_seq == NULL)){
+        buffer_free(buf);
+        return ENOMEM;
+    }
+    unsigned int i;
+    for(i = 0; i < n; i++)
+        buf->free_slots[i] = i;
+    return 0;
+}
+
+/*
+* grows the index arrays of a growable heap to idx_cap entries, the
+* arrays that were already grown are kept on failure
+*/
+static int _hb_resize(buffer_t * hb, unsigned int idx_cap){
+    int * prio;
+    void * p;
+    if(posix_memalign((void**)&prio, CACHE_LINE_SIZE,
+                (idx_cap + HEAP_PAD)*sizeof(int)) != 0)
+        return 0;
+    prio += HEAP_PAD;
+    if((p = realloc(hb->heap_slot, idx_cap*sizeof(unsigned int))) == NULL)
+        goto fail;
+    hb->heap_slot = p;
+    if((p = realloc(hb->free_slots, idx_cap*sizeof(unsigned int))) == NULL)
+        goto fail;
+    hb->free_slots = p;
+    if(hb->prio){
+        memcpy(prio, hb->prio, hb->used*sizeof(int));
+        free(hb->prio - HEAP_PAD);
+    }
+    hb->prio = prio;
+    hb->idx_cap = idx_cap;
+    return 1;
+fail:
+    free(prio - HEAP_PAD);
+    return 0;
+}
+
+/*
+* adds a segment to a full growable heap, its slots become the free
+* slots. returns 0 if no memory is available
+*/
+static int _hb_grow(buffer_t * hb){
+    unsigned int i, cap = hb->cap + hb->seg_n;
+    segment_t ** segs;
+    segment_t * s;
+    if(cap < hb->cap)
+        return 0;
+    if(cap > hb->idx_cap &&
+            !_hb_resize(hb, cap > 2*hb->idx_cap ? cap : 2*hb->idx_cap))
+        return 0;
+    segs = realloc(hb->segs, (hb->seg_count + 1)*sizeof(segment_t*));
+    if(segs == NULL)
+        return 0;
+    hb->segs = segs;
+    if((s = segment_alloc(_seg_bytes(hb))) == NULL)
+        return 0;
+    hb->segs[hb->seg_count++] = s;
+    for(i = 0; i < hb->seg_n; i++)
+        hb->free_slots[i] = cap - 1 - i;
+    hb->cap = cap;
+    return 1;
+}
+
+// gives back the segments above the soft limit of an empty heap
+static void _hb_shrink(buffer_t * hb){
+    unsigned int i;
+    while(hb->seg_count > _seg_keep(hb))
+        segment_free(hb->segs[--hb->seg_count], _seg_bytes(hb));
+    hb->cap = hb->seg_count << hb->seg_shift;
+    for(i = 0; i < hb->cap; i++)
+        hb->free_slots[i] = i;
+}
+
+int heap_init_growable(buffer_t * buf, unsigned int soft,
+        unsigned int hard, size_t size, unsigned int flags)
 {
-    return buffer_init(buf, n, 
-            size + sizeof(heap_node_t), 
-            HEAP_BUFFER);
+    if(flags != 2 && flags != 4 && flags != 8)
+        return EINVAL;
+    buffer_init_at(buf, NULL, 0, size, HEAP_BUFFER);
+    _seg_setup(buf, soft, hard);
+    buf->arity = flags;
+    if(!_hb_resize(buf, buf->seg_n)){
+        buffer_free(buf);
+        return ENOMEM;
+    }
+    return 0;
 }
 
-void __hb_swap(buffer_t * hb, heap_node_t * n1,
-        heap_node_t * n2)
+/*
+* position of the greatest of the k priorities of p, the first one on
+* ties. full groups of 4 (or 8) children are compared with SIMD
+* instructions when the target has them
+*/
+static inline unsigned int _hb_max_child(const int * p, unsigned int k){
+#if defined(__SSE4_1__)
+    if(k == 4){
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i m = _mm_max_epi32(v,
+                _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+        return __builtin_ctz(_mm_movemask_ps(
+                    _mm_castsi128_ps(_mm_cmpeq_epi32(v, m))));
+    }
+#endif
+#if defined(__AVX2__)
+    if(k == 8){
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i m = _mm256_max_epi32(v,
+                _mm256_permute2x128_si256(v, v, 1));
+        m = _mm256_max_epi32(m,
+                _mm256_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm256_max_epi32(m,
+                _mm256_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+        return __builtin_ctz(_mm256_movemask_ps(
+                    _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, m))));
+    }
+#endif
+#if defined(__aarch64__)
+    if(k == 4 || k == 8){
+        int32x4_t v = vld1q_s32(p);
+        if(k == 8)
+            v = vmaxq_s32(v, vld1q_s32(p + 4));
+        int max = vmaxvq_s32(v);
+        unsigned int i = 0;
+        while(p[i] != max) i++;
+        return i;
+    }
+#endif
+    unsigned int i, j = 0;
+    for(i = 1; i < k; i++)
+        if(p[i] > p[j])
+            j = i;
+    return j;
+}
+
+#define _hb_seq(hb, i) ((hb)->heap_seq ? (hb)->heap_seq[(i)] : 0)
+
+// 1 if the entry (p1, s1) must be taken before the entry (p2, s2)
+static inline int _hb_before(buffer_t * hb, int p1, uint64_t s1,
+        int p2, uint64_t s2)
+{
+    return p1 > p2 || (hb->heap_seq && p1 == p2 && s1 < s2);
+}
+
+static inline void _hb_set(buffer_t * hb, unsigned int i, int priority,
+        unsigned int slot, uint64_t seq)
 {
-    heap_node_t * tmp_n = alloca(hb->size);
-    memmove(tmp_n, n2, hb->size);
-    memmove(n2, n1, hb->size);
-    memmove(n1, tmp_n, hb->size);
+    hb->prio[i] = priority;
+    hb->heap_slot[i] = slot;
+    if(hb->heap_seq) hb->heap_seq[i] = seq;
 }
 
+static inline void _hb_move(buffer_t * hb, unsigned int i, unsigned int j){
+    _hb_set(hb, i, hb->prio[j], hb->heap_slot[j], _hb_seq(hb, j));
+}
+
+/*
+* first entry to take among the k children starting at j, in stable
+* heaps the children tied with the greatest priority are then checked
+* for the lowest sequence number
+*/
+static inline unsigned int _hb_best_child(buffer_t * hb, unsigned int j,
+        unsigned int k)
+{
+    unsigned int i, b = j + _hb_max_child(&hb->prio[j], k);
+    if(hb->heap_seq)
+        for(i = b + 1; i < j + k; i++)
+            if(hb->prio[i] == hb->prio[b] &&
+                    hb->heap_seq[i] < hb->heap_seq[b])
+                b = i;
+    return b;
+}
+
+/*
+* the element is copied once in a free slot, sifting only moves the
+* priority and slot of the entries, the entry being sifted is written
+* once at the end
+*/
 int hb_write(buffer_t * hb, void * data, int priority){
     assert(hb->type == HEAP_BUFFER);
-    if(rb_available(hb) > 0){
-        heap_node_t * n = (heap_node_t*)heap_get(hb, hb->used);
-        n->priority = priority;
-        memmove(n->value, data, hb->size - sizeof(int));
-        int i = hb->used;
-        hb->used++;
-        while(i > 0){
-            int j = (i - 1)/2;
-            heap_node_t * pn = (heap_node_t*)heap_get(hb, j);
-            if(n->priority > pn->priority){
-                __hb_swap(hb, n, pn);
-                i = j;
-                n = pn;
-            }else
-                break;
-        }
-        return 1;
+    if(rb_available(hb) == 0)
+        return 0;
+    if(hb->used == hb->cap && !_hb_grow(hb))
+        return 0;
+    unsigned int slot = hb->free_slots[hb->cap - 1 - hb->used];
+    uint64_t seq = hb->heap_seq ? hb->next_seq++ : 0;
+    buffer_copy(heap_get(hb, slot), data, hb->size);
+    unsigned int i = hb->used++;
+    while(i > 0){
+        unsigned int j = (i - 1)/hb->arity;
+        if(!_hb_before(hb, priority, seq, hb->prio[j], _hb_seq(hb, j)))
+            break;
+        _hb_move(hb, i, j);
+        i = j;
     }
-    return 0;
+    _hb_set(hb, i, priority, slot, seq);
+    return 1;
 }
 
 int hb_take(buffer_t * hb, void * data){
     assert(hb->type == HEAP_BUFFER);
-    if(rb_has_next(hb) > 0){
-        heap_node_t * n = (heap_node_t*)heap_get(hb, 0);
-        memmove(data, n->value, hb->size - sizeof(int));
-        hb->used--;
-        heap_node_t * ln = (heap_node_t*)heap_get(hb, hb->used);
-        __hb_swap(hb, ln, n);
-        unsigned int i = 0;
-        while(1){
-            unsigned int j = 2*i + 1;
-            unsigned int k = 2*i + 2;
-            heap_node_t * sn;
-            if(j < hb->used && k < hb->used){
-                int pj, pk;
-                pj = *(int*)heap_get(hb, j);
-                pk = *(int*)heap_get(hb, k);
-                if(pj > pk){
-                    sn = (heap_node_t*)heap_get(hb, j);
-                    i = j;
-                }else{
-                    sn = (heap_node_t*)heap_get(hb, k);
-                    i = k;
-                }
-            }else if(j < hb->used){
-                sn = (heap_node_t*)heap_get(hb, j);
-                i = j;
-            }else if (k < hb->used){
-                sn = (heap_node_t*)heap_get(hb, k);
-                i = k;
-            }else
-                break;
-            if(n->priority < sn->priority){
-                __hb_swap(hb, n, sn); 
-                n = sn;
-            }else
-                break;
-        }
+    if(rb_has_next(hb) == 0)
+        return 0;
+    unsigned int slot = hb->heap_slot[0];
+    buffer_copy(data, heap_get(hb, slot), hb->size);
+    hb->used--;
+    hb->free_slots[hb->cap - 1 - hb->used] = slot;
+    if(hb->used == 0){
+        if(hb->seg_n)
+            _hb_shrink(hb);
         return 1;
     }
+    int priority = hb->prio[hb->used];
+    uint64_t seq = _hb_seq(hb, hb->used);
+    slot = hb->heap_slot[hb->used];
+    unsigned int i = 0;
+    while(1){
+        unsigned int j = hb->arity*i + 1;
+        if(j >= hb->used)
+            break;
+        unsigned int k = hb->used - j;
+        if(k > hb->arity) k = hb->arity;
+        j = _hb_best_child(hb, j, k);
+        if(!_hb_before(hb, hb->prio[j], _hb_seq(hb, j), priority, seq))
+            break;
+        _hb_move(hb, i, j);
+        i = j;
+    }
+    _hb_set(hb, i, priority, slot, seq);
+    return 1;
+}
+
+unsigned int hb_write_many(buffer_t * hb, void * data,
+        int * priorities, unsigned int n)
+{
+    unsigned int k;
+    for(k = 0; k < n; k++)
+        if(!hb_write(hb, (char*)data + k*hb->size, priorities[k]))
+            break;
+    return k;
+}
+
+unsigned int hb_take_many(buffer_t * hb, void * data, unsigned int n){
+    unsigned int k;
+    for(k = 0; k < n; k++)
+        if(!hb_take(hb, (char*)data + k*hb->size))
+            break;
+    return k;
+}
+
+int bucket_init(buffer_t * buf, unsigned int n, size_t size,
+        unsigned int levels)
+{
+    int err;
+    if(levels == 0 || levels > BUCKET_MAX_LEVELS)
+        return EINVAL;
+    if((err = buffer_init(buf, n, size, BUCKET_BUFFER)) != 0)
+        return err;
+    buf->levels = levels;
+    buf->free_slots = calloc(n, sizeof(unsigned int));
+    buf->bucket_next = calloc(n, sizeof(unsigned int));
+    buf->bucket_head = calloc(levels, sizeof(unsigned int));
+    buf->bucket_tail = calloc(levels, sizeof(unsigned int));
+    if(buf->free_slots == NULL || buf->bucket_next == NULL ||
+            buf->bucket_head == NULL || buf->bucket_tail == NULL){
+        buffer_free(buf);
+        return ENOMEM;
+    }
+    unsigned int i;
+    for(i = 0; i < n; i++)
+        buf->free_slots[i] = i;
     return 0;
 }
 
+int bucket_write(buffer_t * bb, void * data, int priority){
+    assert(bb->type == BUCKET_BUFFER);
+    if(rb_available(bb) == 0)
+        return 0;
+    unsigned int p = priority < 0 ? 0 :
+        (unsigned int)priority >= bb->levels ? bb->levels - 1 :
+        (unsigned int)priority;
+    unsigned int bit = bb->levels - 1 - p;
+    unsigned int slot = bb->free_slots[bb->cap - 1 - bb->used];
+    buffer_copy(heap_get(bb, slot), data, bb->size);
+    bb->used++;
+    if(bb->bucket_bits & (1ULL << bit))
+        bb->bucket_next[bb->bucket_tail[p]] = slot;
+    else{
+        bb->bucket_head[p] = slot;
+        bb->bucket_bits |= 1ULL << bit;
+    }
+    bb->bucket_tail[p] = slot;
+    return 1;
+}
+
+int bucket_take(buffer_t * bb, void * data){
+    assert(bb->type == BUCKET_BUFFER);
+    if(bb->bucket_bits == 0)
+        return 0;
+    unsigned int bit = __builtin_ctzll(bb->bucket_bits);
+    unsigned int p = bb->levels - 1 - bit;
+    unsigned int slot = bb->bucket_head[p];
+    buffer_copy(data, heap_get(bb, slot), bb->size);
+    if(slot == bb->bucket_tail[p])
+        bb->bucket_bits &= ~(1ULL << bit);
+    else
+        bb->bucket_head[p] = bb->bucket_next[slot];
+    bb->used--;
+    bb->free_slots[bb->cap - 1 - bb->used] = slot;
+    return 1;
+}
+
+unsigned int bucket_write_many(buffer_t * bb, void * data,
+        int * priorities, unsigned int n)
+{
+    unsigned int k;
+    for(k = 0; k < n; k++)
+        if(!bucket_write(bb, (char*)data + k*bb->size, priorities[k]))
+            break;
+    return k;
+}
+
+unsigned int bucket_take_many(buffer_t * bb, void * data, unsigned int n){
+    unsigned int k;
+    for(k = 0; k < n; k++)
+        if(!bucket_take(bb, (char*)data + k*bb->size))
+            break;
+    return k;
+}
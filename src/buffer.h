@@ -1,38 +1,421 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include "common.h"
+#include "segment.h"
 
 typedef enum {
     FREED,
     RING_BUFFER,
-    HEAP_BUFFER
+    HEAP_BUFFER,
+    SPSC_BUFFER,
+    MPMC_BUFFER,
+    BUCKET_BUFFER,
+    BYTES_BUFFER
 }buffer_type_t;
 
+/*
+* buffer, size, n and type are only written by buffer_init and share
+* a cache line, the locked ring indices (only used under the queue
+* mutex) and each side of the lock free indices start a new one
+*/
 typedef struct ring_buffer_st {
     char * buffer;
     size_t size;
     unsigned int n;
+    /*
+    * n - 1 when n is a power of two, 0 otherwise, so that mask == n - 1
+    * tells the rings the functions of BUFFER_SPECIALIZE index with it
+    */
+    unsigned int mask;
     buffer_type_t type;
-    unsigned int used;
+    unsigned int used cache_aligned;
     unsigned int start;
     unsigned int end;
+    // a slot is held by queue_reserve (or queue_peek_acquire)
+    unsigned int write_reserved;
+    unsigned int read_reserved;
+    /*
+    * BYTES_BUFFER only, n is the capacity in bytes, used the number
+    * of records and bytes the number of bytes they take, padding
+    * included. start is the write offset and end the read offset
+    */
+    unsigned int bytes;
+    /*
+    * HEAP_BUFFER only, the elements never move out of their slot in
+    * buffer, the arity-ary heap orders entries made of prio[i] and
+    * heap_slot[i], the priorities are contiguous so that the children
+    * of an entry are compared within one cache line.
+    * stable heaps also give each entry a sequence number, heap_seq[i],
+    * to take the entries of equal priority in the order they were put.
+    * free_slots[0 .. n - used) are the slots not in the heap
+    */
+    unsigned int arity;
+    int * prio;
+    unsigned int * heap_slot;
+    uint64_t * heap_seq;
+    uint64_t next_seq;
+    unsigned int * free_slots;
+    /*
+    * BUCKET_BUFFER only, each of the levels priorities is a fifo list
+    * of slots linked through bucket_next, bit levels - 1 - p of
+    * bucket_bits is set when priority p is not empty so that the
+    * highest one is found with a single count trailing zeros.
+    * the free slots are kept in free_slots as for the heap
+    */
+    unsigned int levels;
+    uint64_t bucket_bits;
+    unsigned int * bucket_next;
+    unsigned int * bucket_head;
+    unsigned int * bucket_tail;
+    /*
+    * growable RING_BUFFER and HEAP_BUFFER only (seg_n != 0), the
+    * elements live in segments of seg_n = 1 << seg_shift slots and n
+    * is the hard limit. segments are taken from the shared pool while
+    * the buffer grows, once drained the buffer keeps the ones needed
+    * for soft elements and gives back the others.
+    * a ring is the list seg_head .. seg_tail, start is the write
+    * position in seg_tail and end the read position in seg_head,
+    * drained segments kept for later are in seg_spare.
+    * the heap slots are numbered across the segs table, cap slots are
+    * allocated and the index arrays have room for idx_cap entries
+    */
+    unsigned int seg_n;
+    unsigned int seg_shift;
+    unsigned int soft;
+    unsigned int seg_count;
+    unsigned int cap;
+    unsigned int idx_cap;
+    segment_t * seg_head;
+    segment_t * seg_tail;
+    segment_t * seg_spare;
+    segment_t ** segs;
+    /*
+    * lock free indices, only used by SPSC_BUFFER and MPMC_BUFFER.
+    * head and tail are free running counters, head is only written
+    * by the producers and tail only by the consumers. In SPSC mode
+    * each side keeps a cached copy of the other index so that it only
+    * touches the other cache line when the ring looks full (or empty).
+    * In MPMC mode every slot carries a sequence number telling
+    * whether it is ready to be written or read at a given lap,
+    * head and tail are claimed with a compare and swap.
+    */
+    struct {
+        atomic_size_t head;
+        size_t tail_cache;
+    } cache_aligned prod;
+    struct {
+        atomic_size_t tail;
+        size_t head_cache;
+    } cache_aligned cons;
 } buffer_t;
 
 int buffer_init(buffer_t * r_buf, unsigned int n,
 	size_t size, buffer_type_t type);
+/*
+* same as buffer_init but the elements are stored in mem, which must
+* hold n elements (n slots of mpmc_stride(size) bytes for MPMC_BUFFER)
+* and is not zeroed. the caller owns mem and must set buffer to NULL
+* before calling buffer_free
+*/
+int buffer_init_at(buffer_t * r_buf, void * mem, unsigned int n,
+        size_t size, buffer_type_t type);
 void buffer_free(buffer_t * rb);
+/*
+* drops every element of the buffer, a growable buffer keeps the
+* segments needed for its soft limit. no slot may be reserved and
+* lock free buffers must not be in use by any other thread
+*/
+void buffer_reset(buffer_t * rb);
+/*
+* growable ring, allocates segments on demand up to hard elements
+* (no limit when hard is 0) and keeps enough of them for soft
+* elements once drained
+*/
+int buffer_init_growable(buffer_t * rb, unsigned int soft,
+        unsigned int hard, size_t size);
 int rb_write(buffer_t * rb, void * data, int _priority);
 int rb_take(buffer_t * rb, void * data);
 int hb_write(buffer_t * hb, void * data, int priority);
 int hb_take(buffer_t * hb, void * data);
-int heap_init(buffer_t * buf, unsigned int n, size_t size);
+/*
+* flags is the number of children of each heap entry: 2, 4 or 8,
+* optionally or'ed with HEAP_STABLE.
+* returns EINVAL for any other arity
+*/
+#define HEAP_STABLE 0x100
+int heap_init(buffer_t * buf, unsigned int n, size_t size,
+        unsigned int flags);
+/*
+* growable heap, see buffer_init_growable, the heap only gives its
+* segments back when it is empty. flags is the arity alone, growable
+* heaps are not stable.
+* returns EINVAL for any other flags
+*/
+int heap_init_growable(buffer_t * buf, unsigned int soft,
+        unsigned int hard, size_t size, unsigned int flags);
+/*
+* priorities from 0 to levels - 1, levels must be between 1 and
+* BUCKET_MAX_LEVELS, returns EINVAL otherwise
+*/
+#define BUCKET_MAX_LEVELS 64
+int bucket_init(buffer_t * buf, unsigned int n, size_t size,
+        unsigned int levels);
+// priorities out of range are clamped to the nearest level
+int bucket_write(buffer_t * bb, void * data, int priority);
+int bucket_take(buffer_t * bb, void * data);
+void * rb_reserve(buffer_t * rb);
+void rb_commit(buffer_t * rb, void * slot);
+void * rb_peek(buffer_t * rb);
+void rb_release(buffer_t * rb, void * slot);
+int spsc_write(buffer_t * rb, void * data, int _priority);
+int spsc_take(buffer_t * rb, void * data);
+void * spsc_reserve(buffer_t * rb);
+void spsc_commit(buffer_t * rb, void * slot);
+void * spsc_peek(buffer_t * rb);
+void spsc_release(buffer_t * rb, void * slot);
+int mpmc_write(buffer_t * rb, void * data, int _priority);
+int mpmc_take(buffer_t * rb, void * data);
+void * mpmc_reserve(buffer_t * rb);
+void mpmc_commit(buffer_t * rb, void * slot);
+void * mpmc_peek(buffer_t * rb);
+void mpmc_release(buffer_t * rb, void * slot);
+unsigned int lf_used(buffer_t * rb);
+/*
+* byte ring of variable length records, n is the capacity in bytes,
+* rounded up to a multiple of BYTES_ALIGN.
+* each record is a BYTES_HEADER bytes length followed by the payload
+* padded to BYTES_ALIGN, so that payloads stay aligned. a record never
+* wraps around the end of the ring, when it does not fit before the
+* end a wrap marker skips the bytes left and it starts at offset 0.
+* an empty ring starts over at offset 0
+*/
+#define BYTES_ALIGN 8
+#define BYTES_HEADER 8
+#define bytes_record(len) \
+    (BYTES_HEADER + (((len) + BYTES_ALIGN - 1) & ~(size_t)(BYTES_ALIGN - 1)))
+// largest payload a ring of n bytes can hold
+#define bytes_max(B) ((B)->n - BYTES_HEADER)
+#define bytes_available(B) ((B)->n - (B)->bytes)
+int bytes_init(buffer_t * rb, unsigned int n);
+// returns 1 when the record was written, 0 when there is no room
+int bytes_write(buffer_t * rb, const void * data, size_t len);
+/*
+* returns the payload of the oldest record and stores its length in
+* len, NULL when the ring is empty or the record is already peeked.
+* the record stays in the ring until bytes_release
+*/
+void * bytes_peek(buffer_t * rb, size_t * len);
+void bytes_release(buffer_t * rb);
+/*
+* batch versions, copy up to n elements and return the number
+* of elements actually copied
+*/
+unsigned int rb_write_many(buffer_t * rb, void * data,
+        int * _priorities, unsigned int n);
+unsigned int rb_take_many(buffer_t * rb, void * data, unsigned int n);
+unsigned int spsc_write_many(buffer_t * rb, void * data,
+        int * _priorities, unsigned int n);
+unsigned int spsc_take_many(buffer_t * rb, void * data, unsigned int n);
+unsigned int mpmc_write_many(buffer_t * rb, void * data,
+        int * _priorities, unsigned int n);
+unsigned int mpmc_take_many(buffer_t * rb, void * data, unsigned int n);
+unsigned int hb_write_many(buffer_t * hb, void * data,
+        int * priorities, unsigned int n);
+unsigned int hb_take_many(buffer_t * hb, void * data, unsigned int n);
+unsigned int bucket_write_many(buffer_t * bb, void * data,
+        int * priorities, unsigned int n);
+unsigned int bucket_take_many(buffer_t * bb, void * data, unsigned int n);
 
 typedef int (*buffer_write)(buffer_t * rb, void * data, int priority);
 typedef int (*buffer_take)(buffer_t * rb, void * data);
+// reserve/peek return NULL when no slot is available
+typedef void * (*buffer_acquire)(buffer_t * rb);
+typedef void (*buffer_publish)(buffer_t * rb, void * slot);
+typedef unsigned int (*buffer_write_many)(buffer_t * rb, void * data,
+        int * priorities, unsigned int n);
+typedef unsigned int (*buffer_take_many)(buffer_t * rb, void * data,
+        unsigned int n);
 
 #define rb_has_next(B) ((B)->used)
 #define rb_available(B) ((B)->n - rb_has_next((B)))
 
+// moves the slot index i of a locked ring forward by k <= n slots
+#define rb_wrap(B, i, k) \
+    ((i) + (k) >= (B)->n ? (i) + (k) - (B)->n : (i) + (k))
+
+// smallest power of two greater or equal to n
+static inline unsigned int buffer_pow2(unsigned int n){
+    unsigned int p = 1;
+    while(p < n) p <<= 1;
+    return p;
+}
+
+/*
+* copies one element, the common sizes are copied with a constant
+* size so that the compiler turns them into a few moves
+*/
+static inline void buffer_copy(void * dst, const void * src, size_t size){
+    switch(size){
+    case 4: memcpy(dst, src, 4); break;
+    case 8: memcpy(dst, src, 8); break;
+    case 16: memcpy(dst, src, 16); break;
+    default: memcpy(dst, src, size);
+    }
+}
+
+typedef struct {
+    atomic_size_t seq;
+    char value[];
+}mpmc_slot_t;
+
+#define mpmc_stride(size) \
+    ((sizeof(mpmc_slot_t) + (size) + sizeof(size_t) - 1) & \
+     ~(sizeof(size_t) - 1))
+#define mpmc_get(rb, pos) \
+    ((mpmc_slot_t*)&(rb)->buffer[((pos) % (rb)->n)*mpmc_stride((rb)->size)])
+
+/*
+* claims the next slot to write (lap = 0) or to read (lap = 1) by
+* moving index forward, returns NULL when the ring is full (or empty)
+*/
+static inline mpmc_slot_t * mpmc_claim(buffer_t * rb,
+        atomic_size_t * index, size_t lap)
+{
+    if(rb->n == 0) return NULL;
+    size_t pos = atomic_load_explicit(index, memory_order_relaxed);
+    while(1){
+        mpmc_slot_t * slot = mpmc_get(rb, pos);
+        size_t seq = atomic_load_explicit(&slot->seq,
+                memory_order_acquire);
+        ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + lap);
+        if(dif == 0){
+            if(atomic_compare_exchange_weak_explicit(index,
+                        &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+                return slot;
+        }else if(dif < 0)
+            //the slot was not released from the previous lap yet
+            //(or not written in this lap)
+            return NULL;
+        else
+            pos = atomic_load_explicit(index, memory_order_relaxed);
+    }
+}
+
+/*
+* the owner of a claimed slot is the only one allowed to change its
+* sequence number: +1 once written, +n-1 once read
+*/
+static inline void mpmc_publish(mpmc_slot_t * slot, size_t inc){
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + inc, memory_order_release);
+}
+
+/*
+* BUFFER_SPECIALIZE(name, elem_t) defines write and take functions for
+* rings of elements of type elem_t, with the same signatures and
+* semantics as rb_write, rb_take, spsc_write, spsc_take, mpmc_write
+* and mpmc_take:
+*   name##_rb_write, name##_rb_take, name##_spsc_write,
+*   name##_spsc_take, name##_mpmc_write, name##_mpmc_take
+* the ring must have been initialized with a power of two capacity
+* (see buffer_pow2) and elements of sizeof(elem_t) bytes, so the slot
+* is found with a mask and the element copied with a constant size.
+*/
+#define BUFFER_SPECIALIZE(name, elem_t) \
+static inline int name##_rb_write(buffer_t * rb, void * data, \
+        int _priority) \
+{ \
+    (void)_priority; \
+    if(rb->used == rb->n || rb->write_reserved) return 0; \
+    memcpy(rb->buffer + rb->start*sizeof(elem_t), data, sizeof(elem_t)); \
+    rb->used += 1; \
+    rb->start = (rb->start + 1) & rb->mask; \
+    return 1; \
+} \
+static inline int name##_rb_take(buffer_t * rb, void * data){ \
+    if(rb->used == 0 || rb->read_reserved) return 0; \
+    memcpy(data, rb->buffer + rb->end*sizeof(elem_t), sizeof(elem_t)); \
+    rb->used -= 1; \
+    rb->end = (rb->end + 1) & rb->mask; \
+    return 1; \
+} \
+static inline int name##_spsc_write(buffer_t * rb, void * data, \
+        int _priority) \
+{ \
+    (void)_priority; \
+    size_t head = atomic_load_explicit(&rb->prod.head, \
+            memory_order_relaxed); \
+    if(head - rb->prod.tail_cache >= rb->n){ \
+        rb->prod.tail_cache = atomic_load_explicit(&rb->cons.tail, \
+                memory_order_acquire); \
+        if(head - rb->prod.tail_cache >= rb->n) \
+            return 0; \
+    } \
+    memcpy(rb->buffer + (head & rb->mask)*sizeof(elem_t), data, \
+            sizeof(elem_t)); \
+    atomic_store_explicit(&rb->prod.head, head + 1, \
+            memory_order_release); \
+    return 1; \
+} \
+static inline int name##_spsc_take(buffer_t * rb, void * data){ \
+    size_t tail = atomic_load_explicit(&rb->cons.tail, \
+            memory_order_relaxed); \
+    if(rb->cons.head_cache == tail){ \
+        rb->cons.head_cache = atomic_load_explicit(&rb->prod.head, \
+                memory_order_acquire); \
+        if(rb->cons.head_cache == tail) \
+            return 0; \
+    } \
+    memcpy(data, rb->buffer + (tail & rb->mask)*sizeof(elem_t), \
+            sizeof(elem_t)); \
+    atomic_store_explicit(&rb->cons.tail, tail + 1, \
+            memory_order_release); \
+    return 1; \
+} \
+/* same as mpmc_claim with the slot size known at compile time */ \
+static inline mpmc_slot_t * name##_mpmc_claim(buffer_t * rb, \
+        atomic_size_t * index, size_t lap) \
+{ \
+    size_t pos = atomic_load_explicit(index, memory_order_relaxed); \
+    while(1){ \
+        mpmc_slot_t * slot = (mpmc_slot_t*)(rb->buffer + \
+                (pos & rb->mask)*mpmc_stride(sizeof(elem_t))); \
+        size_t seq = atomic_load_explicit(&slot->seq, \
+                memory_order_acquire); \
+        ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + lap); \
+        if(dif == 0){ \
+            if(atomic_compare_exchange_weak_explicit(index, \
+                        &pos, pos + 1, \
+                        memory_order_relaxed, memory_order_relaxed)) \
+                return slot; \
+        }else if(dif < 0) \
+            return NULL; \
+        else \
+            pos = atomic_load_explicit(index, memory_order_relaxed); \
+    } \
+} \
+static inline int name##_mpmc_write(buffer_t * rb, void * data, \
+        int _priority) \
+{ \
+    (void)_priority; \
+    mpmc_slot_t * slot = name##_mpmc_claim(rb, &rb->prod.head, 0); \
+    if(slot == NULL) return 0; \
+    memcpy(slot->value, data, sizeof(elem_t)); \
+    mpmc_publish(slot, 1); \
+    return 1; \
+} \
+static inline int name##_mpmc_take(buffer_t * rb, void * data){ \
+    mpmc_slot_t * slot = name##_mpmc_claim(rb, &rb->cons.tail, 1); \
+    if(slot == NULL) return 0; \
+    memcpy(data, slot->value, sizeof(elem_t)); \
+    mpmc_publish(slot, rb->n - 1); \
+    return 1; \
+}
+
 #endif
 
@@ -1,57 +1,31 @@
 #include <pthread.h>
-#include <sys/time.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include <stdio.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 
 #include "channel.h"
-#include "buffer.h"
+#include "channel_impl.h"
 
 static char * _channel_type_name[] = {
-    "FIFO_CHANNEL",
-    "PRIORITY_CHANNEL"
+    "QUEUE_FIFO",
+    "QUEUE_PRIORITY",
+    "QUEUE_SPSC",
+    "QUEUE_MPMC",
+    "QUEUE_BROADCAST",
+    "QUEUE_BYTES"
 };
 
-typedef enum{
-    FIFO_CHANNEL = 0,
-    PRIORITY_CHANNEL = 1,
-}channel_type_t;
-
 static char * _notification_type_name[] = {
     "HEAD",
     "NODE",
     "DEAD"
 };
 
-typedef enum{
-    HEAD = 0,
-    NODE = 1,
-    DEAD = 2,
-}link_list_node_t;
-
-struct notification_callback_st{
-    void(*callback)(struct queue_st * q, void * data);
-    void *data;
-    link_list_node_t type;
-    struct queue_st * q;
-    struct notification_callback_st * n;
-    struct notification_callback_st * p;
-};
-
-typedef struct data_control_st dctrl_t;
-struct data_control_st {
-    pthread_mutex_t mutex;
-    pthread_cond_t empty;
-    pthread_cond_t full;
-    struct notification_callback_st * not_full_callback;
-    struct notification_callback_st *  not_empty_callback;
-};
-
-struct queue_st {
-    channel_type_t type;
-    dctrl_t ctrl;
-    buffer_t rb;
-};
-
 void queue_print(struct queue_st * q){
     printf("%p, %s\n", q, _channel_type_name[q->type]);
 }
@@ -60,42 +34,51 @@ void notification_print(struct notification_callback_st * nc){
     printf("%p, %s\n", nc, _notification_type_name[nc->type]);
 }
 
-int init_dctrl(dctrl_t * dctrl){
+int _queue_ctrl_init(queue_ctrl_t * dctrl){
     int err_code;
     if((err_code = pthread_mutex_init(&(dctrl->mutex), NULL)))
         return err_code;
-    if((err_code = pthread_cond_init(&(dctrl->empty), NULL))){
+    if((err_code = event_init(&(dctrl->empty)))){
 	pthread_mutex_destroy(&(dctrl->mutex));
         return err_code;
     }
-    if((err_code = pthread_cond_init(&(dctrl->full), NULL))){
+    if((err_code = event_init(&(dctrl->full)))){
 	pthread_mutex_destroy(&(dctrl->mutex));
-	pthread_cond_destroy(&(dctrl->empty));
+	event_destroy(&(dctrl->empty));
         return err_code;
     }
-    struct notification_callback_st * nc = calloc(2, 
-            sizeof(struct notification_callback_st));
-    if(nc == NULL){
+    if((err_code = pthread_mutex_init(&(dctrl->cb_mutex), NULL))){
 	pthread_mutex_destroy(&(dctrl->mutex));
-	pthread_cond_destroy(&(dctrl->empty));
-        pthread_cond_destroy(&(dctrl->full));
-        return ENOMEM;
+	event_destroy(&(dctrl->empty));
+        event_destroy(&(dctrl->full));
+        return err_code;
     }
+    struct notification_callback_st * nc = dctrl->heads;
+    memset(nc, 0, sizeof(dctrl->heads));
     dctrl->not_full_callback = nc;
-    dctrl->not_full_callback->type = HEAD;
+    dctrl->not_full_callback->type = CALLBACK_HEAD;
     dctrl->not_empty_callback = nc + 1;
-    dctrl->not_empty_callback->type = HEAD;
+    dctrl->not_empty_callback->type = CALLBACK_HEAD;
+    atomic_init(&dctrl->not_full_listeners, 0);
+    atomic_init(&dctrl->not_empty_listeners, 0);
+    dctrl->max_spin = 0;
+    atomic_init(&dctrl->spin_budget, dctrl->max_spin);
+    atomic_init(&dctrl->closed, 0);
+    dctrl->resets = 0;
+    dctrl->cb_epoch = 0;
+    atomic_init(&dctrl->cb_running[0], 0);
+    atomic_init(&dctrl->cb_running[1], 0);
+    dctrl->efd[0] = dctrl->efd[1] = -1;
+    dctrl->efd_nc[0] = dctrl->efd_nc[1] = NULL;
     return 0;
 }
 
-int dctrl_free(dctrl_t * dctrl){
+int _queue_ctrl_free(queue_ctrl_t * dctrl){
     if(pthread_mutex_destroy(&(dctrl->mutex)))
         return 1;
-    if(pthread_cond_destroy(&(dctrl->empty)))
-        return 1;
-    if(pthread_cond_destroy(&(dctrl->full)))
-        return 1;
-    free(dctrl->not_full_callback);
+    event_destroy(&(dctrl->empty));
+    event_destroy(&(dctrl->full));
+    pthread_mutex_destroy(&(dctrl->cb_mutex));
     return 0;
 }
 
@@ -117,34 +100,58 @@ void __queue_unlock(queue_t * q){
     _queue_unlock(q);
 }
 
+/*
+* the links are written under the queue mutex but followed without it
+* by the dispatchers, see _queue_callback
+*/
 static inline void _append_callback(struct notification_callback_st ** d, 
         struct notification_callback_st * nc)
 {
     if(*d){
-        nc->type = NODE;
+        nc->type = CALLBACK_NODE;
         nc->n = (*d)->n;
+        nc->p = *d;
         if(nc->n) nc->n->p = nc;
-        (*d)->n = nc;
+        __atomic_store_n(&(*d)->n, nc, __ATOMIC_RELEASE);
     }else{
-        nc->type = HEAD;
+        nc->type = CALLBACK_HEAD;
         nc->n = NULL;
-    }   
-    nc->p = *d;
+        nc->p = *d;
+    }
 }
 
-void _remove_callback(struct notification_callback_st * nc){
-    assert(nc->type != HEAD);
+/*
+* unlinks nc, cb_mutex and the mutex must be held. nc keeps its next link for the
+* dispatchers that already reached it, it may only be freed once
+* _callback_sync returns for the epoch returned here
+*/
+static unsigned int _remove_callback(struct notification_callback_st * nc){
+    assert(nc->type != CALLBACK_HEAD);
     struct notification_callback_st * n = nc->n;
     struct notification_callback_st * p = nc->p;
-    if(p) p->n = n;
+    if(p) __atomic_store_n(&p->n, n, __ATOMIC_RELEASE);
     if(n) n->p = p;
-    nc->type = DEAD;
+    __atomic_store_n(&nc->type, CALLBACK_DEAD, __ATOMIC_RELAXED);
+    atomic_fetch_sub(nc->listeners, 1);
+    return nc->q->ctrl.cb_epoch++ & 1;
+}
+
+/*
+* waits for the dispatchers registered in epoch, cb_mutex must be
+* held but not the mutex
+*/
+static void _callback_sync(queue_t * q, unsigned int epoch){
+    while(atomic_load_explicit(&q->ctrl.cb_running[epoch],
+                memory_order_acquire))
+        sched_yield();
 }
 
 void _queue_append_not_empty_callback(struct queue_st * q, 
     struct notification_callback_st * nc)
 {
     nc->q = q;
+    nc->listeners = &q->ctrl.not_empty_listeners;
+    atomic_fetch_add(nc->listeners, 1);
     _append_callback(&(q->ctrl.not_empty_callback), nc); 
 }
 
@@ -152,12 +159,14 @@ void _queue_append_not_full_callback(struct queue_st * q,
         struct notification_callback_st * nc)
 {
     nc->q = q;
+    nc->listeners = &q->ctrl.not_full_listeners;
+    atomic_fetch_add(nc->listeners, 1);
     _append_callback(&(q->ctrl.not_full_callback), nc); 
 }
 
 static inline notification_callback_t * __queue_append_callback(
         struct queue_st * q,
-        callback_t callback, void * data,
+        callback_t callback, void * data, int edge,
         void(*callback_setter)(struct queue_st * q,
             struct notification_callback_st * nc))
 {
@@ -166,6 +175,7 @@ static inline notification_callback_t * __queue_append_callback(
     if(!nc) return nc;
     nc->callback = callback;
     nc->data = data;
+    nc->edge = edge;
     int err;
     if((err = _queue_lock(q)) != 0){
         free(nc);
@@ -180,7 +190,7 @@ notification_callback_t * queue_append_not_empty_callback(
         struct queue_st * q, 
         callback_t callback, void * data)
 {
-    return __queue_append_callback(q, callback, data,
+    return __queue_append_callback(q, callback, data, 0,
             _queue_append_not_empty_callback);
 }
 
@@ -188,301 +198,1702 @@ notification_callback_t * queue_append_not_full_callback(
         struct queue_st * q, 
         callback_t callback, void * data)
 {
-    return __queue_append_callback(q, callback, data,
+    return __queue_append_callback(q, callback, data, 0,
+            _queue_append_not_full_callback);
+}
+
+notification_callback_t * queue_append_not_empty_edge_callback(
+        struct queue_st * q,
+        callback_t callback, void * data)
+{
+    return __queue_append_callback(q, callback, data, 1,
+            _queue_append_not_empty_callback);
+}
+
+notification_callback_t * queue_append_not_full_edge_callback(
+        struct queue_st * q,
+        callback_t callback, void * data)
+{
+    return __queue_append_callback(q, callback, data, 1,
             _queue_append_not_full_callback);
 }
 
 void queue_remove_callback(notification_callback_t * nc){
-    _queue_lock(nc->q);
-    _remove_callback(nc);
-    _queue_unlock(nc->q);
+    queue_t * q = nc->q;
+    pthread_mutex_lock(&(q->ctrl.cb_mutex));
+    _queue_lock(q);
+    unsigned int epoch = _remove_callback(nc);
+    _queue_unlock(q);
+    _callback_sync(q, epoch);
+    pthread_mutex_unlock(&(q->ctrl.cb_mutex));
     free(nc);
 }
 
-static inline void _queue_callback(queue_t * q, 
-        struct notification_callback_st * nc)
+/*
+* the callbacks of a list are snapshotted with the mutex held and run
+* by _callback_run once it is released: the dispatcher keeps the
+* first node and registers in the current epoch so that the nodes
+* it may reach are not freed under it. edge is 1 when the queue was
+* empty (or full) before the change, the edge triggered callbacks
+* are skipped otherwise
+*/
+typedef struct {
+    queue_t * q;
+    struct notification_callback_st * first;
+    unsigned int epoch;
+    int edge;
+}callback_snapshot_t;
+
+static inline callback_snapshot_t _queue_callback(queue_t * q,
+        struct notification_callback_st * head, int edge)
 {
-    nc = nc->n;
+    callback_snapshot_t cs = {q, head->n, q->ctrl.cb_epoch & 1, edge};
+    if(cs.first)
+        atomic_fetch_add_explicit(&q->ctrl.cb_running[cs.epoch], 1,
+                memory_order_relaxed);
+    return cs;
+}
+
+static void _callback_run(callback_snapshot_t * cs){
+    struct notification_callback_st * nc = cs->first;
+    if(nc == NULL)
+        return;
     while(nc){
-        if(nc->callback) nc->callback(q, nc->data);
-        nc = nc->n;
+        if(__atomic_load_n(&nc->type, __ATOMIC_RELAXED) != CALLBACK_DEAD &&
+                nc->callback && (cs->edge || !nc->edge))
+            nc->callback(cs->q, nc->data);
+        nc = __atomic_load_n(&nc->n, __ATOMIC_ACQUIRE);
+    }
+    atomic_fetch_sub_explicit(&cs->q->ctrl.cb_running[cs->epoch], 1,
+            memory_order_release);
+}
+
+/*
+* wakes up to n threads waiting for the condition, does not enter
+* the kernel when nobody is waiting
+*/
+int notify_not_empty(queue_t * q, unsigned int n) {
+    event_notify(&q->ctrl.empty, n);
+    return 0;
+}
+
+#define MIN_SPIN 16
+
+/*
+* spins on the event for up to the current budget before sleeping.
+* the budget starts at max_spin, a succesful spin raises it to twice
+* the spins it needed and it loses a quarter every time spinning was
+* not enough, so it decays towards MIN_SPIN while the waits are too
+* long to be served by spinning
+*/
+int _spin_then_wait(queue_ctrl_t * dctrl, event_t * ev,
+        unsigned int key, struct timespec * abstime)
+{
+    if(dctrl->max_spin){
+        unsigned int budget = atomic_load_explicit(&dctrl->spin_budget,
+                memory_order_relaxed);
+        unsigned int spins = event_spin(ev, key, budget);
+        if(spins){
+            if(2*spins > budget) budget = 2*spins;
+            if(budget > dctrl->max_spin) budget = dctrl->max_spin;
+        }else
+            budget -= budget/4;
+        if(budget < MIN_SPIN)
+            budget = dctrl->max_spin < MIN_SPIN ? dctrl->max_spin : MIN_SPIN;
+        atomic_store_explicit(&dctrl->spin_budget, budget,
+                memory_order_relaxed);
+        if(spins){
+            event_cancel_wait(ev);
+            return 0;
+        }
+    }
+    return event_wait(ev, key, abstime);
+}
+
+static inline int _wait_event(queue_ctrl_t * dctrl, event_t * ev,
+        struct timespec * abstime)
+{
+    unsigned int key = event_prepare_wait(ev);
+    unsigned int resets = dctrl->resets;
+    pthread_mutex_unlock(&(dctrl->mutex));
+    int err = _spin_then_wait(dctrl, ev, key, abstime);
+    pthread_mutex_lock(&(dctrl->mutex));
+    if(dctrl->resets != resets)
+        return ECANCELED;
+    return err;
+}
+
+/*
+* the mutex must be held, may return 0 before the condition is
+* satisfied, callers check it again
+*/
+int wait_empty(queue_ctrl_t * dctrl, struct timespec * abstime){
+    return _wait_event(dctrl, &(dctrl->empty), abstime);
+}
+
+int notify_not_full(queue_t * q, unsigned int n) {
+    event_notify(&q->ctrl.full, n);
+    return 0;
+}
+
+int wait_full(queue_ctrl_t * dctrl, struct timespec * abstime){
+    return _wait_event(dctrl, &(dctrl->full), abstime);
+}
+
+/*
+* the subscribers of a broadcast do not keep their elements under
+* their mutex either, they are handled apart by each operation
+*/
+static inline int _is_lock_free(queue_t * q){
+    return q->type == QUEUE_SPSC || q->type == QUEUE_MPMC ||
+        q->type == QUEUE_BROADCAST;
+}
+
+static inline int _is_subscriber(queue_t * q){
+    return q->type == QUEUE_BROADCAST;
+}
+
+static inline int _is_fifo(queue_t * q){
+    return q->type == QUEUE_FIFO || _is_lock_free(q);
+}
+
+/*
+* 1 if a locked queue was empty before k elements were put (or full
+* before k elements were taken), the mutex must be held
+*/
+#define _was_empty(q, k) (rb_has_next(&(q)->rb) == (k))
+#define _was_full(q, k) (rb_available(&(q)->rb) == (k))
+
+static inline buffer_write _fifo_write(queue_t * q){
+    switch(q->type){
+    case QUEUE_SPSC: return spsc_write;
+    case QUEUE_MPMC: return mpmc_write;
+    default: return rb_write;
     }
 }
 
-static inline int __notify_condition(pthread_cond_t * cond)
+static inline buffer_take _fifo_take(queue_t * q){
+    switch(q->type){
+    case QUEUE_SPSC: return spsc_take;
+    case QUEUE_MPMC: return mpmc_take;
+    default: return rb_take;
+    }
+}
+
+static inline buffer_write_many _fifo_write_many(queue_t * q){
+    switch(q->type){
+    case QUEUE_SPSC: return spsc_write_many;
+    case QUEUE_MPMC: return mpmc_write_many;
+    default: return rb_write_many;
+    }
+}
+
+static inline buffer_take_many _fifo_take_many(queue_t * q){
+    switch(q->type){
+    case QUEUE_SPSC: return spsc_take_many;
+    case QUEUE_MPMC: return mpmc_take_many;
+    default: return rb_take_many;
+    }
+}
+
+/*
+* the lock free side published its change to the ring, waiters are
+* woken up without the mutex, it is only taken when callbacks are
+* registered. notify issues the fence that orders the change before
+* the read of listeners.
+*/
+static inline void _lf_notify(queue_t * q,
+        int(*notify)(queue_t * q, unsigned int n), unsigned int n,
+        atomic_uint * listeners, struct notification_callback_st * nc)
+{
+    notify(q, n);
+    if(atomic_load_explicit(listeners, memory_order_relaxed) == 0)
+        return;
+    //the lock free rings do not tell the transitions apart, the
+    //edge triggered callbacks run every time
+    _queue_lock(q);
+    callback_snapshot_t cs = _queue_callback(q, nc, 1);
+    _queue_unlock(q);
+    _callback_run(&cs);
+}
+
+void _lf_notify_not_empty(queue_t * q, unsigned int n){
+    _lf_notify(q, notify_not_empty, n, &q->ctrl.not_empty_listeners,
+            q->ctrl.not_empty_callback);
+}
+
+void _lf_notify_not_full(queue_t * q, unsigned int n){
+    _lf_notify(q, notify_not_full, n, &q->ctrl.not_full_listeners,
+            q->ctrl.not_full_callback);
+}
+
+/*
+* lock free queues never take the mutex to wait, the waiter registers
+* on the event then checks the ring again before sleeping.
+* may return 0 before the condition is satisfied
+*/
+static inline int _lf_wait_not_empty(queue_t * q,
+        struct timespec * abstime)
 {
-    if(pthread_cond_broadcast(cond) == 0){
+    unsigned int key = event_prepare_wait(&q->ctrl.empty);
+    if(lf_used(&(q->rb)) > 0 || _queue_closed(q)){
+        event_cancel_wait(&q->ctrl.empty);
         return 0;
-    }else
-        return EINVAL;
+    }
+    return _spin_then_wait(&q->ctrl, &q->ctrl.empty, key, abstime);
 }
 
-int notify_not_empty(queue_t * q) {
-    return __notify_condition(&q->ctrl.empty);
+static inline int _lf_wait_not_full(queue_t * q,
+        struct timespec * abstime)
+{
+    unsigned int key = event_prepare_wait(&q->ctrl.full);
+    if(lf_used(&(q->rb)) < q->rb.n || _queue_closed(q)){
+        event_cancel_wait(&q->ctrl.full);
+        return 0;
+    }
+    return _spin_then_wait(&q->ctrl, &q->ctrl.full, key, abstime);
 }
 
-int wait_empty(dctrl_t * dctrl, struct timespec * abstime){
-    if(abstime)
-	return pthread_cond_timedwait(&(dctrl->empty),
-				 &(dctrl->mutex),
-				 abstime);
-    else
-	return pthread_cond_wait(&(dctrl->empty),
-				 &(dctrl->mutex));
+/*
+* consumers read the closed flag before trying the ring, so that when
+* they see it set they also see every element put before the close
+*/
+int _lf_queue_take(queue_t * queue, void * data,
+        struct timespec * abstime, buffer_take f)
+{
+    int err;
+    int closed = _queue_closed(queue);
+    while(f(&(queue->rb), data) == 0){
+        if(closed)
+            return EPIPE;
+        if((err = _lf_wait_not_empty(queue, abstime)) != 0)
+            return err;
+        closed = _queue_closed(queue);
+    }
+    _lf_notify_not_full(queue, 1);
+    return 0;
 }
 
-int notify_not_full(queue_t * q) {
-    return __notify_condition(&q->ctrl.full);
+int _lf_queue_try_take(queue_t * q, void * data, buffer_take f){
+    int closed = _queue_closed(q);
+    if(f(&(q->rb), data) == 0)
+        return closed ? EPIPE : EAGAIN;
+    _lf_notify_not_full(q, 1);
+    return 0;
 }
 
-int wait_full(dctrl_t * dctrl, struct timespec * abstime){
-    if(abstime)
-	return pthread_cond_timedwait(&(dctrl->full),
-				 &(dctrl->mutex), 
-				 abstime);
-    else
-	return pthread_cond_wait(&(dctrl->full),
-				 &(dctrl->mutex));
+int _lf_queue_put(queue_t * queue, void * value,
+        struct timespec * abstime, buffer_write f, int priority)
+{
+    int err;
+    while(1){
+        if(_queue_closed(queue))
+            return EPIPE;
+        if(f(&(queue->rb), value, priority))
+            break;
+        if((err = _lf_wait_not_full(queue, abstime)) != 0)
+            return err;
+    }
+    _lf_notify_not_empty(queue, 1);
+    return 0;
+}
+
+int _lf_queue_try_put(queue_t * q, void * data,
+        buffer_write f, int priority)
+{
+    if(_queue_closed(q))
+        return EPIPE;
+    if(f(&(q->rb), data, priority) == 0)
+        return EAGAIN;
+    _lf_notify_not_empty(q, 1);
+    return 0;
 }
 
-void _gettimer(struct timespec * ts, unsigned int sec){
-    struct timeval tv;
-    gettimeofday(&tv, NULL);    
-    ts->tv_nsec = 0;
-    ts->tv_sec = tv.tv_sec + sec;
+void _queue_put_done(queue_t * q, unsigned int n){
+    notify_not_empty(q, n);
+    callback_snapshot_t cs = _queue_callback(q, q->ctrl.not_empty_callback,
+            _was_empty(q, n));
+    pthread_mutex_unlock(&(q->ctrl.mutex));
+    _callback_run(&cs);
 }
 
-typedef int (*mutex_lock_t)(pthread_mutex_t *);
+void _queue_take_done(queue_t * q, unsigned int n){
+    notify_not_full(q, n);
+    callback_snapshot_t cs = _queue_callback(q, q->ctrl.not_full_callback,
+            _was_full(q, n));
+    pthread_mutex_unlock(&(q->ctrl.mutex));
+    _callback_run(&cs);
+}
 
 int _queue_take(queue_t *queue, void * data, 
         struct timespec * abstime, buffer_take f)
 {
+    unsigned int taken;
+    if(_is_subscriber(queue))
+        return _broadcast_take(queue, data, 1, &taken, abstime, 1);
+    if(_is_lock_free(queue))
+        return _lf_queue_take(queue, data, abstime, f);
     int err;
     if((err = pthread_mutex_lock(&(queue->ctrl.mutex))) != 0)
         return err;
     int res;
     while((res = f(&(queue->rb), data)) == 0){
-        if((err = wait_empty(&(queue->ctrl), abstime)) != 0) {
+        if(_queue_closed(queue))
+            err = EPIPE;
+        else
+            err = wait_empty(&(queue->ctrl), abstime);
+        if(err != 0){
 	    pthread_mutex_unlock(&(queue->ctrl.mutex));
 	    return err;
 	}
     }
-    notify_not_full(queue);
-    _queue_callback(queue, queue->ctrl.not_full_callback);
-    pthread_mutex_unlock(&(queue->ctrl.mutex));
+    _queue_take_done(queue, 1);
     return 0;
 }
 
 int _queue_try_take(queue_t * q, void * data, 
         buffer_take f,
-        mutex_lock_t mutex_lock)
+        queue_mutex_lock_t mutex_lock)
 {
+    unsigned int taken;
+    if(_is_subscriber(q))
+        return _broadcast_take(q, data, 1, &taken, NULL, 0);
+    if(_is_lock_free(q))
+        return _lf_queue_try_take(q, data, f);
     int err = 0;
+    callback_snapshot_t cs = {0};
     if((err = mutex_lock(&(q->ctrl.mutex))) != 0)
         return err;
     if(f(&(q->rb), data) == 0){
-        err = EAGAIN;
+        err = _queue_closed(q) ? EPIPE : EAGAIN;
         goto end_queue_try_take;
     }
-    notify_not_full(q);
-    _queue_callback(q, q->ctrl.not_full_callback);
+    notify_not_full(q, 1);
+    cs = _queue_callback(q, q->ctrl.not_full_callback, _was_full(q, 1));
 end_queue_try_take:
     pthread_mutex_unlock(&(q->ctrl.mutex));
+    _callback_run(&cs);
     return err;
 }
 
 int _queue_put(queue_t * queue, void * value, 
         struct timespec * abstime, buffer_write f, int priority)
 {
+    if(_is_subscriber(queue))
+        return EINVAL;
+    if(_is_lock_free(queue))
+        return _lf_queue_put(queue, value, abstime, f, priority);
     int err;
     if((err = pthread_mutex_lock(&(queue->ctrl.mutex))) != 0)
         return err;
-    int res;
-    while((res = f(&(queue->rb), value, priority)) == 0){
-        if((err = wait_full(&(queue->ctrl), abstime)) != 0){
+    while(_queue_closed(queue) || f(&(queue->rb), value, priority) == 0){
+        if(_queue_closed(queue))
+            err = EPIPE;
+        else
+            err = wait_full(&(queue->ctrl), abstime);
+        if(err != 0){
 	    pthread_mutex_unlock(&(queue->ctrl.mutex));
 	    return err;
 	}
     }
-    notify_not_empty(queue);
-    _queue_callback(queue, queue->ctrl.not_empty_callback);
-    pthread_mutex_unlock(&(queue->ctrl.mutex));
+    _queue_put_done(queue, 1);
     return 0;
 }
 
 int _queue_try_put(queue_t * q, void * data, 
         buffer_write f, int priority, 
-        mutex_lock_t mutex_lock){
+        queue_mutex_lock_t mutex_lock){
+    if(_is_subscriber(q))
+        return EINVAL;
+    if(_is_lock_free(q))
+        return _lf_queue_try_put(q, data, f, priority);
     int err = 0;
+    callback_snapshot_t cs = {0};
     if((err = mutex_lock(&(q->ctrl.mutex))) != 0)
         return err;
+    if(_queue_closed(q)){
+        err = EPIPE;
+        goto end_queue_try_put;
+    }
     if(f(&(q->rb), data, priority) == 0){
         err = EAGAIN;
         goto end_queue_try_put;
     }
-    notify_not_empty(q);
-    _queue_callback(q, q->ctrl.not_empty_callback);
+    notify_not_empty(q, 1);
+    cs = _queue_callback(q, q->ctrl.not_empty_callback, _was_empty(q, 1));
 end_queue_try_put:
     pthread_mutex_unlock(&(q->ctrl.mutex));
+    _callback_run(&cs);
+    return err;
+}
+
+/*
+* batch versions of the functions above, they wait until at least one
+* element can be transfered then transfer as many elements as possible
+* in a single critical section and notify once
+*/
+int _queue_take_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken, struct timespec * abstime,
+        buffer_take_many f)
+{
+    int err = 0;
+    *taken = 0;
+    if(n == 0) return 0;
+    if(_is_subscriber(q))
+        return _broadcast_take(q, data, n, taken, abstime, 1);
+    if(_is_lock_free(q)){
+        int closed = _queue_closed(q);
+        while((*taken = f(&(q->rb), data, n)) == 0){
+            if(closed)
+                return EPIPE;
+            if((err = _lf_wait_not_empty(q, abstime)) != 0)
+                return err;
+            closed = _queue_closed(q);
+        }
+        _lf_notify_not_full(q, *taken);
+        return 0;
+    }
+    callback_snapshot_t cs = {0};
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    while((*taken = f(&(q->rb), data, n)) == 0){
+        if(_queue_closed(q))
+            err = EPIPE;
+        else
+            err = wait_empty(&(q->ctrl), abstime);
+        if(err != 0)
+            break;
+    }
+    if(err == 0){
+        notify_not_full(q, *taken);
+        cs = _queue_callback(q, q->ctrl.not_full_callback,
+                _was_full(q, *taken));
+    }
+    _queue_unlock(q);
+    _callback_run(&cs);
+    return err;
+}
+
+int _queue_try_take_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken, buffer_take_many f,
+        queue_mutex_lock_t mutex_lock)
+{
+    int err = 0;
+    *taken = 0;
+    if(_is_subscriber(q))
+        return _broadcast_take(q, data, n, taken, NULL, 0);
+    if(_is_lock_free(q)){
+        int closed = _queue_closed(q);
+        if((*taken = f(&(q->rb), data, n)) == 0)
+            return closed ? EPIPE : EAGAIN;
+        _lf_notify_not_full(q, *taken);
+        return 0;
+    }
+    callback_snapshot_t cs = {0};
+    if((err = mutex_lock(&(q->ctrl.mutex))) != 0)
+        return err;
+    if((*taken = f(&(q->rb), data, n)) == 0){
+        err = _queue_closed(q) ? EPIPE : EAGAIN;
+        goto end_queue_try_take_many;
+    }
+    notify_not_full(q, *taken);
+    cs = _queue_callback(q, q->ctrl.not_full_callback, _was_full(q, *taken));
+end_queue_try_take_many:
+    pthread_mutex_unlock(&(q->ctrl.mutex));
+    _callback_run(&cs);
+    return err;
+}
+
+int _queue_put_many(queue_t * q, void * data, int * priorities,
+        unsigned int n, unsigned int * written,
+        struct timespec * abstime, buffer_write_many f)
+{
+    int err = 0;
+    *written = 0;
+    if(n == 0) return 0;
+    if(_is_subscriber(q))
+        return EINVAL;
+    if(_is_lock_free(q)){
+        while(1){
+            if(_queue_closed(q))
+                return EPIPE;
+            if((*written = f(&(q->rb), data, priorities, n)) > 0)
+                break;
+            if((err = _lf_wait_not_full(q, abstime)) != 0)
+                return err;
+        }
+        _lf_notify_not_empty(q, *written);
+        return 0;
+    }
+    callback_snapshot_t cs = {0};
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    while(_queue_closed(q) ||
+            (*written = f(&(q->rb), data, priorities, n)) == 0){
+        if(_queue_closed(q))
+            err = EPIPE;
+        else
+            err = wait_full(&(q->ctrl), abstime);
+        if(err != 0)
+            break;
+    }
+    if(err == 0){
+        notify_not_empty(q, *written);
+        cs = _queue_callback(q, q->ctrl.not_empty_callback,
+                _was_empty(q, *written));
+    }
+    _queue_unlock(q);
+    _callback_run(&cs);
+    return err;
+}
+
+int _queue_try_put_many(queue_t * q, void * data, int * priorities,
+        unsigned int n, unsigned int * written,
+        buffer_write_many f, queue_mutex_lock_t mutex_lock)
+{
+    int err = 0;
+    *written = 0;
+    if(_is_subscriber(q))
+        return EINVAL;
+    if(_is_lock_free(q)){
+        if(_queue_closed(q))
+            return EPIPE;
+        if((*written = f(&(q->rb), data, priorities, n)) == 0)
+            return EAGAIN;
+        _lf_notify_not_empty(q, *written);
+        return 0;
+    }
+    callback_snapshot_t cs = {0};
+    if((err = mutex_lock(&(q->ctrl.mutex))) != 0)
+        return err;
+    if(_queue_closed(q)){
+        err = EPIPE;
+        goto end_queue_try_put_many;
+    }
+    if((*written = f(&(q->rb), data, priorities, n)) == 0){
+        err = EAGAIN;
+        goto end_queue_try_put_many;
+    }
+    notify_not_empty(q, *written);
+    cs = _queue_callback(q, q->ctrl.not_empty_callback,
+            _was_empty(q, *written));
+end_queue_try_put_many:
+    pthread_mutex_unlock(&(q->ctrl.mutex));
+    _callback_run(&cs);
+    return err;
+}
+
+typedef struct {
+    buffer_acquire reserve;
+    buffer_publish commit;
+    buffer_acquire peek;
+    buffer_publish release;
+}in_place_ops_t;
+
+static const in_place_ops_t _in_place_ops[] = {
+    [QUEUE_FIFO] = {rb_reserve, rb_commit, rb_peek, rb_release},
+    [QUEUE_SPSC] = {spsc_reserve, spsc_commit, spsc_peek, spsc_release},
+    [QUEUE_MPMC] = {mpmc_reserve, mpmc_commit, mpmc_peek, mpmc_release},
+    // the subscribers have no slot of their own
+    [QUEUE_BROADCAST] = {NULL, NULL, NULL, NULL},
+    [QUEUE_BYTES] = {NULL, NULL, NULL, NULL},
+};
+
+/*
+* in place access to a slot of the ring.
+* _queue_acquire gets a slot to write (or read) waiting with wait,
+* it fails with EPIPE when the queue is closed and no slot is
+* available, producers check the closed flag before calling it.
+* _queue_publish hands it over to the other side and wakes up the
+* threads of the same side that were waiting for the slot
+*/
+int _queue_acquire(queue_t * q, void ** slot,
+        struct timespec * abstime, int block, buffer_acquire f,
+        int(*wait)(queue_ctrl_t *, struct timespec *),
+        int(*lf_wait)(queue_t *, struct timespec *))
+{
+    int err = 0;
+    if(_is_subscriber(q))
+        return EINVAL;
+    if(_is_lock_free(q)){
+        int closed = _queue_closed(q);
+        while((*slot = f(&(q->rb))) == NULL){
+            if(closed) return EPIPE;
+            if(!block) return EAGAIN;
+            if((err = lf_wait(q, abstime)) != 0) return err;
+            closed = _queue_closed(q);
+        }
+        return 0;
+    }
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    while((*slot = f(&(q->rb))) == NULL){
+        if(_queue_closed(q))
+            err = EPIPE;
+        else if(!block)
+            err = EAGAIN;
+        else
+            err = wait(&(q->ctrl), abstime);
+        if(err != 0)
+            break;
+    }
+    _queue_unlock(q);
     return err;
 }
 
-int queue_init(queue_t * queue, unsigned int n, size_t size,
-        channel_type_t type)
+int _queue_publish(queue_t * q, void * slot, buffer_publish f,
+        int(*notify)(queue_t * q, unsigned int n),
+        struct notification_callback_st * nc, atomic_uint * listeners,
+        int(*notify_same_side)(queue_t * q, unsigned int n))
+{
+    int err;
+    if(_is_subscriber(q))
+        return EINVAL;
+    if(_is_lock_free(q)){
+        f(&(q->rb), slot);
+        _lf_notify(q, notify, 1, listeners, nc);
+        return 0;
+    }
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    f(&(q->rb), slot);
+    notify(q, 1);
+    callback_snapshot_t cs = _queue_callback(q, nc,
+            nc == q->ctrl.not_empty_callback ?
+            _was_empty(q, 1) : _was_full(q, 1));
+    notify_same_side(q, 1);
+    _queue_unlock(q);
+    _callback_run(&cs);
+    return 0;
+}
+
+/*
+* prio_flags is only used by priority queues, either the flags of
+* heap_init or QUEUE_BUCKETED or'ed with the number of levels.
+* with QUEUE_GROWABLE or'ed in, the fifo (or heap) grows up to hard
+* elements and keeps n of them once drained, see queue_new_growable.
+* the lock free rings and the buckets have a fixed capacity
+*/
+int queue_init(queue_t * queue, unsigned int n, unsigned int hard,
+        size_t size, queue_type_t type, unsigned int prio_flags)
 {
     queue->type = type;
     int err_code;
-    if((err_code = init_dctrl(&(queue->ctrl))) != 0) 
+    if((err_code = _queue_ctrl_init(&(queue->ctrl))) != 0) 
 	return err_code;
-    if((type == FIFO_CHANNEL && 
-                (err_code = buffer_init(&(queue->rb), n, size, RING_BUFFER)) != 0) ||
-            (type == PRIORITY_CHANNEL &&
-             (err_code = heap_init(&(queue->rb), n, size)) != 0)){ 
-	dctrl_free(&queue->ctrl);
+    if(prio_flags & QUEUE_GROWABLE)
+        err_code = type == QUEUE_FIFO ?
+            buffer_init_growable(&(queue->rb), n, hard, size) :
+            heap_init_growable(&(queue->rb), n, hard, size,
+                    prio_flags & ~QUEUE_GROWABLE);
+    else if(type == QUEUE_FIFO)
+        err_code = buffer_init(&(queue->rb), n, size, RING_BUFFER);
+    else if(type == QUEUE_SPSC)
+        err_code = buffer_init(&(queue->rb), n, size, SPSC_BUFFER);
+    else if(type == QUEUE_MPMC)
+        err_code = buffer_init(&(queue->rb), n, size, MPMC_BUFFER);
+    else if(type == QUEUE_PRIORITY && !(prio_flags & QUEUE_BUCKETED))
+        err_code = heap_init(&(queue->rb), n, size, prio_flags);
+    else if(type == QUEUE_PRIORITY)
+        err_code = bucket_init(&(queue->rb), n, size,
+                prio_flags & ~QUEUE_BUCKETED);
+    else if(type == QUEUE_BYTES)
+        err_code = bytes_init(&(queue->rb), n);
+    if(err_code != 0){
+	_queue_ctrl_free(&queue->ctrl);
 	return err_code;
     }
     return 0;
 }
 
-queue_t * _queue_new(unsigned int n, size_t size, channel_type_t type){
-    queue_t * q = calloc(1, sizeof(queue_t));
-    if(!q) return q;
-    if(queue_init(q, n, size, type) != 0){
+static queue_t * _queue_alloc(unsigned int n, unsigned int hard,
+        size_t size, queue_type_t type, unsigned int prio_flags)
+{
+    queue_t * q;
+    if(posix_memalign((void**)&q, CACHE_LINE_SIZE, sizeof(queue_t)))
+        return NULL;
+    memset(q, 0, sizeof(queue_t));
+    if(queue_init(q, n, hard, size, type, prio_flags) != 0){
 	free(q);
 	return NULL;
     }
     return q;
 }
 
-void queue_free(queue_t * queue){
-    buffer_free(&(queue->rb));
-    dctrl_free(&(queue->ctrl));
-    free(queue);
+queue_t * _queue_new(unsigned int n, size_t size, queue_type_t type,
+        unsigned int prio_flags)
+{
+    return _queue_alloc(n, 0, size, type, prio_flags);
 }
 
-int queue_take(queue_t * q, void * data){
-    assert(q->type == FIFO_CHANNEL);
-    return _queue_take(q, data, NULL, rb_take);
+/*
+* an arena starts with a cache line holding its header, followed by
+* the count queues and then their rings
+*/
+typedef struct queue_arena_st {
+    struct queue_arena_st * next;
+} queue_arena_t;
+
+struct queue_pool_st {
+    pthread_mutex_t mutex;
+    unsigned int n;
+    size_t size;
+    unsigned int count;
+    // number of queues handed out and not given back yet
+    unsigned int live;
+    queue_t * free;
+    queue_arena_t * arenas;
+};
+
+#define _arena_stride(pool) \
+    (((pool)->n*(pool)->size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1))
+#define _arena_queue(a, i) \
+    ((queue_t*)((char*)(a) + CACHE_LINE_SIZE) + (i))
+#define _arena_ring(pool, a, i) \
+    ((char*)_arena_queue((a), (pool)->count) + (i)*_arena_stride(pool))
+
+static void _arena_destroy(queue_arena_t * a, unsigned int k){
+    unsigned int i;
+    for(i = 0; i < k; i++){
+        queue_t * q = _arena_queue(a, i);
+        q->rb.buffer = NULL;
+        buffer_free(&(q->rb));
+        _queue_ctrl_free(&(q->ctrl));
+    }
+    free(a);
 }
 
-int queue_try_take(queue_t *q, void * data){
-    assert(q->type == FIFO_CHANNEL);
-    return _queue_try_take(q, data, rb_take, 
-            pthread_mutex_trylock);
+// called with the pool mutex held
+static int _queue_pool_grow(queue_pool_t * pool){
+    queue_arena_t * a;
+    unsigned int i;
+    size_t footprint;
+    //the rings and the arena must not wrap around, see aligned_calloc
+    if(pool->size && pool->n > SIZE_MAX / 2 / pool->size)
+        return ENOMEM;
+    footprint = sizeof(queue_t) + _arena_stride(pool);
+    if(pool->count > (SIZE_MAX - CACHE_LINE_SIZE) / footprint)
+        return ENOMEM;
+    if(posix_memalign((void**)&a, CACHE_LINE_SIZE, CACHE_LINE_SIZE +
+                pool->count*footprint))
+        return ENOMEM;
+    for(i = 0; i < pool->count; i++){
+        queue_t * q = _arena_queue(a, i);
+        memset(q, 0, sizeof(queue_t));
+        q->type = QUEUE_FIFO;
+        if(_queue_ctrl_init(&(q->ctrl)) != 0){
+            _arena_destroy(a, i);
+            return ENOMEM;
+        }
+        buffer_init_at(&(q->rb), _arena_ring(pool, a, i), pool->n,
+                pool->size, RING_BUFFER);
+        q->pool = pool;
+    }
+    for(i = pool->count; i > 0; i--){
+        queue_t * q = _arena_queue(a, i - 1);
+        q->pool_next = pool->free;
+        pool->free = q;
+    }
+    a->next = pool->arenas;
+    pool->arenas = a;
+    return 0;
 }
 
-int queue_no_wait_take(queue_t * q, void * data){
-    assert(q->type == FIFO_CHANNEL);
-    return _queue_try_take(q, data, rb_take, 
-            pthread_mutex_lock);
+queue_pool_t * queue_pool_new(unsigned int n, size_t size,
+        unsigned int count)
+{
+    queue_pool_t * pool;
+    if(count == 0 || (pool = calloc(1, sizeof(queue_pool_t))) == NULL)
+        return NULL;
+    if(pthread_mutex_init(&(pool->mutex), NULL)){
+        free(pool);
+        return NULL;
+    }
+    pool->n = n;
+    pool->size = size;
+    pool->count = count;
+    if(_queue_pool_grow(pool) != 0){
+        pthread_mutex_destroy(&(pool->mutex));
+        free(pool);
+        return NULL;
+    }
+    return pool;
 }
 
-int queue_timed_take(queue_t * q, void * data, unsigned int sec){
-    assert(q->type == FIFO_CHANNEL);
-    struct timespec ts;
-    _gettimer(&ts, sec);
-    return _queue_take(q, data, &ts, rb_take);
+queue_t * queue_pool_get(queue_pool_t * pool){
+    queue_t * q = NULL;
+    pthread_mutex_lock(&(pool->mutex));
+    if(pool->free != NULL || _queue_pool_grow(pool) == 0){
+        q = pool->free;
+        pool->free = q->pool_next;
+        q->pool_next = NULL;
+        pool->live++;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+    return q;
 }
 
-int queue_put(queue_t *q, void *data){
-    assert(q->type == FIFO_CHANNEL);
-    return _queue_put(q, data, NULL, rb_write, 0);
+/*
+* nobody else uses a queue being freed, so it is reset without
+* taking its lock
+*/
+static void _queue_pool_put(queue_t * q){
+    queue_pool_t * pool = q->pool;
+    q->rb.write_reserved = 0;
+    q->rb.read_reserved = 0;
+    buffer_reset(&(q->rb));
+    q->ctrl.max_spin = 0;
+    atomic_store(&q->ctrl.spin_budget, q->ctrl.max_spin);
+    atomic_store(&q->ctrl.closed, 0);
+    pthread_mutex_lock(&(pool->mutex));
+    q->pool_next = pool->free;
+    pool->free = q;
+    pool->live--;
+    pthread_mutex_unlock(&(pool->mutex));
 }
 
-int queue_try_put(queue_t *q, void *data){
-    assert(q->type == FIFO_CHANNEL);
-    return _queue_try_put(q, data, rb_write, 0, 
-            pthread_mutex_trylock);
+int queue_pool_free(queue_pool_t * pool){
+    pthread_mutex_lock(&(pool->mutex));
+    if(pool->live){
+        pthread_mutex_unlock(&(pool->mutex));
+        return EBUSY;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+    while(pool->arenas){
+        queue_arena_t * a = pool->arenas;
+        pool->arenas = a->next;
+        _arena_destroy(a, pool->count);
+    }
+    pthread_mutex_destroy(&(pool->mutex));
+    free(pool);
+    return 0;
 }
 
-int queue_no_wait_put(queue_t *q, void *data){
-    assert(q->type == FIFO_CHANNEL);
-    return _queue_try_put(q, data, rb_write, 0, 
-            pthread_mutex_lock);
+int queue_close(queue_t * q){
+    int err;
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    atomic_store(&q->ctrl.closed, 1);
+    notify_not_empty(q, EVENT_ALL);
+    notify_not_full(q, EVENT_ALL);
+    callback_snapshot_t not_empty = _queue_callback(q,
+            q->ctrl.not_empty_callback, 1);
+    callback_snapshot_t not_full = _queue_callback(q,
+            q->ctrl.not_full_callback, 1);
+    _queue_unlock(q);
+    _callback_run(&not_empty);
+    _callback_run(&not_full);
+    return 0;
 }
 
-int queue_timed_put(queue_t * q, void *data, unsigned int sec){
-    assert(q->type == FIFO_CHANNEL);
-    struct timespec ts;
-    _gettimer(&ts, sec);
-    return _queue_put(q, data, &ts, rb_write, 0);
+int queue_reset(queue_t * q){
+    int err;
+    if(_is_lock_free(q))
+        return EINVAL;
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    if(q->rb.write_reserved || q->rb.read_reserved){
+        _queue_unlock(q);
+        return EBUSY;
+    }
+    /*
+    * a bytes queue is full for the next message only, any room made
+    * counts as for _queue_release_bytes
+    */
+    int was_full = q->type == QUEUE_BYTES ? q->rb.bytes > 0 :
+        rb_available(&(q->rb)) == 0;
+    buffer_reset(&(q->rb));
+    q->ctrl.resets++;
+    notify_not_empty(q, EVENT_ALL);
+    notify_not_full(q, EVENT_ALL);
+    callback_snapshot_t cs = _queue_callback(q, q->ctrl.not_full_callback,
+            was_full);
+    _queue_unlock(q);
+    _callback_run(&cs);
+    return 0;
 }
 
-queue_t * queue_new(unsigned int n, size_t size){
-    return _queue_new(n, size, FIFO_CHANNEL);
+size_t queue_footprint(unsigned int n, size_t size){
+    return CACHE_LINE_SIZE - 1 + sizeof(queue_t) + (size_t)n*size;
 }
 
-priority_queue_t * priority_queue_new(unsigned int n, size_t size){
-    return _queue_new(n, size, PRIORITY_CHANNEL);
+queue_t * queue_init_at(void * mem, unsigned int n, size_t size){
+    queue_t * q = (queue_t*)(((uintptr_t)mem + CACHE_LINE_SIZE - 1) &
+            ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    memset(q, 0, sizeof(queue_t));
+    q->type = QUEUE_FIFO;
+    q->in_place = 1;
+    if(_queue_ctrl_init(&(q->ctrl)) != 0)
+        return NULL;
+    buffer_init_at(&(q->rb), q + 1, n, size, RING_BUFFER);
+    return q;
 }
 
-int priority_queue_take(priority_queue_t * q, void * data){
-    assert(q->type == PRIORITY_CHANNEL);
-    return _queue_take(q, data, NULL, hb_take);
+int queue_is_closed(queue_t * q){
+    return _queue_closed(q);
 }
 
-int priority_queue_try_take(priority_queue_t * q, void * data){
-    assert(q->type == PRIORITY_CHANNEL);
-    return _queue_try_take(q, data, hb_take, 
-            pthread_mutex_trylock);
+/*
+* the eventfds are signaled by edge callbacks, writing to an eventfd
+* only fails once its counter reaches 2^64 - 2, it is readable then
+*/
+#define EVENTFD_NOT_EMPTY 0
+#define EVENTFD_NOT_FULL 1
+
+int _queue_peek_used(queue_t * q);
+int _queue_peek_available(queue_t * q);
+
+static void __eventfd_callback(queue_t * q, void * data){
+    (void)q;
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t res = write((int)(intptr_t)data, &one, sizeof(one));
+    (void)res;
+#else
+    (void)data;
+#endif
 }
 
-int priority_queue_no_wait_take(priority_queue_t * q, 
-        void * data)
-{
-    assert(q->type == PRIORITY_CHANNEL);
-    return _queue_try_take(q, data, hb_take, 
-            pthread_mutex_lock);
+static int _queue_eventfd(queue_t * q, int side){
+#ifdef __linux__
+    int fd;
+    pthread_mutex_lock(&(q->ctrl.cb_mutex));
+    if((fd = q->ctrl.efd[side]) >= 0)
+        goto end_queue_eventfd;
+    if((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto end_queue_eventfd;
+    void * data = (void*)(intptr_t)fd;
+    notification_callback_t * nc = side == EVENTFD_NOT_EMPTY ?
+        queue_append_not_empty_edge_callback(q, __eventfd_callback, data) :
+        queue_append_not_full_edge_callback(q, __eventfd_callback, data);
+    if(nc == NULL){
+        close(fd);
+        errno = ENOMEM;
+        fd = -1;
+        goto end_queue_eventfd;
+    }
+    q->ctrl.efd[side] = fd;
+    q->ctrl.efd_nc[side] = nc;
+    //the queue may already satisfy the condition
+    _queue_lock(q);
+    int ready = side == EVENTFD_NOT_EMPTY ?
+        _queue_peek_used(q) > 0 : _queue_peek_available(q) > 0;
+    _queue_unlock(q);
+    if(ready)
+        __eventfd_callback(q, data);
+end_queue_eventfd:
+    pthread_mutex_unlock(&(q->ctrl.cb_mutex));
+    return fd;
+#else
+    (void)q;
+    (void)side;
+    errno = ENOSYS;
+    return -1;
+#endif
 }
 
-int priority_queue_timed_take(priority_queue_t * q, 
-        void * data, unsigned int sec){
-    assert(q->type == PRIORITY_CHANNEL);
-    struct timespec ts;
-    _gettimer(&ts, sec);
-    return _queue_take(q, data, &ts, hb_take);
+int queue_eventfd_not_empty(queue_t * q){
+    return _queue_eventfd(q, EVENTFD_NOT_EMPTY);
+}
+
+int queue_eventfd_not_full(queue_t * q){
+    return _queue_eventfd(q, EVENTFD_NOT_FULL);
+}
+
+// nobody else uses a queue being freed
+static void _queue_eventfd_free(queue_t * q){
+#ifdef __linux__
+    int side;
+    for(side = 0; side < 2; side++){
+        if(q->ctrl.efd[side] < 0)
+            continue;
+        queue_remove_callback(q->ctrl.efd_nc[side]);
+        close(q->ctrl.efd[side]);
+        q->ctrl.efd[side] = -1;
+        q->ctrl.efd_nc[side] = NULL;
+    }
+#else
+    (void)q;
+#endif
+}
+
+void queue_deadline(struct timespec * deadline, uint64_t nsec){
+    monotonic_deadline(deadline, nsec);
+}
+
+void queue_set_spin(queue_t * q, unsigned int max_spin){
+    q->ctrl.max_spin = max_spin;
+    atomic_store(&q->ctrl.spin_budget, max_spin);
+}
+
+/*
+* removes and frees every callback still registered on q, one at a
+* time as queue_remove_callback does
+*/
+void __selector_callback(queue_t * q, void * data);
+static void _selector_detach(void * data);
+
+/*
+* the callbacks of the selectors q is registered in are removed along
+* with the others, their entries are dropped from the selectors
+*/
+static void _queue_callbacks_free(queue_t * q){
+    struct notification_callback_st * heads[] = {
+        q->ctrl.not_full_callback, q->ctrl.not_empty_callback
+    };
+    struct notification_callback_st * nc;
+    unsigned int i, epoch;
+    pthread_mutex_lock(&(q->ctrl.cb_mutex));
+    for(i = 0; i < 2; i++){
+        while(1){
+            _queue_lock(q);
+            if((nc = heads[i]->n) == NULL){
+                _queue_unlock(q);
+                break;
+            }
+            epoch = _remove_callback(nc);
+            _queue_unlock(q);
+            _callback_sync(q, epoch);
+            if(nc->callback == __selector_callback)
+                _selector_detach(nc->data);
+            free(nc);
+        }
+    }
+    pthread_mutex_unlock(&(q->ctrl.cb_mutex));
+}
+
+void queue_free(queue_t * queue){
+    _queue_eventfd_free(queue);
+    _queue_callbacks_free(queue);
+    if(_is_subscriber(queue))
+        _broadcast_unsubscribe(queue);
+    if(queue->pool){
+        _queue_pool_put(queue);
+        return;
+    }
+    if(queue->in_place)
+        queue->rb.buffer = NULL;
+    buffer_free(&(queue->rb));
+    _queue_ctrl_free(&(queue->ctrl));
+    if(!queue->in_place)
+        free(queue);
+}
+
+int queue_take(queue_t * q, void * data){
+    assert(_is_fifo(q));
+    return _queue_take(q, data, NULL, _fifo_take(q));
+}
+
+int queue_try_take(queue_t *q, void * data){
+    assert(_is_fifo(q));
+    return _queue_try_take(q, data, _fifo_take(q), 
+            pthread_mutex_trylock);
+}
+
+int queue_no_wait_take(queue_t * q, void * data){
+    assert(_is_fifo(q));
+    return _queue_try_take(q, data, _fifo_take(q), 
+            pthread_mutex_lock);
+}
+
+int queue_timed_take(queue_t * q, void * data,
+        unsigned int sec)
+{
+    return queue_take_for(q, data, sec*1000000000ULL);
+}
+
+int queue_take_for(queue_t * q, void * data,
+        uint64_t nsec)
+{
+    struct timespec ts;
+    monotonic_deadline(&ts, nsec);
+    return queue_take_until(q, data, &ts);
+}
+
+int queue_take_until(queue_t * q, void * data,
+        const struct timespec * deadline)
+{
+    assert(_is_fifo(q));
+    struct timespec ts = *deadline;
+    return _queue_take(q, data, &ts, _fifo_take(q));
+}
+
+int queue_put(queue_t *q, void *data){
+    assert(_is_fifo(q));
+    return _queue_put(q, data, NULL, _fifo_write(q), 0);
+}
+
+int queue_try_put(queue_t *q, void *data){
+    assert(_is_fifo(q));
+    return _queue_try_put(q, data, _fifo_write(q), 0, 
+            pthread_mutex_trylock);
+}
+
+int queue_no_wait_put(queue_t *q, void *data){
+    assert(_is_fifo(q));
+    return _queue_try_put(q, data, _fifo_write(q), 0, 
+            pthread_mutex_lock);
+}
+
+int queue_timed_put(queue_t * q, void * data,
+        unsigned int sec)
+{
+    return queue_put_for(q, data, sec*1000000000ULL);
+}
+
+int queue_put_for(queue_t * q, void * data,
+        uint64_t nsec)
+{
+    struct timespec ts;
+    monotonic_deadline(&ts, nsec);
+    return queue_put_until(q, data, &ts);
+}
+
+int queue_put_until(queue_t * q, void * data,
+        const struct timespec * deadline)
+{
+    assert(_is_fifo(q));
+    struct timespec ts = *deadline;
+    return _queue_put(q, data, &ts, _fifo_write(q), 0);
+}
+
+queue_t * queue_new(unsigned int n, size_t size){
+    return _queue_new(n, size, QUEUE_FIFO, 0);
+}
+
+queue_t * queue_new_spsc(unsigned int n, size_t size){
+    return _queue_new(n, size, QUEUE_SPSC, 0);
+}
+
+queue_t * queue_new_mpmc(unsigned int n, size_t size){
+    return _queue_new(n, size, QUEUE_MPMC, 0);
+}
+
+queue_t * queue_new_growable(unsigned int soft, unsigned int hard,
+        size_t size)
+{
+    return _queue_alloc(soft, hard, size, QUEUE_FIFO, QUEUE_GROWABLE);
+}
+
+/*
+* the variable length messages of queue_new_bytes, always under the
+* mutex. there is no full state for these queues, a message may not
+* fit while others do, so the not full callbacks run on every take
+*/
+static int _queue_put_bytes(queue_t * q, const void * data, size_t len,
+        struct timespec * abstime, int block)
+{
+    int err = 0;
+    callback_snapshot_t cs = {0};
+    assert(q->type == QUEUE_BYTES);
+    if(len > bytes_max(&(q->rb)))
+        return EMSGSIZE;
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    while(_queue_closed(q) || bytes_write(&(q->rb), data, len) == 0){
+        if(_queue_closed(q))
+            err = EPIPE;
+        else if(!block)
+            err = EAGAIN;
+        else
+            err = wait_full(&(q->ctrl), abstime);
+        if(err != 0)
+            break;
+    }
+    if(err == 0){
+        notify_not_empty(q, 1);
+        cs = _queue_callback(q, q->ctrl.not_empty_callback,
+                _was_empty(q, 1));
+    }
+    _queue_unlock(q);
+    _callback_run(&cs);
+    return err;
+}
+
+/*
+* peeks the oldest message, the mutex must be held and is kept.
+* a peeked message blocks the other consumers until it is released
+*/
+static int _queue_peek_bytes(queue_t * q, void ** data, size_t * len,
+        struct timespec * abstime, int block)
+{
+    int err = 0;
+    while((*data = bytes_peek(&(q->rb), len)) == NULL){
+        if(_queue_closed(q) && !q->rb.read_reserved)
+            err = EPIPE;
+        else if(!block)
+            err = EAGAIN;
+        else
+            err = wait_empty(&(q->ctrl), abstime);
+        if(err != 0)
+            break;
+    }
+    return err;
+}
+
+// the mutex must be held, it is released
+static int _queue_release_bytes(queue_t * q){
+    bytes_release(&(q->rb));
+    notify_not_full(q, EVENT_ALL);
+    callback_snapshot_t cs = _queue_callback(q,
+            q->ctrl.not_full_callback, 1);
+    //the consumers waiting for the peeked message, or for EPIPE
+    if(_queue_closed(q))
+        notify_not_empty(q, EVENT_ALL);
+    else if(rb_has_next(&(q->rb)))
+        notify_not_empty(q, 1);
+    _queue_unlock(q);
+    _callback_run(&cs);
+    return 0;
+}
+
+static int _queue_take_bytes(queue_t * q, void * data, size_t cap,
+        size_t * len, struct timespec * abstime, int block)
+{
+    int err;
+    void * msg;
+    assert(q->type == QUEUE_BYTES);
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    if((err = _queue_peek_bytes(q, &msg, len, abstime, block)) != 0){
+        _queue_unlock(q);
+        return err;
+    }
+    if(*len > cap){
+        q->rb.read_reserved = 0;
+        _queue_unlock(q);
+        return EMSGSIZE;
+    }
+    memcpy(data, msg, *len);
+    return _queue_release_bytes(q);
+}
+
+queue_t * queue_new_bytes(unsigned int capacity){
+    return _queue_new(capacity, 1, QUEUE_BYTES, 0);
+}
+
+int queue_put_bytes(queue_t * q, const void * data, size_t len){
+    return _queue_put_bytes(q, data, len, NULL, 1);
+}
+
+int queue_put_bytes_for(queue_t * q, const void * data, size_t len,
+        uint64_t nsec)
+{
+    struct timespec ts;
+    queue_deadline(&ts, nsec);
+    return _queue_put_bytes(q, data, len, &ts, 1);
+}
+
+int queue_try_put_bytes(queue_t * q, const void * data, size_t len){
+    return _queue_put_bytes(q, data, len, NULL, 0);
+}
+
+int queue_take_bytes(queue_t * q, void * data, size_t cap, size_t * len){
+    return _queue_take_bytes(q, data, cap, len, NULL, 1);
+}
+
+int queue_take_bytes_for(queue_t * q, void * data, size_t cap,
+        size_t * len, uint64_t nsec)
+{
+    struct timespec ts;
+    queue_deadline(&ts, nsec);
+    return _queue_take_bytes(q, data, cap, len, &ts, 1);
+}
+
+int queue_try_take_bytes(queue_t * q, void * data, size_t cap,
+        size_t * len)
+{
+    return _queue_take_bytes(q, data, cap, len, NULL, 0);
+}
+
+static int _queue_peek_bytes_unlocked(queue_t * q, void ** data,
+        size_t * len, int block)
+{
+    int err;
+    assert(q->type == QUEUE_BYTES);
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    err = _queue_peek_bytes(q, data, len, NULL, block);
+    _queue_unlock(q);
+    return err;
+}
+
+int queue_peek_bytes(queue_t * q, void ** data, size_t * len){
+    return _queue_peek_bytes_unlocked(q, data, len, 1);
+}
+
+int queue_try_peek_bytes(queue_t * q, void ** data, size_t * len){
+    return _queue_peek_bytes_unlocked(q, data, len, 0);
+}
+
+int queue_release_bytes(queue_t * q){
+    int err;
+    assert(q->type == QUEUE_BYTES);
+    if((err = _queue_lock(q)) != 0)
+        return err;
+    return _queue_release_bytes(q);
+}
+
+priority_queue_t * priority_queue_new(unsigned int n, size_t size){
+    return _queue_new(n, size, QUEUE_PRIORITY, 2);
+}
+
+priority_queue_t * priority_queue_new_dary(unsigned int n, size_t size,
+        unsigned int arity)
+{
+    if(arity & HEAP_STABLE)
+        return NULL;
+    return _queue_new(n, size, QUEUE_PRIORITY, arity);
+}
+
+priority_queue_t * priority_queue_new_stable(unsigned int n, size_t size,
+        unsigned int arity)
+{
+    if(arity & HEAP_STABLE)
+        return NULL;
+    return _queue_new(n, size, QUEUE_PRIORITY, arity | HEAP_STABLE);
+}
+
+priority_queue_t * priority_queue_new_bucketed(unsigned int n, size_t size,
+        unsigned int levels)
+{
+    if(levels & QUEUE_BUCKETED)
+        return NULL;
+    return _queue_new(n, size, QUEUE_PRIORITY, levels | QUEUE_BUCKETED);
+}
+
+priority_queue_t * priority_queue_new_growable(unsigned int soft,
+        unsigned int hard, size_t size, unsigned int arity)
+{
+    if(arity & QUEUE_GROWABLE)
+        return NULL;
+    return _queue_alloc(soft, hard, size, QUEUE_PRIORITY,
+            arity | QUEUE_GROWABLE);
+}
+
+int priority_queue_take(priority_queue_t * q, void * data){
+    assert(q->type == QUEUE_PRIORITY);
+    return _queue_take(q, data, NULL, _priority_take(q));
+}
+
+int priority_queue_try_take(priority_queue_t * q, void * data){
+    assert(q->type == QUEUE_PRIORITY);
+    return _queue_try_take(q, data, _priority_take(q), 
+            pthread_mutex_trylock);
+}
+
+int priority_queue_no_wait_take(priority_queue_t * q, 
+        void * data)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    return _queue_try_take(q, data, _priority_take(q), 
+            pthread_mutex_lock);
+}
+
+int priority_queue_timed_take(priority_queue_t * q, void * data,
+        unsigned int sec)
+{
+    return priority_queue_take_for(q, data, sec*1000000000ULL);
+}
+
+int priority_queue_take_for(priority_queue_t * q, void * data,
+        uint64_t nsec)
+{
+    struct timespec ts;
+    monotonic_deadline(&ts, nsec);
+    return priority_queue_take_until(q, data, &ts);
+}
+
+int priority_queue_take_until(priority_queue_t * q, void * data,
+        const struct timespec * deadline)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    struct timespec ts = *deadline;
+    return _queue_take(q, data, &ts, _priority_take(q));
 }
 
 int priority_queue_put(priority_queue_t *q, void *data, int priority){
-    assert(q->type == PRIORITY_CHANNEL);
+    assert(q->type == QUEUE_PRIORITY);
     return _queue_put(q, data, NULL, 
-            hb_write, priority);
+            _priority_write(q), priority);
 }
 
 int priority_queue_try_put(priority_queue_t *q, void *data, int priority){
-    assert(q->type == PRIORITY_CHANNEL);
+    assert(q->type == QUEUE_PRIORITY);
     return _queue_try_put(q, data, 
-            hb_write, priority, 
+            _priority_write(q), priority, 
             pthread_mutex_trylock);
 }
 
 int priority_queue_no_wait_put(priority_queue_t *q, 
         void *data, int priority)
 {
-    assert(q->type == PRIORITY_CHANNEL);
+    assert(q->type == QUEUE_PRIORITY);
     return _queue_try_put(q, data, 
-            hb_write, priority, 
+            _priority_write(q), priority, 
             pthread_mutex_lock);
 }
 
-int priority_queue_timed_put(priority_queue_t * q, 
-        void *data, int priority, unsigned int sec){
-    assert(q->type == PRIORITY_CHANNEL);
+int priority_queue_timed_put(priority_queue_t * q, void * data, int priority,
+        unsigned int sec)
+{
+    return priority_queue_put_for(q, data, priority, sec*1000000000ULL);
+}
+
+int priority_queue_put_for(priority_queue_t * q, void * data, int priority,
+        uint64_t nsec)
+{
     struct timespec ts;
-    _gettimer(&ts, sec);
-    return _queue_put(q, data, &ts, 
-            hb_write, priority);
+    monotonic_deadline(&ts, nsec);
+    return priority_queue_put_until(q, data, priority, &ts);
+}
+
+int priority_queue_put_until(priority_queue_t * q, void * data, int priority,
+        const struct timespec * deadline)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    struct timespec ts = *deadline;
+    return _queue_put(q, data, &ts, _priority_write(q), priority);
 }
 
 void priority_queue_free(priority_queue_t * q){
     queue_free(q);
 }
 
+int queue_take_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken)
+{
+    assert(_is_fifo(q));
+    return _queue_take_many(q, data, n, taken, NULL,
+            _fifo_take_many(q));
+}
+
+int queue_timed_take_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken,
+        unsigned int sec)
+{
+    return queue_take_many_for(q, data, n, taken, sec*1000000000ULL);
+}
+
+int queue_take_many_for(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken,
+        uint64_t nsec)
+{
+    struct timespec ts;
+    monotonic_deadline(&ts, nsec);
+    return queue_take_many_until(q, data, n, taken, &ts);
+}
+
+int queue_take_many_until(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken,
+        const struct timespec * deadline)
+{
+    assert(_is_fifo(q));
+    struct timespec ts = *deadline;
+    return _queue_take_many(q, data, n, taken, &ts,
+            _fifo_take_many(q));
+}
+
+int queue_try_take_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken)
+{
+    assert(_is_fifo(q));
+    return _queue_try_take_many(q, data, n, taken,
+            _fifo_take_many(q), pthread_mutex_trylock);
+}
+
+int queue_put_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * written)
+{
+    assert(_is_fifo(q));
+    return _queue_put_many(q, data, NULL, n, written, NULL,
+            _fifo_write_many(q));
+}
+
+int queue_timed_put_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * written,
+        unsigned int sec)
+{
+    return queue_put_many_for(q, data, n, written, sec*1000000000ULL);
+}
+
+int queue_put_many_for(queue_t * q, void * data, unsigned int n,
+        unsigned int * written,
+        uint64_t nsec)
+{
+    struct timespec ts;
+    monotonic_deadline(&ts, nsec);
+    return queue_put_many_until(q, data, n, written, &ts);
+}
+
+int queue_put_many_until(queue_t * q, void * data, unsigned int n,
+        unsigned int * written,
+        const struct timespec * deadline)
+{
+    assert(_is_fifo(q));
+    struct timespec ts = *deadline;
+    return _queue_put_many(q, data, NULL, n, written, &ts,
+            _fifo_write_many(q));
+}
+
+int queue_try_put_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * written)
+{
+    assert(_is_fifo(q));
+    return _queue_try_put_many(q, data, NULL, n, written,
+            _fifo_write_many(q), pthread_mutex_trylock);
+}
+
+int queue_reserve(queue_t * q, void ** slot){
+    assert(_is_fifo(q));
+    if(_queue_closed(q))
+        return EPIPE;
+    return _queue_acquire(q, slot, NULL, 1, _in_place_ops[q->type].reserve,
+            wait_full, _lf_wait_not_full);
+}
+
+int queue_try_reserve(queue_t * q, void ** slot){
+    assert(_is_fifo(q));
+    if(_queue_closed(q))
+        return EPIPE;
+    return _queue_acquire(q, slot, NULL, 0, _in_place_ops[q->type].reserve,
+            wait_full, _lf_wait_not_full);
+}
+
+int queue_commit(queue_t * q, void * slot){
+    assert(_is_fifo(q));
+    return _queue_publish(q, slot, _in_place_ops[q->type].commit,
+            notify_not_empty, q->ctrl.not_empty_callback,
+            &q->ctrl.not_empty_listeners, notify_not_full);
+}
+
+int queue_peek_acquire(queue_t * q, void ** slot){
+    assert(_is_fifo(q));
+    return _queue_acquire(q, slot, NULL, 1, _in_place_ops[q->type].peek,
+            wait_empty, _lf_wait_not_empty);
+}
+
+int queue_try_peek_acquire(queue_t * q, void ** slot){
+    assert(_is_fifo(q));
+    return _queue_acquire(q, slot, NULL, 0, _in_place_ops[q->type].peek,
+            wait_empty, _lf_wait_not_empty);
+}
+
+int queue_release(queue_t * q, void * slot){
+    assert(_is_fifo(q));
+    return _queue_publish(q, slot, _in_place_ops[q->type].release,
+            notify_not_full, q->ctrl.not_full_callback,
+            &q->ctrl.not_full_listeners, notify_not_empty);
+}
+
+int priority_queue_take_many(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    return _queue_take_many(q, data, n, taken, NULL,
+            _priority_take_many(q));
+}
+
+int priority_queue_timed_take_many(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken,
+        unsigned int sec)
+{
+    return priority_queue_take_many_for(q, data, n, taken, sec*1000000000ULL);
+}
+
+int priority_queue_take_many_for(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken,
+        uint64_t nsec)
+{
+    struct timespec ts;
+    monotonic_deadline(&ts, nsec);
+    return priority_queue_take_many_until(q, data, n, taken, &ts);
+}
+
+int priority_queue_take_many_until(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken,
+        const struct timespec * deadline)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    struct timespec ts = *deadline;
+    return _queue_take_many(q, data, n, taken, &ts,
+            _priority_take_many(q));
+}
+
+int priority_queue_try_take_many(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    return _queue_try_take_many(q, data, n, taken, _priority_take_many(q),
+            pthread_mutex_trylock);
+}
+
+int priority_queue_put_many(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    return _queue_put_many(q, data, priorities, n, written, NULL,
+            _priority_write_many(q));
+}
+
+int priority_queue_timed_put_many(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written,
+        unsigned int sec)
+{
+    return priority_queue_put_many_for(q, data, priorities, n, written, sec*1000000000ULL);
+}
+
+int priority_queue_put_many_for(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written,
+        uint64_t nsec)
+{
+    struct timespec ts;
+    monotonic_deadline(&ts, nsec);
+    return priority_queue_put_many_until(q, data, priorities, n, written, &ts);
+}
+
+int priority_queue_put_many_until(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written,
+        const struct timespec * deadline)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    struct timespec ts = *deadline;
+    return _queue_put_many(q, data, priorities, n, written, &ts,
+            _priority_write_many(q));
+}
+
+int priority_queue_try_put_many(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written)
+{
+    assert(q->type == QUEUE_PRIORITY);
+    return _queue_try_put_many(q, data, priorities, n, written,
+            _priority_write_many(q), pthread_mutex_trylock);
+}
+
+/*
+* a closed queue is reported by the select functions so that the
+* caller gets EPIPE from it
+*/
 int _queue_peek_used(queue_t * q){
+    if(_queue_closed(q))
+        return 1;
+    if(_is_subscriber(q))
+        return _broadcast_used(q);
+    if(_is_lock_free(q))
+        return lf_used(&(q->rb));
     return rb_has_next(&(q->rb));
 }
 
 int _queue_peek_available(queue_t * q){
+    if(_queue_closed(q))
+        return 1;
+    //nothing can be put in a subscriber
+    if(_is_subscriber(q))
+        return 0;
+    if(q->type == QUEUE_BYTES)
+        return bytes_available(&(q->rb));
+    if(_is_lock_free(q))
+        return q->rb.n - lf_used(&(q->rb));
     return rb_available(&(q->rb));
 }
 
@@ -497,7 +1908,7 @@ int select_data_init(select_data_t * sdata){
     int err_code;
     if((err_code = pthread_mutex_init(&(sdata->mutex), NULL)))
         return err_code;
-    if((err_code = pthread_cond_init(&(sdata->cond), NULL))){
+    if((err_code = monotonic_cond_init(&(sdata->cond)))){
 	pthread_mutex_destroy(&(sdata->mutex));
         return err_code;
     }
@@ -520,6 +1931,33 @@ void __select_callback(queue_t * q, void * data){
     pthread_mutex_unlock(&(sdata->mutex));
 }
 
+static inline void _select_reverse(struct queue_st ** s, int i, int j){
+    for(j--; i < j; i++, j--){
+        struct queue_st * tmp = s[i];
+        s[i] = s[j];
+        s[j] = tmp;
+    }
+}
+
+/*
+* the selected queues are found in index order, the first k of them
+* are moved to the end so that successive selects do not always
+* start with the lowest indices
+*/
+static inline void _select_rotate(struct queue_st ** s, int ns, int k){
+    if(k == 0 || k == ns) return;
+    _select_reverse(s, 0, k);
+    _select_reverse(s, k, ns);
+    _select_reverse(s, 0, ns);
+}
+
+/*
+* each thread rotates its own start, a counter shared by every thread
+* would be written by every select and could hand a thread the same
+* start on each of its calls
+*/
+static __thread unsigned int _select_start;
+
 int _select(struct queue_st ** q, int n, 
         struct queue_st ** selected_queue, int * ns,
         void(*callback_setter)(struct queue_st*, struct notification_callback_st *),
@@ -528,6 +1966,12 @@ int _select(struct queue_st ** q, int n,
     int i = 0;
     *ns = 0;
     int err = 0;
+    //queues are always locked in index order, only the order in
+    //which they are reported rotates
+    int start = n ? _select_start++ % n : 0;
+    int skipped;
+retry_select:
+    skipped = 0;
     for(i = 0; i < n; i++){
         err = _queue_lock(q[i]);
         if(err != 0){
@@ -539,8 +1983,10 @@ int _select(struct queue_st ** q, int n,
             //returning it
             selected_queue[*ns] = q[i];
             *ns += 1;
+            if(i < start) skipped++;
         }
     }
+    _select_rotate(selected_queue, *ns, skipped);
     if(*ns > 0) goto error_select;
     struct notification_callback_st * nc = calloc(n, 
             sizeof(struct notification_callback_st));
@@ -549,7 +1995,8 @@ int _select(struct queue_st ** q, int n,
         goto error_select;
     }
     select_data_t sdata;
-    if((err = select_data_init(&sdata)) != 0) return err;
+    if((err = select_data_init(&sdata)) != 0)
+        goto error_with_free_select;
     err = pthread_mutex_lock(&(sdata.mutex));
     if(err){
         select_data_destroy(&sdata);
@@ -560,26 +2007,41 @@ int _select(struct queue_st ** q, int n,
         n->data = &sdata;
         n->callback = &__select_callback;
         callback_setter(q[i], n);
+        //lock free queues do not take the lock to modify the ring,
+        //it has to be checked again once the callback is visible
+        if(_is_lock_free(q[i]) && peek_function(q[i]) > 0)
+            sdata.q = q[i];
         _queue_unlock(q[i]);
     }
-    if(ts) 
-        err = pthread_cond_timedwait(&(sdata.cond), &(sdata.mutex), ts);
-    else 
-        err = pthread_cond_wait(&(sdata.cond), &(sdata.mutex));
-    if(err != 0)
-        goto end_select;
-    *selected_queue = sdata.q;
-    *ns = 1;
-end_select:
+    while(sdata.q == NULL && err == 0){
+        if(ts) 
+            err = monotonic_cond_timedwait(&(sdata.cond), &(sdata.mutex), ts);
+        else 
+            err = pthread_cond_wait(&(sdata.cond), &(sdata.mutex));
+    }
     pthread_mutex_unlock(&(sdata.mutex));
     for(i = 0; i < n; i++){
+        pthread_mutex_lock(&(q[i]->ctrl.cb_mutex));
         _queue_lock(q[i]);
         struct notification_callback_st * n = nc + i;
-        _remove_callback(n);
+        unsigned int epoch = _remove_callback(n);
+        //report every queue satisfying the condition, not only
+        //the one whose callback woke us up
+        if(err == 0 && peek_function(q[i]) > 0){
+            selected_queue[*ns] = q[i];
+            *ns += 1;
+            if(i < start) skipped++;
+        }
         _queue_unlock(q[i]);
+        _callback_sync(q[i], epoch);
+        pthread_mutex_unlock(&(q[i]->ctrl.cb_mutex));
     }
+    _select_rotate(selected_queue, *ns, skipped);
     free(nc);
     select_data_destroy(&sdata);
+    //drained by another thread in the meantime, wait again
+    if(err == 0 && *ns == 0)
+        goto retry_select;
     return err;
 error_with_free_select:
     free(nc);
@@ -599,11 +2061,26 @@ int queue_select_not_full(struct queue_st ** q, int n,
 }
 
 int queue_timed_select_not_full(struct queue_st ** q, int n,
-        struct queue_st ** selected_queue, int *ns,
+        struct queue_st ** selected_queue, int * ns,
         unsigned int s)
+{
+    return queue_select_not_full_for(q, n, selected_queue, ns, s*1000000000ULL);
+}
+
+int queue_select_not_full_for(struct queue_st ** q, int n,
+        struct queue_st ** selected_queue, int * ns,
+        uint64_t nsec)
 {
     struct timespec ts;
-    _gettimer(&ts, s);
+    monotonic_deadline(&ts, nsec);
+    return queue_select_not_full_until(q, n, selected_queue, ns, &ts);
+}
+
+int queue_select_not_full_until(struct queue_st ** q, int n,
+        struct queue_st ** selected_queue, int * ns,
+        const struct timespec * deadline)
+{
+    struct timespec ts = *deadline;
     return _select(q, n, selected_queue, ns,
         _queue_append_not_full_callback, 
         _queue_peek_available,
@@ -622,12 +2099,283 @@ int queue_select_not_empty(struct queue_st ** q, int n,
 int queue_timed_select_not_empty(struct queue_st ** q, int n,
         struct queue_st ** selected_queue, int * ns,
         unsigned int s)
+{
+    return queue_select_not_empty_for(q, n, selected_queue, ns, s*1000000000ULL);
+}
+
+int queue_select_not_empty_for(struct queue_st ** q, int n,
+        struct queue_st ** selected_queue, int * ns,
+        uint64_t nsec)
 {
     struct timespec ts;
-    _gettimer(&ts, s);
+    monotonic_deadline(&ts, nsec);
+    return queue_select_not_empty_until(q, n, selected_queue, ns, &ts);
+}
+
+int queue_select_not_empty_until(struct queue_st ** q, int n,
+        struct queue_st ** selected_queue, int * ns,
+        const struct timespec * deadline)
+{
+    struct timespec ts = *deadline;
     return _select(q, n, selected_queue, ns,
             _queue_append_not_empty_callback,
             _queue_peek_used,
             &ts);
 }
 
+
+/*
+* persistent selectors, each registered queue gets a callback once,
+* the callback pushes its entry to the ready list of the selector.
+* a wait only looks at the ready list and at the entries it returned
+* last time (they may still hold elements without firing the
+* callback again), never at the whole set of queues.
+* lock order is queue mutex then selector mutex, the selector only
+* try locks a queue while holding its own mutex.
+*/
+typedef struct selector_entry_st {
+    queue_t * q;
+    queue_selector_t * sel;
+    notification_callback_t * nc;
+    int ready;
+    int rearm;
+    // unlinked by queue_selector_remove, its callback may still run
+    int dead;
+    struct selector_entry_st * next_ready;
+    struct selector_entry_st * next_rearm;
+    struct selector_entry_st * n;
+    struct selector_entry_st * p;
+}selector_entry_t;
+
+struct queue_selector_st {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    selector_type_t type;
+    unsigned int waiters;
+    selector_entry_t * ready_head;
+    selector_entry_t * ready_tail;
+    selector_entry_t * rearm;
+    selector_entry_t * entries;
+};
+
+/*
+* a queue that can not be locked is reported as ready, at worst the
+* caller of the wait finds it empty (or full)
+*/
+static inline int _selector_peek(queue_selector_t * sel, queue_t * q,
+        queue_mutex_lock_t mutex_lock)
+{
+    int res;
+    if(_is_lock_free(q))
+        return sel->type == SELECT_NOT_EMPTY ?
+            _queue_peek_used(q) : _queue_peek_available(q);
+    if(mutex_lock(&(q->ctrl.mutex)) != 0)
+        return 1;
+    res = sel->type == SELECT_NOT_EMPTY ?
+        _queue_peek_used(q) : _queue_peek_available(q);
+    _queue_unlock(q);
+    return res;
+}
+
+// the selector mutex must be held
+static inline void _selector_push_ready(queue_selector_t * sel,
+        selector_entry_t * e)
+{
+    if(e->ready || e->dead) return;
+    e->ready = 1;
+    e->next_ready = NULL;
+    if(sel->ready_tail)
+        sel->ready_tail->next_ready = e;
+    else
+        sel->ready_head = e;
+    sel->ready_tail = e;
+    if(sel->waiters)
+        pthread_cond_signal(&sel->cond);
+}
+
+void __selector_callback(queue_t * q, void * data){
+    (void)q;
+    selector_entry_t * e = (selector_entry_t*)data;
+    pthread_mutex_lock(&(e->sel->mutex));
+    _selector_push_ready(e->sel, e);
+    pthread_mutex_unlock(&(e->sel->mutex));
+}
+
+queue_selector_t * queue_selector_new(selector_type_t type){
+    queue_selector_t * sel = calloc(1, sizeof(queue_selector_t));
+    if(!sel) return sel;
+    sel->type = type;
+    if(pthread_mutex_init(&(sel->mutex), NULL)){
+        free(sel);
+        return NULL;
+    }
+    if(monotonic_cond_init(&(sel->cond))){
+        pthread_mutex_destroy(&(sel->mutex));
+        free(sel);
+        return NULL;
+    }
+    return sel;
+}
+
+int queue_selector_add(queue_selector_t * sel, queue_t * q){
+    selector_entry_t * e = calloc(1, sizeof(selector_entry_t));
+    if(!e) return ENOMEM;
+    e->q = q;
+    e->sel = sel;
+    e->nc = sel->type == SELECT_NOT_EMPTY ?
+        queue_append_not_empty_callback(q, __selector_callback, e) :
+        queue_append_not_full_callback(q, __selector_callback, e);
+    if(!e->nc){
+        free(e);
+        return ENOMEM;
+    }
+    //the queue may already satisfy the condition
+    int ready = _selector_peek(sel, q, pthread_mutex_lock) > 0;
+    pthread_mutex_lock(&(sel->mutex));
+    e->n = sel->entries;
+    if(e->n) e->n->p = e;
+    sel->entries = e;
+    if(ready)
+        _selector_push_ready(sel, e);
+    pthread_mutex_unlock(&(sel->mutex));
+    return 0;
+}
+
+static void _selector_unlink(queue_selector_t * sel, selector_entry_t * e){
+    selector_entry_t * c, * prev = NULL;
+    if(e->ready){
+        for(c = sel->ready_head; c != e; c = c->next_ready)
+            prev = c;
+        if(prev) prev->next_ready = e->next_ready;
+        else sel->ready_head = e->next_ready;
+        if(sel->ready_tail == e) sel->ready_tail = prev;
+    }
+    prev = NULL;
+    if(e->rearm){
+        for(c = sel->rearm; c != e; c = c->next_rearm)
+            prev = c;
+        if(prev) prev->next_rearm = e->next_rearm;
+        else sel->rearm = e->next_rearm;
+    }
+    if(e->p) e->p->n = e->n;
+    else sel->entries = e->n;
+    if(e->n) e->n->p = e->p;
+}
+
+// queue_free removed the callback of the entry already
+static void _selector_detach(void * data){
+    selector_entry_t * e = (selector_entry_t*)data;
+    queue_selector_t * sel = e->sel;
+    pthread_mutex_lock(&(sel->mutex));
+    _selector_unlink(sel, e);
+    pthread_mutex_unlock(&(sel->mutex));
+    free(e);
+}
+
+int queue_selector_remove(queue_selector_t * sel, queue_t * q){
+    selector_entry_t * e;
+    pthread_mutex_lock(&(sel->mutex));
+    for(e = sel->entries; e; e = e->n)
+        if(e->q == q) break;
+    if(!e){
+        pthread_mutex_unlock(&(sel->mutex));
+        return EINVAL;
+    }
+    //a concurrent remove of q can not find it anymore, and the
+    //callback can not push it back on the ready list
+    _selector_unlink(sel, e);
+    e->dead = 1;
+    pthread_mutex_unlock(&(sel->mutex));
+    //once removed the callback can not fire anymore
+    queue_remove_callback(e->nc);
+    free(e);
+    return 0;
+}
+
+void queue_selector_free(queue_selector_t * sel){
+    selector_entry_t * e = sel->entries;
+    while(e){
+        selector_entry_t * n = e->n;
+        queue_remove_callback(e->nc);
+        free(e);
+        e = n;
+    }
+    pthread_cond_destroy(&(sel->cond));
+    pthread_mutex_destroy(&(sel->mutex));
+    free(sel);
+}
+
+/*
+* the queues returned by the previous wait only fire their callback
+* again on the next put (or take), check whether they still satisfy
+* the condition
+*/
+static void _selector_rearm(queue_selector_t * sel){
+    selector_entry_t * e = sel->rearm;
+    sel->rearm = NULL;
+    while(e){
+        selector_entry_t * n = e->next_rearm;
+        e->rearm = 0;
+        if(!e->ready &&
+                _selector_peek(sel, e->q, pthread_mutex_trylock) > 0)
+            _selector_push_ready(sel, e);
+        e = n;
+    }
+}
+
+int _selector_wait(queue_selector_t * sel, queue_t ** selected_queue,
+        int max, int * ns, struct timespec * ts)
+{
+    int err = 0;
+    *ns = 0;
+    if((err = pthread_mutex_lock(&(sel->mutex))) != 0)
+        return err;
+    _selector_rearm(sel);
+    while(sel->ready_head == NULL && err == 0){
+        sel->waiters++;
+        if(ts)
+            err = monotonic_cond_timedwait(&(sel->cond), &(sel->mutex), ts);
+        else
+            err = pthread_cond_wait(&(sel->cond), &(sel->mutex));
+        sel->waiters--;
+    }
+    while(sel->ready_head && *ns < max){
+        selector_entry_t * e = sel->ready_head;
+        sel->ready_head = e->next_ready;
+        if(!sel->ready_head) sel->ready_tail = NULL;
+        e->ready = 0;
+        if(!e->rearm){
+            e->rearm = 1;
+            e->next_rearm = sel->rearm;
+            sel->rearm = e;
+        }
+        selected_queue[(*ns)++] = e->q;
+    }
+    //other threads may be waiting for what is left
+    if(sel->ready_head && sel->waiters)
+        pthread_cond_signal(&sel->cond);
+    pthread_mutex_unlock(&(sel->mutex));
+    return *ns > 0 ? 0 : err;
+}
+
+int queue_selector_wait(queue_selector_t * sel, queue_t ** selected_queue,
+        int max, int * ns)
+{
+    return _selector_wait(sel, selected_queue, max, ns, NULL);
+}
+
+int queue_selector_wait_for(queue_selector_t * sel,
+        queue_t ** selected_queue, int max, int * ns, uint64_t nsec)
+{
+    struct timespec ts;
+    monotonic_deadline(&ts, nsec);
+    return _selector_wait(sel, selected_queue, max, ns, &ts);
+}
+
+int queue_selector_wait_until(queue_selector_t * sel,
+        queue_t ** selected_queue, int max, int * ns,
+        const struct timespec * deadline)
+{
+    struct timespec ts = *deadline;
+    return _selector_wait(sel, selected_queue, max, ns, &ts);
+}
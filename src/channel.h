@@ -2,9 +2,12 @@
 #define CHANNEL_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 typedef struct queue_st queue_t;
 typedef struct queue_st priority_queue_t;
+typedef struct queue_pool_st queue_pool_t;
 
 /*
 * allocates a new fifo queue able to hold n elements of size size.
@@ -12,6 +15,67 @@ typedef struct queue_st priority_queue_t;
 */
 queue_t * queue_new(unsigned int n, size_t size);
 /*
+* allocates a new fifo queue able to hold n elements of size size
+* that may only be used by one producer thread and one consumer
+* thread at a time.
+* puts and takes do not take any lock as long as the queue is
+* neither full nor empty, the blocking, timed and select functions
+* fall back to the mutex and the condition variables when they
+* have to wait.
+* all the queue_* functions can be used on the returned queue,
+* the try functions never return EBUSY.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+queue_t * queue_new_spsc(unsigned int n, size_t size);
+/*
+* allocates a new fifo queue able to hold n elements of size size
+* that can be shared by any number of producers and consumers
+* without serializing them on a lock.
+* every slot of the ring carries a sequence number, producers and
+* consumers claim slots with a compare and swap and only fall back
+* to the mutex and the condition variables when they have to wait,
+* like the queues returned by queue_new_spsc.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+queue_t * queue_new_mpmc(unsigned int n, size_t size);
+/*
+* allocates a new fifo queue that grows with the number of elements
+* it holds. elements are stored in fixed size segments taken from a
+* pool shared by all the growable queues, the queue holds at most
+* hard elements (no limit when hard is 0) and puts block (or fail
+* with EAGAIN) at that point as for a full queue. once drained the
+* queue keeps the segments needed for soft elements and gives the
+* other ones back to the pool.
+* puts also behave as if the queue was full when no memory is
+* available for a new segment.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+queue_t * queue_new_growable(unsigned int soft, unsigned int hard,
+        size_t size);
+/*
+* allocates a pool of fifo queues able to hold n elements of size
+* size. the queues and their rings are carved out of arenas of count
+* queues allocated in a single block, a new arena is added when every
+* queue of the pool is in use.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+queue_pool_t * queue_pool_new(unsigned int n, size_t size,
+        unsigned int count);
+/*
+* returns an empty queue of the pool, queue_free gives it back to the
+* pool, which empties it and clears its callbacks, close flag and spin
+* settings, instead of releasing its memory.
+* may be called from any thread.
+* returns NULL if no queue is free and no arena could be allocated
+*/
+queue_t * queue_pool_get(queue_pool_t * pool);
+/*
+* releases the pool and its arenas
+* returns 0 when the operation is succesful
+* returns EBUSY if some queues of the pool were not freed
+*/
+int queue_pool_free(queue_pool_t * pool);
+/*
 * retrieves the first element from the queue and copies it to
 * data
 * or blocks until an element is available
@@ -33,6 +97,16 @@ int queue_take(queue_t * queue, void * data);
 */
 int queue_timed_take(queue_t * queue, void * data, unsigned int sec);
 /*
+* same as queue_timed_take with a timeout of nsec nanoseconds
+*/
+int queue_take_for(queue_t * q, void * data, uint64_t nsec);
+/*
+* same as queue_timed_take but waits until deadline, an absolute time
+* on CLOCK_MONOTONIC (see queue_deadline)
+*/
+int queue_take_until(queue_t * q, void * data,
+        const struct timespec * deadline);
+/*
 * tries to retrieve the first element from the queue and copies it to
 * data
 * this call is non blocking
@@ -72,6 +146,9 @@ int queue_put(queue_t * queue, void * value);
 * returns ETIMEDOUT if the when the timer has ellapsed
 */
 int queue_timed_put(queue_t * queue, void * data, unsigned int sec);
+int queue_put_for(queue_t * q, void * data, uint64_t nsec);
+int queue_put_until(queue_t * q, void * data,
+        const struct timespec * deadline);
 /*
 * tries to copy the memory pointed by value into the queue
 * this call is non blocking
@@ -91,16 +168,218 @@ int queue_try_put(queue_t * queue, void * data);
 */
 int queue_no_wait_put(queue_t *q, void *data);
 /*
-* free a previously allocated queue
+* makes the threads blocking on the queue busy wait for up to
+* max_spin iterations before going to sleep, trading cpu time for
+* shorter hand offs. the first waits spin up to max_spin iterations,
+* the number actually spent then adapts to how long recent waits
+* lasted. 0, the default, disables spinning.
+* must be called before the queue is shared between threads,
+* works with every kind of queue
+*/
+void queue_set_spin(queue_t * q, unsigned int max_spin);
+/*
+* closes the queue, works with every kind of queue.
+* every thread blocked on the queue, in a select or a selector wait
+* included, is woken up.
+* once closed every put (or reserve) returns EPIPE, takes (or peeks)
+* keep returning the elements left in the queue and return EPIPE
+* once it is empty. the select functions report closed queues as
+* ready so that the caller gets EPIPE from them.
+* a put racing with queue_close may still succeed.
+* returns 0 when the operation is succesful
+*/
+int queue_close(queue_t * q);
+// returns 1 if queue_close was called on q, 0 otherwise
+int queue_is_closed(queue_t * q);
+/*
+* drops every element of q in one step, the queue stays open (or
+* closed). the threads blocked in q when it is reset wake up and
+* return ECANCELED, the callbacks waiting for room are run.
+* returns 0 when the operation is succesful
+* returns EBUSY if a slot is reserved (see queue_reserve)
+* returns EINVAL for the lock free queues of queue_new_spsc and
+* queue_new_mpmc, their producers and consumers do not take the lock
+*/
+int queue_reset(queue_t * q);
+/*
+* number of bytes queue_init_at needs for a queue of n elements of
+* size size
+*/
+size_t queue_footprint(unsigned int n, size_t size);
+/*
+* builds a fifo queue of n elements of size size in mem, which must
+* hold queue_footprint(n, size) bytes and outlive the queue, without
+* allocating any memory. queue_free releases the lock and the events
+* of the queue but not mem.
+* the queue may only be used by the threads of the process that
+* built it.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+queue_t * queue_init_at(void * mem, unsigned int n, size_t size);
+/*
+* stores in deadline the CLOCK_MONOTONIC time nsec nanoseconds from
+* now, to be passed to the *_until functions.
+* the timeouts of all the timed functions are measured on
+* CLOCK_MONOTONIC and are not affected by changes of the wall clock
+*/
+void queue_deadline(struct timespec * deadline, uint64_t nsec);
+/*
+* free a previously allocated queue, a queue of a pool is given back
+* to its pool. the callbacks still registered are removed and freed,
+* their handles may not be used afterwards
 */
 void queue_free(queue_t * queue);
 
+/*
+* batch versions of queue_take, queue_timed_take and queue_try_take.
+* data must point to a block of memory of at least n*size.
+* waits until at least one element is available then copies as many
+* elements as available, up to n, in a single critical section.
+* the number of elements copied is stored in taken.
+* waiters and callbacks are notified once per call, not once per
+* element.
+* return the same values as their single element counterparts
+*/
+int queue_take_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken);
+int queue_timed_take_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken, unsigned int sec);
+int queue_take_many_for(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken, uint64_t nsec);
+int queue_take_many_until(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken, const struct timespec * deadline);
+int queue_try_take_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken);
+/*
+* batch versions of queue_put, queue_timed_put and queue_try_put.
+* data must point to n contiguous elements of size size.
+* waits until there is room for at least one element then copies
+* as many elements as fit, up to n, in a single critical section.
+* the number of elements copied is stored in written.
+*/
+int queue_put_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * written);
+int queue_timed_put_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * written, unsigned int sec);
+int queue_put_many_for(queue_t * q, void * data, unsigned int n,
+        unsigned int * written, uint64_t nsec);
+int queue_put_many_until(queue_t * q, void * data, unsigned int n,
+        unsigned int * written, const struct timespec * deadline);
+int queue_try_put_many(queue_t * q, void * data, unsigned int n,
+        unsigned int * written);
+
+/*
+* zero copy access to a fifo queue.
+* queue_reserve blocks until there is room in the queue and stores
+* in slot a pointer to the next free slot of the ring, the element
+* is built in place then handed over to the consumers with
+* queue_commit.
+* queue_peek_acquire blocks until an element is available and
+* stores in slot a pointer to it, the slot is given back to the
+* producers with queue_release.
+* the slot pointers are aligned to at least 8 bytes when size is a
+* multiple of 8.
+* on the queues returned by queue_new a single slot can be reserved
+* (or acquired) at a time, other producers (or consumers) wait until
+* it is committed (or released).
+* the try versions do not block and return EAGAIN instead.
+* returns 0 when the operation is succesful
+* returns EINVAL if the queue is not properly initialized
+*/
+int queue_reserve(queue_t * q, void ** slot);
+int queue_try_reserve(queue_t * q, void ** slot);
+int queue_commit(queue_t * q, void * slot);
+int queue_peek_acquire(queue_t * q, void ** slot);
+int queue_try_peek_acquire(queue_t * q, void ** slot);
+int queue_release(queue_t * q, void * slot);
+
+/*
+* allocates a queue of variable length messages holding up to
+* capacity bytes, each message takes its length rounded up to 8
+* bytes plus an 8 bytes header. only the queue_*_bytes functions, the
+* select functions, the selectors, the callbacks, the eventfds,
+* queue_close, queue_reset and queue_free can be used on it.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+queue_t * queue_new_bytes(unsigned int capacity);
+/*
+* copies the len bytes of data as one message, blocking until there
+* is room for it.
+* returns 0 when the operation is succesful
+* returns EMSGSIZE if the message can never fit in the queue
+*/
+int queue_put_bytes(queue_t * q, const void * data, size_t len);
+int queue_put_bytes_for(queue_t * q, const void * data, size_t len,
+        uint64_t nsec);
+int queue_try_put_bytes(queue_t * q, const void * data, size_t len);
+/*
+* copies the oldest message to data, which can hold cap bytes, and
+* stores its length in len, blocking until a message is available.
+* returns 0 when the operation is succesful
+* returns EMSGSIZE if the message is longer than cap, it is left in
+* the queue and its length stored in len
+*/
+int queue_take_bytes(queue_t * q, void * data, size_t cap, size_t * len);
+int queue_take_bytes_for(queue_t * q, void * data, size_t cap,
+        size_t * len, uint64_t nsec);
+int queue_try_take_bytes(queue_t * q, void * data, size_t cap,
+        size_t * len);
+/*
+* zero copy read, stores in data a pointer to the oldest message and
+* its length in len, the message stays in the queue until
+* queue_release_bytes. a single message can be peeked at a time,
+* other consumers wait until it is released.
+* returns 0 when the operation is succesful
+*/
+int queue_peek_bytes(queue_t * q, void ** data, size_t * len);
+int queue_try_peek_bytes(queue_t * q, void ** data, size_t * len);
+int queue_release_bytes(queue_t * q);
+
 priority_queue_t * priority_queue_new(unsigned int n, size_t size);
+/*
+* allocates a new priority queue backed by a heap where each entry has
+* arity children, arity must be 2, 4 or 8.
+* wider heaps are shallower and compare all the children of an entry
+* within one cache line, they are faster for large queues.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+priority_queue_t * priority_queue_new_dary(unsigned int n, size_t size,
+        unsigned int arity);
+/*
+* same as priority_queue_new_dary but the elements of equal priority
+* are taken in the order they were put, at the cost of a sequence
+* number per element
+*/
+priority_queue_t * priority_queue_new_stable(unsigned int n, size_t size,
+        unsigned int arity);
+/*
+* allocates a new priority queue for priorities from 0 to levels - 1,
+* levels must be between 1 and 64. each priority is a fifo list and a
+* bitmap tells which ones are not empty, puts and takes are O(1) and
+* the elements of equal priority are taken in the order they were put.
+* priorities out of range are clamped to 0 or levels - 1.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+priority_queue_t * priority_queue_new_bucketed(unsigned int n, size_t size,
+        unsigned int levels);
+/*
+* allocates a new priority queue backed by a heap of arity children
+* per entry that grows as queue_new_growable does, the segments above
+* soft elements are only given back once the queue is empty.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+priority_queue_t * priority_queue_new_growable(unsigned int soft,
+        unsigned int hard, size_t size, unsigned int arity);
 // blocking
 int priority_queue_take(priority_queue_t * q, void * data);
 // blocking, waits up to sec for data to be available
 int priority_queue_timed_take(priority_queue_t * q, 
         void * data, unsigned int sec);
+// blocking, waits up to nsec nanoseconds (or until deadline)
+int priority_queue_take_for(priority_queue_t * q, void * data,
+        uint64_t nsec);
+int priority_queue_take_until(priority_queue_t * q, void * data,
+        const struct timespec * deadline);
 // non blocking
 int priority_queue_try_take(priority_queue_t * q,
         void * data);
@@ -111,35 +390,181 @@ int priority_queue_put(priority_queue_t *q, void *data, int priority);
 // blocking, waits up to sec for data to be available
 int priority_queue_timed_put(priority_queue_t * q, 
         void *data, int priority, unsigned int sec);
+int priority_queue_put_for(priority_queue_t * q, void * data,
+        int priority, uint64_t nsec);
+int priority_queue_put_until(priority_queue_t * q, void * data,
+        int priority, const struct timespec * deadline);
 // non blocking
 int priority_queue_try_put(priority_queue_t * q,
         void * data, int priority);
 int priority_queue_no_wait_put(priority_queue_t *q, 
         void *data, int priority);
 void priority_queue_free(priority_queue_t * q);
+// batch versions, see queue_take_many and queue_put_many
+// priorities holds the priority of each of the n elements
+int priority_queue_take_many(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken);
+int priority_queue_timed_take_many(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken, unsigned int sec);
+int priority_queue_take_many_for(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken, uint64_t nsec);
+int priority_queue_take_many_until(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken,
+        const struct timespec * deadline);
+int priority_queue_try_take_many(priority_queue_t * q, void * data,
+        unsigned int n, unsigned int * taken);
+int priority_queue_put_many(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written);
+int priority_queue_timed_put_many(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written,
+        unsigned int sec);
+int priority_queue_put_many_for(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written,
+        uint64_t nsec);
+int priority_queue_put_many_until(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written,
+        const struct timespec * deadline);
+int priority_queue_try_put_many(priority_queue_t * q, void * data,
+        int * priorities, unsigned int n, unsigned int * written);
 
+/*
+* blocks until at least one of the n queues in q is not full (or not
+* empty) and stores every queue satisfying the condition in
+* selected_queue, which must be able to hold n queues, and their
+* number in ns.
+* the order of the selected queues rotates from one call to the
+* next so that the queues at the beginning of q are not favored.
+* returns 0 when the operation is succesful
+* returns ETIMEDOUT if the timer has ellapsed
+*/
 int queue_select_not_full(struct queue_st ** q, int n,
         struct queue_st ** selected_queue, int * ns);
 int queue_timed_select_not_full(struct queue_st ** q, int n,
         struct queue_st ** selected_queue, int *ns,
         unsigned int s);
+int queue_select_not_full_for(struct queue_st ** q, int n,
+        struct queue_st ** selected_queue, int * ns, uint64_t nsec);
+int queue_select_not_full_until(struct queue_st ** q, int n,
+        struct queue_st ** selected_queue, int * ns,
+        const struct timespec * deadline);
 int queue_select_not_empty(struct queue_st ** q, int n,
         struct queue_st ** selected_queue, int * ns);
 int queue_timed_select_not_empty(struct queue_st ** q, int n,
         struct queue_st ** selected_queue, int * ns,
         unsigned int s);
+int queue_select_not_empty_for(struct queue_st ** q, int n,
+        struct queue_st ** selected_queue, int * ns, uint64_t nsec);
+int queue_select_not_empty_until(struct queue_st ** q, int n,
+        struct queue_st ** selected_queue, int * ns,
+        const struct timespec * deadline);
+
+/*
+* persistent selectors, queues are registered once and the selector
+* can then be waited on many times.
+* readiness is tracked incrementally through the queue callbacks, a
+* wait does not lock nor scan every registered queue and does not
+* allocate memory.
+*/
+typedef struct queue_selector_st queue_selector_t;
+typedef enum {
+    SELECT_NOT_EMPTY = 0,
+    SELECT_NOT_FULL = 1,
+}selector_type_t;
+
+/*
+* allocates a selector reporting the queues that are not empty
+* (or not full)
+* returns NULL if the initialization was unsuccesful at some point
+*/
+queue_selector_t * queue_selector_new(selector_type_t type);
+/*
+* registers (or unregisters) q, a queue can be registered to several
+* selectors but only once to each of them. queue_free unregisters q
+* from its selectors, it must not run along with queue_selector_remove
+* of the same queue.
+* returns 0 when the operation is succesful
+* returns ENOMEM if the allocation failed
+* returns EINVAL if q is not registered (queue_selector_remove)
+*/
+int queue_selector_add(queue_selector_t * sel, queue_t * q);
+int queue_selector_remove(queue_selector_t * sel, queue_t * q);
+/*
+* blocks until at least one registered queue satisfies the condition
+* and stores up to max of them in selected_queue and their number
+* in ns.
+* queues are reported in the order they became ready, a queue
+* returned by a wait goes back to the end of the line if it still
+* satisfies the condition, so every ready queue is eventually
+* reported even when max is smaller than the number of ready queues.
+* a returned queue may have been drained (or filled) by another
+* thread in the meantime, the non blocking functions should be used
+* on it.
+* returns 0 when the operation is succesful
+* returns ETIMEDOUT if the timer has ellapsed
+*/
+int queue_selector_wait(queue_selector_t * sel, queue_t ** selected_queue,
+        int max, int * ns);
+int queue_selector_wait_for(queue_selector_t * sel,
+        queue_t ** selected_queue, int max, int * ns, uint64_t nsec);
+int queue_selector_wait_until(queue_selector_t * sel,
+        queue_t ** selected_queue, int max, int * ns,
+        const struct timespec * deadline);
+/*
+* unregisters every queue and frees the selector, no thread may be
+* waiting on it
+*/
+void queue_selector_free(queue_selector_t * sel);
 
 void queue_print(struct queue_st * q);
 
 typedef struct notification_callback_st notification_callback_t;
 typedef void(callback_t)(struct queue_st * q, void * data);
 
+/*
+* returns a non blocking eventfd that becomes readable when q goes
+* from empty to not empty (or from full to not full), so that q can
+* be waited for with poll, epoll or io_uring along with sockets.
+* it is also readable right away if q already satisfies the condition,
+* and once q is closed.
+* the caller reads the eventfd to clear it then takes (or puts) until
+* EAGAIN, the eventfd is only signaled again after a new transition.
+* the same eventfd is returned by every call, it belongs to q and is
+* closed by queue_free.
+* returns -1 and sets errno if the eventfd could not be created,
+* ENOSYS on systems without eventfd
+*/
+int queue_eventfd_not_empty(queue_t * q);
+int queue_eventfd_not_full(queue_t * q);
+/*
+* the callbacks run after every put (or take) once the queue lock is
+* released, in the thread that made the change. they may run
+* concurrently with each other and with the operations on the queue,
+* including the ones they call themselves.
+* the edge versions only run when the queue was empty (or full)
+* before the change. queue_close runs every callback of both lists,
+* queue_reset only the not full ones, the edge versions among them
+* only when the queue was full. lock free queues do not tell the
+* transitions apart and run them after every change.
+* returns NULL if the callback could not be registered
+*/
 notification_callback_t * queue_append_not_empty_callback(
         struct queue_st *q,
         callback_t callback, void * data);
 notification_callback_t * queue_append_not_full_callback(
         struct queue_st *q,
         callback_t callback, void * data);
+notification_callback_t * queue_append_not_empty_edge_callback(
+        struct queue_st *q,
+        callback_t callback, void * data);
+notification_callback_t * queue_append_not_full_edge_callback(
+        struct queue_st *q,
+        callback_t callback, void * data);
+/*
+* unregisters and frees nc, it returns once no thread runs the
+* callback anymore, so its data may be released right after.
+* may not be called from the callback itself, nor once the queue of
+* nc was freed: queue_free already removed it
+*/
 void queue_remove_callback(notification_callback_t * nc);
 
 #endif
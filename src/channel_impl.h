@@ -0,0 +1,193 @@
+#ifndef CHANNEL_IMPL_H
+#define CHANNEL_IMPL_H
+
+/*
+* definitions shared by the sources of the library and the typed
+* queues of channel_typed.h, they are not part of the public interface
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+#include "channel.h"
+#include "buffer.h"
+#include "event.h"
+
+typedef enum{
+    QUEUE_FIFO = 0,
+    QUEUE_PRIORITY = 1,
+    QUEUE_SPSC = 2,
+    QUEUE_MPMC = 3,
+    // a subscriber of a broadcast, see broadcast.c
+    QUEUE_BROADCAST = 4,
+    // variable length messages in a BYTES_BUFFER
+    QUEUE_BYTES = 5,
+}queue_type_t;
+
+typedef enum{
+    CALLBACK_HEAD = 0,
+    CALLBACK_NODE = 1,
+    CALLBACK_DEAD = 2,
+}callback_node_t;
+
+struct notification_callback_st{
+    void(*callback)(struct queue_st * q, void * data);
+    void *data;
+    // only run when the queue was empty (or full) before the change
+    int edge;
+    callback_node_t type;
+    struct queue_st * q;
+    atomic_uint * listeners;
+    struct notification_callback_st * n;
+    struct notification_callback_st * p;
+};
+
+typedef struct data_control_st queue_ctrl_t;
+/*
+* the fields read by every operation but rarely written come first,
+* the mutex, the callback dispatch counters and each event, which are
+* written by the threads that lock, run callbacks or wait, get their
+* own cache line so that consumers waiting on empty do not invalidate
+* the line producers wait on
+*/
+struct data_control_st {
+    struct notification_callback_st * not_full_callback;
+    struct notification_callback_st *  not_empty_callback;
+    /*
+    * number of callbacks registered in each list, lock free queues
+    * only take the mutex to run the callbacks when it is not 0
+    */
+    atomic_uint not_full_listeners;
+    atomic_uint not_empty_listeners;
+    /*
+    * waiters spin up to spin_budget iterations before sleeping,
+    * the budget starts at max_spin, adapts to the number of spins
+    * recent waits needed and never exceeds it, 0 disables spinning
+    */
+    unsigned int max_spin;
+    // set once by queue_close, never cleared
+    atomic_int closed;
+    /*
+    * incremented by queue_reset under the mutex, a waiter that sees
+    * it change while it sleeps returns ECANCELED
+    */
+    unsigned int resets;
+    /*
+    * eventfds of queue_eventfd_not_empty and queue_eventfd_not_full,
+    * -1 until requested, and the edge callbacks writing to them
+    */
+    int efd[2];
+    struct notification_callback_st * efd_nc[2];
+    pthread_mutex_t mutex cache_aligned;
+    atomic_uint spin_budget;
+    /*
+    * callbacks run outside the mutex, a dispatcher registers in
+    * cb_running[cb_epoch & 1] while it holds the mutex. removing a
+    * callback moves to the next epoch, then waits for the dispatchers
+    * of the previous one before freeing it. removals are serialized
+    * by cb_mutex, so the dispatchers of older epochs are done already
+    */
+    unsigned int cb_epoch cache_aligned;
+    atomic_uint cb_running[2];
+    pthread_mutex_t cb_mutex;
+    event_t empty cache_aligned;
+    event_t full cache_aligned;
+    // the heads of the two callback lists
+    struct notification_callback_st heads[2];
+};
+
+// allocated on a cache line boundary by _queue_new
+struct queue_st {
+    queue_type_t type;
+    /*
+    * pool the queue is given back to by queue_free, NULL for the
+    * queues allocated on their own. pool_next links the free queues,
+    * or the subscribers of a broadcast
+    */
+    struct queue_pool_st * pool;
+    struct queue_st * pool_next;
+    // built by queue_init_at, queue_free does not release its memory
+    int in_place;
+    /*
+    * broadcast a subscriber reads from, the next element it reads and
+    * the number of elements it missed, see broadcast.c
+    */
+    struct broadcast_st * broadcast;
+    _Atomic uint64_t cursor;
+    _Atomic uint64_t lagged;
+    queue_ctrl_t ctrl;
+    buffer_t rb;
+};
+
+static inline int _queue_closed(queue_t * q){
+    return atomic_load_explicit(&q->ctrl.closed, memory_order_acquire);
+}
+
+typedef int (*queue_mutex_lock_t)(pthread_mutex_t *);
+
+// priority queues built with bucket_init instead of heap_init
+#define QUEUE_BUCKETED 0x10000
+// queues built with buffer_init_growable (or heap_init_growable)
+#define QUEUE_GROWABLE 0x20000
+
+// buffer functions of a priority queue, a heap or buckets
+static inline buffer_write _priority_write(queue_t * q){
+    return q->rb.type == BUCKET_BUFFER ? bucket_write : hb_write;
+}
+
+static inline buffer_take _priority_take(queue_t * q){
+    return q->rb.type == BUCKET_BUFFER ? bucket_take : hb_take;
+}
+
+static inline buffer_write_many _priority_write_many(queue_t * q){
+    return q->rb.type == BUCKET_BUFFER ? bucket_write_many : hb_write_many;
+}
+
+static inline buffer_take_many _priority_take_many(queue_t * q){
+    return q->rb.type == BUCKET_BUFFER ? bucket_take_many : hb_take_many;
+}
+
+/*
+* the generic operations, f is the buffer function moving the element
+* in (or out of) the queue buffer
+*/
+int _queue_take(queue_t * queue, void * data,
+        struct timespec * abstime, buffer_take f);
+int _queue_try_take(queue_t * q, void * data,
+        buffer_take f, queue_mutex_lock_t mutex_lock);
+int _queue_put(queue_t * queue, void * value,
+        struct timespec * abstime, buffer_write f, int priority);
+int _queue_try_put(queue_t * q, void * data,
+        buffer_write f, int priority, queue_mutex_lock_t mutex_lock);
+/*
+* end a locked put (or take) of n elements: wake up the waiters,
+* release the mutex then run the callbacks
+*/
+void _queue_put_done(queue_t * q, unsigned int n);
+void _queue_take_done(queue_t * q, unsigned int n);
+/*
+* wake up the waiters and run the callbacks after n elements were
+* put (or taken) in a lock free queue
+*/
+void _lf_notify_not_empty(queue_t * q, unsigned int n);
+void _lf_notify_not_full(queue_t * q, unsigned int n);
+/*
+* waits on ev after event_prepare_wait returned key, spinning first as
+* set by queue_set_spin
+*/
+int _spin_then_wait(queue_ctrl_t * dctrl, event_t * ev,
+        unsigned int key, struct timespec * abstime);
+
+int _queue_ctrl_init(queue_ctrl_t * dctrl);
+int _queue_ctrl_free(queue_ctrl_t * dctrl);
+/*
+* the subscribers of a broadcast keep no element, they read them from
+* the ring of the broadcast. block is 0 for the try takes
+*/
+int _broadcast_take(queue_t * q, void * data, unsigned int n,
+        unsigned int * taken, struct timespec * abstime, int block);
+unsigned int _broadcast_used(queue_t * q);
+void _broadcast_unsubscribe(queue_t * q);
+
+#endif
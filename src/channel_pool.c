@@ -0,0 +1,387 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "channel_pool.h"
+#include "channel_impl.h"
+
+typedef struct {
+    channel_task_t task;
+    void * arg;
+}pool_task_t;
+
+/*
+* Chase-Lev deque of fixed size, as in "Correct and Efficient
+* Work-Stealing for Weak Memory Models" (Le et al.).
+* only the owner pushes and takes at bottom, thieves take at top with
+* a compare and swap, the owner only competes with them for the last
+* task. the slots are atomic so that a thief reading a slot the owner
+* is writing is not a data race, its compare and swap fails anyway
+*/
+typedef struct {
+    atomic_uintptr_t task;
+    atomic_uintptr_t arg;
+}deque_slot_t;
+
+typedef struct {
+    atomic_long top cache_aligned;
+    atomic_long bottom cache_aligned;
+    deque_slot_t slots[CHANNEL_POOL_DEQUE_SIZE] cache_aligned;
+}deque_t;
+
+#define deque_slot(d, i) (&(d)->slots[(i) & (CHANNEL_POOL_DEQUE_SIZE - 1)])
+
+static int _deque_push(deque_t * d, pool_task_t * t){
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    if(b - top >= CHANNEL_POOL_DEQUE_SIZE)
+        return 0;
+    deque_slot_t * s = deque_slot(d, b);
+    atomic_store_explicit(&s->task, (uintptr_t)t->task, memory_order_relaxed);
+    atomic_store_explicit(&s->arg, (uintptr_t)t->arg, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return 1;
+}
+
+static inline void _deque_read(deque_t * d, long i, pool_task_t * t){
+    deque_slot_t * s = deque_slot(d, i);
+    t->task = (channel_task_t)atomic_load_explicit(&s->task,
+            memory_order_relaxed);
+    t->arg = (void*)atomic_load_explicit(&s->arg, memory_order_relaxed);
+}
+
+static int _deque_take(deque_t * d, pool_task_t * t){
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if(top > b){
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+    _deque_read(d, b, t);
+    if(top == b){
+        //last task, race with the thieves
+        int res = atomic_compare_exchange_strong_explicit(&d->top,
+                &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return res;
+    }
+    return 1;
+}
+
+/*
+* returns 1 if a task was stolen, 0 if d was empty, -1 if another
+* thief (or the owner) took the task first, d may not be empty then
+*/
+static int _deque_steal(deque_t * d, pool_task_t * t){
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if(top >= b)
+        return 0;
+    _deque_read(d, top, t);
+    return atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed) ? 1 : -1;
+}
+
+/*
+* submitted counts the tasks the worker submitted, done the tasks it
+* ran. only the worker writes them, with plain stores, so that a task
+* costs no read-modify-write on a shared line
+*/
+typedef struct {
+    deque_t deque;
+    channel_pool_t * pool;
+    unsigned int seed;
+    pthread_t thread;
+    atomic_ulong submitted cache_aligned;
+    atomic_ulong done;
+}worker_t;
+
+/*
+* the n deques are all valid, even the ones of workers that failed to
+* start, so that thieves can look at every one of them.
+* the shared fields are only written off the task path: sleepers
+* counts the workers about to sleep on the idle event, submitters
+* only notify it when it is not 0. the tasks of the threads that are
+* not workers are counted in submitted, they go through the injection
+* queue which is shared anyway. prio_pending counts the tasks of the
+* priority lanes so that workers skip their lock when they are empty.
+* channel_pool_wait compares the tasks submitted and done, the
+* workers notify the done event when they run out of tasks
+*/
+struct channel_pool_st {
+    unsigned int n;
+    unsigned int started;
+    worker_t * workers;
+    queue_t * inject;
+    priority_queue_t * lanes;
+    atomic_int stop;
+    atomic_uint sleepers cache_aligned;
+    atomic_long prio_pending cache_aligned;
+    atomic_ulong submitted cache_aligned;
+    event_t idle cache_aligned;
+    event_t done cache_aligned;
+};
+
+static __thread worker_t * _current_worker;
+
+// times an idle worker looks for tasks again before it sleeps
+#define POOL_SPIN 64
+
+// counters written by a single thread
+static inline void _count(atomic_ulong * c){
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed)
+            + 1, memory_order_release);
+}
+
+/*
+* 1 once every task submitted is done. the done counters are read
+* first: a task is counted as submitted before it can be picked, so
+* the tasks counted as done are all counted as submitted, and the
+* totals only match when no task is left
+*/
+static int _pool_finished(channel_pool_t * pool){
+    unsigned long done = 0, submitted;
+    unsigned int i;
+    for(i = 0; i < pool->n; i++)
+        done += atomic_load_explicit(&pool->workers[i].done,
+                memory_order_acquire);
+    submitted = atomic_load_explicit(&pool->submitted, memory_order_acquire);
+    for(i = 0; i < pool->n; i++)
+        submitted += atomic_load_explicit(&pool->workers[i].submitted,
+                memory_order_acquire);
+    return done == submitted;
+}
+
+/*
+* wakes up a sleeping worker after a task was published. the fence
+* pairs with the one _pool_worker issues once it counted itself in
+* sleepers: either the worker sees the task, or the submitter sees
+* the sleeper
+*/
+static inline void _pool_wake(channel_pool_t * pool){
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&pool->sleepers, memory_order_relaxed) > 0)
+        event_notify(&pool->idle, 1);
+}
+
+static int _pool_next(channel_pool_t * pool, worker_t * w, pool_task_t * t){
+    unsigned int i;
+    if(atomic_load_explicit(&pool->prio_pending, memory_order_relaxed) > 0 &&
+            priority_queue_no_wait_take(pool->lanes, t) == 0){
+        atomic_fetch_sub_explicit(&pool->prio_pending, 1,
+                memory_order_relaxed);
+        return 1;
+    }
+    if(_deque_take(&w->deque, t))
+        return 1;
+    if(queue_try_take(pool->inject, t) == 0)
+        return 1;
+    //steal, starting from a random victim
+    w->seed = w->seed * 1103515245 + 12345;
+    unsigned int start = (w->seed >> 16) % pool->n;
+    for(i = 0; i < pool->n; i++){
+        worker_t * v = &pool->workers[(start + i) % pool->n];
+        int res;
+        if(v == w)
+            continue;
+        //a lost race does not mean the deque is empty
+        while((res = _deque_steal(&v->deque, t)) < 0);
+        if(res)
+            return 1;
+    }
+    return 0;
+}
+
+static void * _pool_worker(void * arg){
+    worker_t * w = (worker_t*)arg;
+    channel_pool_t * pool = w->pool;
+    pool_task_t t;
+    unsigned int spins = 0;
+    _current_worker = w;
+    while(1){
+        if(_pool_next(pool, w, &t)){
+            t.task(t.arg);
+            _count(&w->done);
+            spins = 0;
+            continue;
+        }
+        //out of tasks, channel_pool_wait may be done
+        if(spins == 0)
+            event_notify(&pool->done, EVENT_ALL);
+        //stay awake for a while, so that a stream of tasks does not
+        //have to wake a worker up for each one
+        if(spins++ < POOL_SPIN){
+            sched_yield();
+            continue;
+        }
+        spins = 0;
+        unsigned int key = event_prepare_wait(&pool->idle);
+        atomic_fetch_add(&pool->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        int found = _pool_next(pool, w, &t);
+        if(found || atomic_load(&pool->stop)){
+            atomic_fetch_sub(&pool->sleepers, 1);
+            event_cancel_wait(&pool->idle);
+            if(!found)
+                break;
+            t.task(t.arg);
+            _count(&w->done);
+            continue;
+        }
+        event_wait(&pool->idle, key, NULL);
+        atomic_fetch_sub(&pool->sleepers, 1);
+    }
+    _current_worker = NULL;
+    return NULL;
+}
+
+/*
+* counts a task about to be published, in the counter of w when the
+* caller is a worker of the pool
+*/
+static inline void _pool_count(channel_pool_t * pool, worker_t * w){
+    if(w != NULL)
+        _count(&w->submitted);
+    else
+        atomic_fetch_add(&pool->submitted, 1);
+}
+
+// the task counted by _pool_count was never published
+static void _pool_uncount(channel_pool_t * pool, worker_t * w){
+    if(w != NULL)
+        _count(&w->done);
+    else
+        atomic_fetch_sub(&pool->submitted, 1);
+    event_notify(&pool->done, EVENT_ALL);
+}
+
+int channel_pool_submit(channel_pool_t * pool, channel_task_t task,
+        void * arg)
+{
+    pool_task_t t = {task, arg};
+    worker_t * w = _current_worker;
+    int err;
+    if(w != NULL && w->pool != pool)
+        w = NULL;
+    if(w == NULL && atomic_load(&pool->stop))
+        return EPIPE;
+    _pool_count(pool, w);
+    if(w != NULL && _deque_push(&w->deque, &t)){
+        _pool_wake(pool);
+        return 0;
+    }
+    err = w != NULL ?
+        queue_try_put(pool->inject, &t) : queue_put(pool->inject, &t);
+    if(err == EAGAIN){
+        //the deque and the injection queue of a worker are full
+        task(arg);
+        _count(&w->done);
+        return 0;
+    }
+    if(err != 0){
+        _pool_uncount(pool, w);
+        return err;
+    }
+    _pool_wake(pool);
+    return 0;
+}
+
+int channel_pool_submit_priority(channel_pool_t * pool,
+        channel_task_t task, void * arg, int priority)
+{
+    pool_task_t t = {task, arg};
+    worker_t * w = _current_worker;
+    int err;
+    if(w != NULL && w->pool != pool)
+        w = NULL;
+    if(pool->lanes == NULL)
+        return EINVAL;
+    if(atomic_load(&pool->stop))
+        return EPIPE;
+    _pool_count(pool, w);
+    atomic_fetch_add_explicit(&pool->prio_pending, 1, memory_order_relaxed);
+    if((err = priority_queue_no_wait_put(pool->lanes, &t, priority)) != 0){
+        atomic_fetch_sub_explicit(&pool->prio_pending, 1,
+                memory_order_relaxed);
+        _pool_uncount(pool, w);
+        return err;
+    }
+    _pool_wake(pool);
+    return 0;
+}
+
+int channel_pool_wait(channel_pool_t * pool){
+    while(1){
+        unsigned int key = event_prepare_wait(&pool->done);
+        if(_pool_finished(pool)){
+            event_cancel_wait(&pool->done);
+            return 0;
+        }
+        event_wait(&pool->done, key, NULL);
+    }
+}
+
+static void _pool_destroy(channel_pool_t * pool){
+    if(pool->inject) queue_free(pool->inject);
+    if(pool->lanes) priority_queue_free(pool->lanes);
+    event_destroy(&pool->idle);
+    event_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
+
+channel_pool_t * channel_pool_new(unsigned int workers, unsigned int lanes){
+    channel_pool_t * pool;
+    unsigned int i;
+    if(workers == 0 || lanes > BUCKET_MAX_LEVELS)
+        return NULL;
+    if(posix_memalign((void**)&pool, CACHE_LINE_SIZE,
+                sizeof(channel_pool_t)))
+        return NULL;
+    memset(pool, 0, sizeof(channel_pool_t));
+    if(posix_memalign((void**)&pool->workers, CACHE_LINE_SIZE,
+                workers*sizeof(worker_t))){
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, workers*sizeof(worker_t));
+    event_init(&pool->idle);
+    event_init(&pool->done);
+    pool->inject = queue_new_mpmc(CHANNEL_POOL_QUEUE_SIZE,
+            sizeof(pool_task_t));
+    if(lanes)
+        pool->lanes = priority_queue_new_bucketed(CHANNEL_POOL_QUEUE_SIZE,
+                sizeof(pool_task_t), lanes);
+    if(pool->inject == NULL || (lanes && pool->lanes == NULL)){
+        _pool_destroy(pool);
+        return NULL;
+    }
+    pool->n = workers;
+    for(i = 0; i < workers; i++){
+        worker_t * w = &pool->workers[i];
+        w->pool = pool;
+        w->seed = i + 1;
+    }
+    for(i = 0; i < workers; i++){
+        if(pthread_create(&pool->workers[i].thread, NULL, _pool_worker,
+                    &pool->workers[i]) != 0)
+            break;
+        pool->started++;
+    }
+    if(pool->started < workers){
+        channel_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void channel_pool_free(channel_pool_t * pool){
+    unsigned int i;
+    atomic_store(&pool->stop, 1);
+    event_notify(&pool->idle, EVENT_ALL);
+    for(i = 0; i < pool->started; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    _pool_destroy(pool);
+}
@@ -0,0 +1,65 @@
+#ifndef CHANNEL_POOL_H
+#define CHANNEL_POOL_H
+
+#include "channel.h"
+
+/*
+* pool of worker threads running tasks.
+* every worker owns a work stealing deque: the tasks it submits are
+* pushed to (and taken from) the bottom of its own deque without any
+* lock, idle workers steal from the top of the deques of the others.
+* the tasks submitted by other threads go through a lock free
+* injection queue, the ones submitted with a priority through a
+* bucketed priority queue whose levels are the priority lanes.
+* workers run the priority lanes first, then their own deque, then
+* the injection queue, then steal.
+*/
+typedef struct channel_pool_st channel_pool_t;
+typedef void (*channel_task_t)(void * arg);
+
+// capacity of each worker deque, a full deque spills to the injection queue
+#define CHANNEL_POOL_DEQUE_SIZE 4096
+// capacity of the injection queue and of the priority lanes
+#define CHANNEL_POOL_QUEUE_SIZE 4096
+
+/*
+* starts workers threads, lanes is the number of priorities accepted
+* by channel_pool_submit_priority, from 0 to lanes - 1, 0 disables
+* the priority lanes. lanes must not exceed BUCKET_MAX_LEVELS.
+* returns NULL if the initialization was unsuccesful at some point
+*/
+channel_pool_t * channel_pool_new(unsigned int workers, unsigned int lanes);
+/*
+* runs task(arg) on one of the workers.
+* called from a worker of the pool the task is pushed to its own
+* deque, otherwise it is put in the injection queue, waiting for room
+* if the queue is full.
+* returns 0 when the operation is succesful
+* returns EPIPE if the pool is being freed
+*/
+int channel_pool_submit(channel_pool_t * pool, channel_task_t task,
+        void * arg);
+/*
+* runs task(arg) before the tasks of a lower priority and before the
+* tasks submitted without priority that have not started yet.
+* priorities out of range are clamped to 0 or lanes - 1.
+* returns 0 when the operation is succesful
+* returns EAGAIN if the priority lanes are full
+* returns EINVAL if the pool has no priority lanes
+* returns EPIPE if the pool is being freed
+*/
+int channel_pool_submit_priority(channel_pool_t * pool,
+        channel_task_t task, void * arg, int priority);
+/*
+* waits until every task submitted so far, and the tasks they
+* submitted, are done. may not be called from a worker of the pool.
+* returns 0 when the operation is succesful
+*/
+int channel_pool_wait(channel_pool_t * pool);
+/*
+* runs the tasks left, stops the workers and frees the pool.
+* may not be called from a worker of the pool
+*/
+void channel_pool_free(channel_pool_t * pool);
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef CHANNEL_TYPED_H
+#define CHANNEL_TYPED_H
+
+/*
+* typed queues, their operations are generated for one element type
+* and inlined in the caller. they need the layout of the queues, so
+* this header brings channel_impl.h in, channel.h does not
+*/
+
+#include <assert.h>
+#include "channel.h"
+#include "channel_impl.h"
+
+/*
+* DECLARE_QUEUE(name, elem_t) defines fifo queues of elements of
+* type elem_t:
+*   name##_queue_t
+*   name##_queue_new(n), name##_queue_new_spsc(n), name##_queue_new_mpmc(n)
+*   name##_queue_put(q, value), name##_queue_try_put(q, value),
+*   name##_queue_put_for(q, value, nsec)
+*   name##_queue_take(q, &value), name##_queue_try_take(q, &value),
+*   name##_queue_take_for(q, &value, nsec)
+*   name##_queue_base(q)
+*   name##_queue_free(q)
+* they behave as their queue_* counterparts, the capacity is rounded
+* up to a power of two and the elements are copied with a constant
+* size. as long as they do not have to wait, puts and takes are
+* inlined: lock free queues never call the library, locked queues
+* only call it to wake up the waiters and run the callbacks.
+* name##_queue_t is a type of its own, only the queues built by its
+* constructors can be used with these functions. name##_queue_base
+* returns the queue to use with every queue_* function.
+*/
+#define DECLARE_QUEUE(name, elem_t) \
+BUFFER_SPECIALIZE(name, elem_t) \
+typedef struct name##_queue_st name##_queue_t; \
+static inline queue_t * name##_queue_base(name##_queue_t * q){ \
+    return (queue_t*)q; \
+} \
+static inline name##_queue_t * name##_queue_new(unsigned int n){ \
+    return (name##_queue_t*)queue_new(buffer_pow2(n), sizeof(elem_t)); \
+} \
+static inline name##_queue_t * name##_queue_new_spsc(unsigned int n){ \
+    return (name##_queue_t*)queue_new_spsc(buffer_pow2(n), \
+            sizeof(elem_t)); \
+} \
+static inline name##_queue_t * name##_queue_new_mpmc(unsigned int n){ \
+    return (name##_queue_t*)queue_new_mpmc(buffer_pow2(n), \
+            sizeof(elem_t)); \
+} \
+/* the generated buffer functions only handle these rings */ \
+static inline queue_t * name##_queue_ring(name##_queue_t * tq){ \
+    queue_t * q = (queue_t*)tq; \
+    assert(q->type == QUEUE_FIFO || q->type == QUEUE_SPSC || \
+            q->type == QUEUE_MPMC); \
+    assert(q->rb.seg_n == 0 && q->rb.mask == q->rb.n - 1 && \
+            q->rb.size == sizeof(elem_t)); \
+    return q; \
+} \
+static inline buffer_write name##_queue_write_op(queue_t * q){ \
+    switch(q->type){ \
+    case QUEUE_SPSC: return name##_spsc_write; \
+    case QUEUE_MPMC: return name##_mpmc_write; \
+    default: return name##_rb_write; \
+    } \
+} \
+static inline buffer_take name##_queue_take_op(queue_t * q){ \
+    switch(q->type){ \
+    case QUEUE_SPSC: return name##_spsc_take; \
+    case QUEUE_MPMC: return name##_mpmc_take; \
+    default: return name##_rb_take; \
+    } \
+} \
+/* \
+* puts value without waiting, returns 0 when it was put, EAGAIN when \
+* the queue is full, EPIPE when it is closed \
+*/ \
+static inline int name##_queue_put_now(queue_t * q, elem_t * value, \
+        queue_mutex_lock_t lock) \
+{ \
+    int err; \
+    if(q->type == QUEUE_SPSC || q->type == QUEUE_MPMC){ \
+        if(_queue_closed(q)) \
+            return EPIPE; \
+        if(q->type == QUEUE_SPSC ? !name##_spsc_write(&q->rb, value, 0) : \
+                !name##_mpmc_write(&q->rb, value, 0)) \
+            return EAGAIN; \
+        _lf_notify_not_empty(q, 1); \
+        return 0; \
+    } \
+    if((err = lock(&q->ctrl.mutex)) != 0) \
+        return err; \
+    if(_queue_closed(q)) \
+        err = EPIPE; \
+    else if(!name##_rb_write(&q->rb, value, 0)) \
+        err = EAGAIN; \
+    else{ \
+        _queue_put_done(q, 1); \
+        return 0; \
+    } \
+    pthread_mutex_unlock(&q->ctrl.mutex); \
+    return err; \
+} \
+/* \
+* takes an element without waiting, returns 0 when it was taken, \
+* EAGAIN when the queue is empty, EPIPE when it is also closed. \
+* as in _lf_queue_take the closed flag is read before the ring \
+*/ \
+static inline int name##_queue_take_now(queue_t * q, elem_t * value, \
+        queue_mutex_lock_t lock) \
+{ \
+    int err; \
+    if(q->type == QUEUE_SPSC || q->type == QUEUE_MPMC){ \
+        int closed = _queue_closed(q); \
+        if(q->type == QUEUE_SPSC ? !name##_spsc_take(&q->rb, value) : \
+                !name##_mpmc_take(&q->rb, value)) \
+            return closed ? EPIPE : EAGAIN; \
+        _lf_notify_not_full(q, 1); \
+        return 0; \
+    } \
+    if((err = lock(&q->ctrl.mutex)) != 0) \
+        return err; \
+    if(!name##_rb_take(&q->rb, value)){ \
+        err = _queue_closed(q) ? EPIPE : EAGAIN; \
+        pthread_mutex_unlock(&q->ctrl.mutex); \
+        return err; \
+    } \
+    _queue_take_done(q, 1); \
+    return 0; \
+} \
+static inline int name##_queue_put(name##_queue_t * tq, elem_t value){ \
+    queue_t * q = name##_queue_ring(tq); \
+    int err = name##_queue_put_now(q, &value, pthread_mutex_lock); \
+    if(err != EAGAIN) \
+        return err; \
+    return _queue_put(q, &value, NULL, name##_queue_write_op(q), 0); \
+} \
+static inline int name##_queue_try_put(name##_queue_t * tq, elem_t value){ \
+    return name##_queue_put_now(name##_queue_ring(tq), &value, \
+            pthread_mutex_trylock); \
+} \
+static inline int name##_queue_put_for(name##_queue_t * tq, elem_t value, \
+        uint64_t nsec) \
+{ \
+    queue_t * q = name##_queue_ring(tq); \
+    int err = name##_queue_put_now(q, &value, pthread_mutex_lock); \
+    if(err != EAGAIN) \
+        return err; \
+    struct timespec ts; \
+    queue_deadline(&ts, nsec); \
+    return _queue_put(q, &value, &ts, name##_queue_write_op(q), 0); \
+} \
+static inline int name##_queue_take(name##_queue_t * tq, elem_t * value){ \
+    queue_t * q = name##_queue_ring(tq); \
+    int err = name##_queue_take_now(q, value, pthread_mutex_lock); \
+    if(err != EAGAIN) \
+        return err; \
+    return _queue_take(q, value, NULL, name##_queue_take_op(q)); \
+} \
+static inline int name##_queue_try_take(name##_queue_t * tq, \
+        elem_t * value) \
+{ \
+    return name##_queue_take_now(name##_queue_ring(tq), value, \
+            pthread_mutex_trylock); \
+} \
+static inline int name##_queue_take_for(name##_queue_t * tq, \
+        elem_t * value, uint64_t nsec) \
+{ \
+    queue_t * q = name##_queue_ring(tq); \
+    int err = name##_queue_take_now(q, value, pthread_mutex_lock); \
+    if(err != EAGAIN) \
+        return err; \
+    struct timespec ts; \
+    queue_deadline(&ts, nsec); \
+    return _queue_take(q, value, &ts, name##_queue_take_op(q)); \
+} \
+static inline void name##_queue_free(name##_queue_t * q){ \
+    queue_free((queue_t*)q); \
+}
+
+/*
+* DECLARE_PRIORITY_QUEUE(name, elem_t, priority_of) defines priority
+* queues of elements of type elem_t, priority_of(const elem_t *)
+* returns the int priority of an element:
+*   name##_queue_t, name##_queue_new(n)
+*   name##_queue_put(q, value), name##_queue_try_put(q, value),
+*   name##_queue_put_for(q, value, nsec)
+*   name##_queue_take(q, &value), name##_queue_try_take(q, &value),
+*   name##_queue_take_for(q, &value, nsec)
+*   name##_queue_base(q)
+*   name##_queue_free(q)
+* they behave as their priority_queue_* counterparts, the locking and
+* the calls to the heap (or buckets) are inlined as long as they do
+* not have to wait.
+*/
+#define DECLARE_PRIORITY_QUEUE(name, elem_t, priority_of) \
+typedef struct name##_queue_st name##_queue_t; \
+static inline priority_queue_t * name##_queue_base(name##_queue_t * q){ \
+    return (priority_queue_t*)q; \
+} \
+static inline name##_queue_t * name##_queue_new(unsigned int n){ \
+    return (name##_queue_t*)priority_queue_new(n, sizeof(elem_t)); \
+} \
+static inline queue_t * name##_queue_heap(name##_queue_t * tq){ \
+    queue_t * q = (queue_t*)tq; \
+    assert(q->type == QUEUE_PRIORITY && q->rb.size == sizeof(elem_t)); \
+    return q; \
+} \
+static inline int name##_queue_put_now(queue_t * q, elem_t * value, \
+        queue_mutex_lock_t lock) \
+{ \
+    int err, written; \
+    if((err = lock(&q->ctrl.mutex)) != 0) \
+        return err; \
+    if(_queue_closed(q)){ \
+        pthread_mutex_unlock(&q->ctrl.mutex); \
+        return EPIPE; \
+    } \
+    if(q->rb.type == BUCKET_BUFFER) \
+        written = bucket_write(&q->rb, value, priority_of(value)); \
+    else \
+        written = hb_write(&q->rb, value, priority_of(value)); \
+    if(!written){ \
+        pthread_mutex_unlock(&q->ctrl.mutex); \
+        return EAGAIN; \
+    } \
+    _queue_put_done(q, 1); \
+    return 0; \
+} \
+static inline int name##_queue_take_now(queue_t * q, elem_t * value, \
+        queue_mutex_lock_t lock) \
+{ \
+    int err, taken; \
+    if((err = lock(&q->ctrl.mutex)) != 0) \
+        return err; \
+    if(q->rb.type == BUCKET_BUFFER) \
+        taken = bucket_take(&q->rb, value); \
+    else \
+        taken = hb_take(&q->rb, value); \
+    if(!taken){ \
+        err = _queue_closed(q) ? EPIPE : EAGAIN; \
+        pthread_mutex_unlock(&q->ctrl.mutex); \
+        return err; \
+    } \
+    _queue_take_done(q, 1); \
+    return 0; \
+} \
+static inline int name##_queue_put(name##_queue_t * tq, elem_t value){ \
+    queue_t * q = name##_queue_heap(tq); \
+    int err = name##_queue_put_now(q, &value, pthread_mutex_lock); \
+    if(err != EAGAIN) \
+        return err; \
+    return _queue_put(q, &value, NULL, _priority_write(q), \
+            priority_of(&value)); \
+} \
+static inline int name##_queue_try_put(name##_queue_t * tq, elem_t value){ \
+    return name##_queue_put_now(name##_queue_heap(tq), &value, \
+            pthread_mutex_trylock); \
+} \
+static inline int name##_queue_put_for(name##_queue_t * tq, elem_t value, \
+        uint64_t nsec) \
+{ \
+    queue_t * q = name##_queue_heap(tq); \
+    int err = name##_queue_put_now(q, &value, pthread_mutex_lock); \
+    if(err != EAGAIN) \
+        return err; \
+    struct timespec ts; \
+    queue_deadline(&ts, nsec); \
+    return _queue_put(q, &value, &ts, _priority_write(q), \
+            priority_of(&value)); \
+} \
+static inline int name##_queue_take(name##_queue_t * tq, elem_t * value){ \
+    queue_t * q = name##_queue_heap(tq); \
+    int err = name##_queue_take_now(q, value, pthread_mutex_lock); \
+    if(err != EAGAIN) \
+        return err; \
+    return _queue_take(q, value, NULL, _priority_take(q)); \
+} \
+static inline int name##_queue_try_take(name##_queue_t * tq, \
+        elem_t * value) \
+{ \
+    return name##_queue_take_now(name##_queue_heap(tq), value, \
+            pthread_mutex_trylock); \
+} \
+static inline int name##_queue_take_for(name##_queue_t * tq, \
+        elem_t * value, uint64_t nsec) \
+{ \
+    queue_t * q = name##_queue_heap(tq); \
+    int err = name##_queue_take_now(q, value, pthread_mutex_lock); \
+    if(err != EAGAIN) \
+        return err; \
+    struct timespec ts; \
+    queue_deadline(&ts, nsec); \
+    return _queue_take(q, value, &ts, _priority_take(q)); \
+} \
+static inline void name##_queue_free(name##_queue_t * q){ \
+    priority_queue_free((priority_queue_t*)q); \
+}
+
+#endif
@@ -3,7 +3,33 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <stdint.h>
 
 #define calloc_(ptr, n, size) if(!((ptr) = calloc((n), (size)))) return ENOMEM
+#define CACHE_LINE_SIZE 64
+#define cache_aligned __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/*
+* same as calloc but the memory starts on a cache line boundary.
+* returns ENOMEM if n*size overflows or the allocation failed
+*/
+static inline int aligned_calloc(void ** ptr, size_t n, size_t size){
+    if(size && n > SIZE_MAX / size)
+        return ENOMEM;
+    if(posix_memalign(ptr, CACHE_LINE_SIZE, n*size))
+        return ENOMEM;
+    memset(*ptr, 0, n*size);
+    return 0;
+}
+
+// hint to the cpu that we are in a spin loop
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do{}while(0)
+#endif
 
 #endif
@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <limits.h>
+#include "common.h"
+#include "event.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline long _futex(atomic_uint * addr, int op, unsigned int val,
+        const struct timespec * ts)
+{
+    return syscall(SYS_futex, addr, op, val, ts, NULL,
+            FUTEX_BITSET_MATCH_ANY);
+}
+#endif
+
+int event_init(event_t * ev){
+    atomic_init(&ev->seq, 0);
+    atomic_init(&ev->waiters, 0);
+    atomic_init(&ev->sleepers, 0);
+#ifndef __linux__
+    int err_code;
+    if((err_code = pthread_mutex_init(&(ev->mutex), NULL)))
+        return err_code;
+    if((err_code = monotonic_cond_init(&(ev->cond)))){
+        pthread_mutex_destroy(&(ev->mutex));
+        return err_code;
+    }
+#endif
+    return 0;
+}
+
+void event_destroy(event_t * ev){
+#ifndef __linux__
+    pthread_cond_destroy(&(ev->cond));
+    pthread_mutex_destroy(&(ev->mutex));
+#else
+    (void)ev;
+#endif
+}
+
+unsigned int event_prepare_wait(event_t * ev){
+    atomic_fetch_add(&ev->waiters, 1);
+    //pairs with the fence in event_notify
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&ev->seq, memory_order_acquire);
+}
+
+void event_cancel_wait(event_t * ev){
+    atomic_fetch_sub(&ev->waiters, 1);
+}
+
+int event_wait(event_t * ev, unsigned int key,
+        const struct timespec * abstime)
+{
+    int err = 0;
+    atomic_fetch_add(&ev->sleepers, 1);
+#ifdef __linux__
+    if(atomic_load_explicit(&ev->seq, memory_order_acquire) == key &&
+            _futex(&ev->seq, FUTEX_WAIT_BITSET_PRIVATE, key, abstime) == -1 &&
+            errno == ETIMEDOUT)
+        err = ETIMEDOUT;
+#else
+    pthread_mutex_lock(&(ev->mutex));
+    while(err == 0 &&
+            atomic_load_explicit(&ev->seq, memory_order_acquire) == key){
+        if(abstime)
+            err = monotonic_cond_timedwait(&(ev->cond), &(ev->mutex),
+                    abstime);
+        else
+            err = pthread_cond_wait(&(ev->cond), &(ev->mutex));
+    }
+    pthread_mutex_unlock(&(ev->mutex));
+#endif
+    atomic_fetch_sub(&ev->sleepers, 1);
+    atomic_fetch_sub(&ev->waiters, 1);
+    return err;
+}
+
+unsigned int event_spin(event_t * ev, unsigned int key,
+        unsigned int budget)
+{
+    unsigned int i;
+    for(i = 1; i <= budget; i++){
+        if(atomic_load_explicit(&ev->seq, memory_order_acquire) != key)
+            return i;
+        cpu_relax();
+    }
+    return 0;
+}
+
+void event_notify(event_t * ev, unsigned int n){
+    //the caller's change must be visible before waiters is read
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&ev->waiters, memory_order_relaxed) == 0)
+        return;
+#ifdef __linux__
+    atomic_fetch_add(&ev->seq, 1);
+    //spinning waiters only need the new sequence number
+    if(atomic_load(&ev->sleepers) == 0)
+        return;
+    _futex(&ev->seq, FUTEX_WAKE_PRIVATE, n > INT_MAX ? INT_MAX : n, NULL);
+#else
+    pthread_mutex_lock(&(ev->mutex));
+    atomic_fetch_add_explicit(&ev->seq, 1, memory_order_release);
+    if(n == 1)
+        pthread_cond_signal(&(ev->cond));
+    else
+        pthread_cond_broadcast(&(ev->cond));
+    pthread_mutex_unlock(&(ev->mutex));
+#endif
+}
+
+void monotonic_deadline(struct timespec * ts, uint64_t nsec){
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    nsec += ts->tv_nsec;
+    ts->tv_sec += nsec / 1000000000;
+    ts->tv_nsec = nsec % 1000000000;
+}
+
+int monotonic_cond_init(pthread_cond_t * cond){
+#ifdef __APPLE__
+    return pthread_cond_init(cond, NULL);
+#else
+    int err_code;
+    pthread_condattr_t attr;
+    if((err_code = pthread_condattr_init(&attr)))
+        return err_code;
+    if((err_code = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) == 0)
+        err_code = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return err_code;
+#endif
+}
+
+int monotonic_cond_timedwait(pthread_cond_t * cond,
+        pthread_mutex_t * mutex, const struct timespec * abstime)
+{
+#ifdef __APPLE__
+    //no pthread_condattr_setclock, wait for the time left instead
+    struct timespec now, rel;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rel.tv_sec = abstime->tv_sec - now.tv_sec;
+    rel.tv_nsec = abstime->tv_nsec - now.tv_nsec;
+    if(rel.tv_nsec < 0){
+        rel.tv_sec -= 1;
+        rel.tv_nsec += 1000000000;
+    }
+    if(rel.tv_sec < 0)
+        return ETIMEDOUT;
+    return pthread_cond_timedwait_relative_np(cond, mutex, &rel);
+#else
+    return pthread_cond_timedwait(cond, mutex, abstime);
+#endif
+}
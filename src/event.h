@@ -0,0 +1,69 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+* event count, a waiter first registers with event_prepare_wait,
+* checks its condition again then sleeps with event_wait.
+* event_notify only enters the kernel when somebody is registered,
+* and only wakes up as many threads as asked.
+* on linux the waiters sleep on a futex, elsewhere on a condition
+* variable.
+* all the deadlines are absolute times on CLOCK_MONOTONIC.
+*/
+typedef struct event_st {
+    atomic_uint seq;
+    atomic_uint waiters;
+    atomic_uint sleepers;
+#ifndef __linux__
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+} event_t;
+
+#define EVENT_ALL ((unsigned int)-1)
+
+int event_init(event_t * ev);
+void event_destroy(event_t * ev);
+/*
+* registers the calling thread as a waiter and returns the key to
+* pass to event_wait, the condition must be checked again after this
+* call and event_cancel_wait called if it does not need to wait
+*/
+unsigned int event_prepare_wait(event_t * ev);
+void event_cancel_wait(event_t * ev);
+/*
+* sleeps until the event is notified or abstime has passed,
+* may return early, callers check their condition again.
+* returns 0 or ETIMEDOUT
+*/
+int event_wait(event_t * ev, unsigned int key,
+        const struct timespec * abstime);
+/*
+* busy waits for up to budget iterations for the event to be
+* notified, the thread stays registered as a waiter.
+* returns the number of iterations it took, 0 if it was not notified
+*/
+unsigned int event_spin(event_t * ev, unsigned int key,
+        unsigned int budget);
+/*
+* wakes up to n waiters, EVENT_ALL wakes all of them
+*/
+void event_notify(event_t * ev, unsigned int n);
+
+/*
+* stores in ts the CLOCK_MONOTONIC time nsec nanoseconds from now
+*/
+void monotonic_deadline(struct timespec * ts, uint64_t nsec);
+/*
+* condition variables whose timed waits use CLOCK_MONOTONIC deadlines
+*/
+int monotonic_cond_init(pthread_cond_t * cond);
+int monotonic_cond_timedwait(pthread_cond_t * cond,
+        pthread_mutex_t * mutex, const struct timespec * abstime);
+
+#endif
@@ -0,0 +1,50 @@
+#include <pthread.h>
+#include "segment.h"
+
+static struct {
+    pthread_mutex_t mutex;
+    segment_t * free;
+    unsigned int count;
+} _pool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+
+segment_t * segment_alloc(size_t bytes){
+    segment_t * s = NULL;
+    if(bytes <= SEGMENT_DATA_SIZE){
+        pthread_mutex_lock(&_pool.mutex);
+        if((s = _pool.free) != NULL){
+            _pool.free = s->next;
+            _pool.count--;
+        }
+        pthread_mutex_unlock(&_pool.mutex);
+        bytes = SEGMENT_DATA_SIZE;
+    }
+    if(s == NULL &&
+            posix_memalign((void**)&s, CACHE_LINE_SIZE,
+                CACHE_LINE_SIZE + bytes) != 0)
+        return NULL;
+    s->next = NULL;
+    return s;
+}
+
+void segment_free(segment_t * s, size_t bytes){
+    if(s == NULL)
+        return;
+    if(bytes <= SEGMENT_DATA_SIZE){
+        pthread_mutex_lock(&_pool.mutex);
+        if(_pool.count < SEGMENT_POOL_MAX){
+            s->next = _pool.free;
+            _pool.free = s;
+            _pool.count++;
+            s = NULL;
+        }
+        pthread_mutex_unlock(&_pool.mutex);
+    }
+    free(s);
+}
+
+unsigned int segment_pool_count(void){
+    pthread_mutex_lock(&_pool.mutex);
+    unsigned int count = _pool.count;
+    pthread_mutex_unlock(&_pool.mutex);
+    return count;
+}
@@ -0,0 +1,34 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stddef.h>
+#include "common.h"
+
+/*
+* fixed size blocks of memory shared by every growable buffer.
+* a segment starts with a header of one cache line, its data follows.
+* segments of at most SEGMENT_DATA_SIZE bytes of data come from a
+* process wide pool that keeps up to SEGMENT_POOL_MAX free segments,
+* bigger ones are allocated and freed directly.
+*/
+#define SEGMENT_SIZE 16384
+#define SEGMENT_DATA_SIZE (SEGMENT_SIZE - CACHE_LINE_SIZE)
+#define SEGMENT_POOL_MAX 1024
+
+typedef struct segment_st {
+    struct segment_st * next;
+} segment_t;
+
+#define segment_data(s) ((char*)(s) + CACHE_LINE_SIZE)
+
+/*
+* returns a segment able to hold bytes bytes of data, its next field
+* is NULL, returns NULL if no memory is available
+*/
+segment_t * segment_alloc(size_t bytes);
+// bytes must be the value given to segment_alloc
+void segment_free(segment_t * s, size_t bytes);
+// number of free segments in the pool
+unsigned int segment_pool_count(void);
+
+#endif
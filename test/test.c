@@ -1,10 +1,16 @@
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <poll.h>
 #include "../src/buffer.h"
 #include "../src/channel.h"
+#include "../src/channel_typed.h"
+#include "../src/channel_pool.h"
+#include "../src/broadcast.h"
 
 void test_init_buffer(void){
     printf("%s: \n", __func__);
@@ -84,6 +90,41 @@ void test_rb_write_take_full_failure(void){
     printf("OK\n");
 }
 
+BUFFER_SPECIALIZE(long, long)
+
+void test_specialized_buffer(void){
+    printf("%s: \n", __func__);
+    buffer_type_t types[] = {RING_BUFFER, SPSC_BUFFER, MPMC_BUFFER};
+    buffer_write w[] = {long_rb_write, long_spsc_write, long_mpmc_write};
+    buffer_take t[] = {long_rb_take, long_spsc_take, long_mpmc_take};
+    unsigned int c, i, n = buffer_pow2(5);
+    assert(n == 8 && buffer_pow2(8) == 8 && buffer_pow2(1) == 1);
+    for(c = 0; c < 3; c++){
+        buffer_t rb;
+        long v, next = 0;
+        (void)v;
+        buffer_init(&rb, n, sizeof(long), types[c]);
+        assert(rb.mask == n - 1);
+        //several laps so that the positions wrap around the mask
+        for(i = 0; i < 4*n; i++){
+            long in = i;
+            assert(w[c](&rb, &in, 0));
+            if(i % 3 == 2){
+                while(t[c](&rb, &v))
+                    assert(v == next++);
+            }
+        }
+        while(t[c](&rb, &v))
+            assert(v == next++);
+        assert(next == 4*n);
+        for(i = 0; i < n; i++)
+            assert(w[c](&rb, &next, 0));
+        assert(!w[c](&rb, &next, 0));
+        buffer_free(&rb);
+    }
+    printf("OK\n");
+}
+
 void test_new_channel(void){
     printf("%s: \n", __func__);
     unsigned int i, n = 3;
@@ -105,21 +146,7 @@ typedef struct dummy_t{
     int j;
 }dummy_t;
 
-typedef queue_t dummy_queue_t;
-
-static inline dummy_queue_t * dummy_queue_new(unsigned int n){
-    return queue_new(n, sizeof(dummy_t));
-}
-
-static inline void dummy_queue_put(dummy_queue_t * q, dummy_t d){
-    queue_put(q, &d);
-}
-
-static inline dummy_t dummy_queue_take(dummy_queue_t * q){
-    dummy_t d;
-    queue_take(q, &d);
-    return d;
-}
+DECLARE_QUEUE(dummy, dummy_t)
 
 void test_new_dummy_channel(void){
     printf("%s: \n", __func__);
@@ -127,16 +154,17 @@ void test_new_dummy_channel(void){
     dummy_queue_t * q = dummy_queue_new(n);
     for(i = 0; i < n; i++){
 	dummy_t d = {i, i};
-	dummy_queue_put(q, d);
+	assert(dummy_queue_put(q, d) == 0);
     }
     for(i = 0; i < n; i++){
 	dummy_t comp = {i, i};
-	dummy_t d = dummy_queue_take(q);
+	dummy_t d;
+	assert(dummy_queue_take(q, &d) == 0);
 	(void)comp;
 	(void)d;
 	assert(comp.i == d.i && comp.j == d.j);
     }
-    queue_free(q);
+    dummy_queue_free(q);
     printf("OK\n");
 }
 
@@ -221,7 +249,7 @@ int comp_int(const void * a, const void * b){
 void test_hb_write_take(void){
     printf("%s: \n", __func__);
     buffer_t hb;
-    heap_init(&hb, N, sizeof(int));
+    heap_init(&hb, N, sizeof(int), 2);
     dummy_heap_t dh[N] = {{1, 3}, {2, 4}, 
         {0, 4}, {5, 5}, {3, 8}, {6, 7}, {8, 9}};
     int i = 0;
@@ -240,6 +268,43 @@ void test_hb_write_take(void){
     printf("OK\n");
 }
 
+typedef struct {
+    int id;
+    char data[4092];
+}heap_msg_t;
+
+void test_hb_large_payload(void){
+    printf("%s: \n", __func__);
+    unsigned int arity[] = {2, 4, 8};
+    unsigned int a, i, n = 1000;
+    buffer_t hb;
+    heap_msg_t m;
+    assert(heap_init(&hb, n, sizeof(heap_msg_t), 3) == EINVAL);
+    for(a = 0; a < sizeof(arity)/sizeof(arity[0]); a++){
+        assert(heap_init(&hb, n, sizeof(heap_msg_t), arity[a]) == 0);
+        srand(42);
+        //interleave puts and takes so that the slots get reused
+        int last = 0;
+        for(i = 0; i < n; i++){
+            int p = rand() % 100;
+            memset(&m, 0, sizeof(m));
+            m.id = p;
+            m.data[sizeof(m.data) - 1] = (char)p;
+            assert(hb_write(&hb, &m, p));
+            if(i % 4 == 3)
+                assert(hb_take(&hb, &m));
+        }
+        for(i = 0; hb_take(&hb, &m); i++){
+            assert(i == 0 || m.id <= last);
+            assert(m.data[sizeof(m.data) - 1] == (char)m.id);
+            last = m.id;
+        }
+        assert(i == n - n/4);
+        buffer_free(&hb);
+    }
+    printf("OK\n");
+}
+
 void test_priority_queue_write_take(void){
     printf("%s: \n", __func__);
     priority_queue_t * q = priority_queue_new(N, sizeof(int));
@@ -262,6 +327,203 @@ void test_priority_queue_write_take(void){
     printf("OK\n");
 }
 
+void test_priority_queue_dary(void){
+    printf("%s: \n", __func__);
+    unsigned int arity[] = {4, 8};
+    unsigned int a, n = 10000;
+    assert(priority_queue_new_dary(n, sizeof(int), 3) == NULL);
+    for(a = 0; a < sizeof(arity)/sizeof(arity[0]); a++){
+        priority_queue_t * q = priority_queue_new_dary(n, sizeof(int),
+                arity[a]);
+        int i, v, last = 0;
+        (void)last;
+        srand(7);
+        for(i = 0; i < (int)n; i++){
+            v = rand();
+            assert(priority_queue_try_put(q, &v, v) == 0);
+        }
+        assert(priority_queue_try_put(q, &v, v) == EAGAIN);
+        for(i = 0; i < (int)n; i++){
+            assert(priority_queue_try_take(q, &v) == 0);
+            assert(i == 0 || v <= last);
+            last = v;
+        }
+        assert(priority_queue_try_take(q, &v) == EAGAIN);
+        priority_queue_free(q);
+    }
+    printf("OK\n");
+}
+
+#define STABLE_SEQ 100000
+
+void test_priority_queue_stable(void){
+    printf("%s: \n", __func__);
+    unsigned int arity[] = {2, 4, 8};
+    unsigned int a, n = 1000;
+    for(a = 0; a < sizeof(arity)/sizeof(arity[0]); a++){
+        priority_queue_t * q = priority_queue_new_stable(n, sizeof(int),
+                arity[a]);
+        int i, p, v, count[4] = {0}, next[4] = {0};
+        //a few distinct priorities, each value holds its priority and
+        //its put order within the priority, every take of a priority
+        //must get the next value put with it
+        for(i = 0; i < (int)n; i++){
+            p = (i * 7) % 4;
+            v = p*STABLE_SEQ + count[p]++;
+            assert(priority_queue_try_put(q, &v, p) == 0);
+            if(i % 3 == 0){
+                assert(priority_queue_try_take(q, &v) == 0);
+                p = v / STABLE_SEQ;
+                assert(v % STABLE_SEQ == next[p]++);
+            }
+        }
+        int last = 3;
+        (void)last;
+        while(priority_queue_try_take(q, &v) == 0){
+            p = v / STABLE_SEQ;
+            assert(p <= last);
+            assert(v % STABLE_SEQ == next[p]++);
+            last = p;
+        }
+        for(p = 0; p < 4; p++)
+            assert(next[p] == count[p]);
+        priority_queue_free(q);
+    }
+    assert(priority_queue_new_stable(n, sizeof(int), 5) == NULL);
+    printf("OK\n");
+}
+
+void test_priority_queue_bucketed(void){
+    printf("%s: \n", __func__);
+    unsigned int n = 1000;
+    assert(priority_queue_new_bucketed(n, sizeof(int), 0) == NULL);
+    assert(priority_queue_new_bucketed(n, sizeof(int), 65) == NULL);
+    priority_queue_t * q = priority_queue_new_bucketed(n, sizeof(int), 64);
+    int i, p, v, count[64] = {0}, next[64] = {0};
+    //same checks as the stable heap, with every level in use
+    for(i = 0; i < (int)n; i++){
+        p = (i * 37) % 64;
+        v = p*STABLE_SEQ + count[p]++;
+        assert(priority_queue_try_put(q, &v, p) == 0);
+        if(i % 3 == 0){
+            assert(priority_queue_try_take(q, &v) == 0);
+            p = v / STABLE_SEQ;
+            assert(v % STABLE_SEQ == next[p]++);
+        }
+    }
+    int last = 63;
+    (void)last;
+    while(priority_queue_try_take(q, &v) == 0){
+        p = v / STABLE_SEQ;
+        assert(p <= last);
+        assert(v % STABLE_SEQ == next[p]++);
+        last = p;
+    }
+    for(p = 0; p < 64; p++)
+        assert(next[p] == count[p]);
+    //out of range priorities are clamped
+    int in[3] = {1, 2, 3}, pr[3] = {-5, 1000, 10}, out[3];
+    unsigned int k;
+    assert(priority_queue_put_many(q, in, pr, 3, &k) == 0 && k == 3);
+    assert(priority_queue_take_many(q, out, 3, &k) == 0 && k == 3);
+    assert(out[0] == 2 && out[1] == 3 && out[2] == 1);
+    priority_queue_free(q);
+    printf("OK\n");
+}
+
+typedef struct {
+    int id;
+    char data[1020];
+} seg_msg_t;
+
+void test_growable_buffer(void){
+    printf("%s: \n", __func__);
+    buffer_t rb;
+    seg_msg_t m, batch[20];
+    int i, next = 0;
+    unsigned int pool = segment_pool_count();
+    assert(buffer_init_growable(&rb, 20, 100, sizeof(seg_msg_t)) == 0);
+    //1020 + 4 bytes elements, 8 per segment
+    assert(rb.seg_n == 8 && rb.n == 100 && rb.seg_count == 0);
+    for(m.id = 0; m.id < 100; m.id++)
+        assert(rb_write(&rb, &m, 0));
+    assert(!rb_write(&rb, &m, 0));
+    assert(rb.seg_count == 13);
+    //fifo order across segments, single and batch
+    for(i = 0; i < 10; i++)
+        assert(rb_take(&rb, &m) && m.id == next++);
+    assert(rb_take_many(&rb, batch, 20) == 20);
+    for(i = 0; i < 20; i++)
+        assert(batch[i].id == next++);
+    for(i = 0; i < 20; i++)
+        batch[i].id = 100 + i;
+    assert(rb_write_many(&rb, batch, NULL, 20) == 20);
+    seg_msg_t * slot = rb_peek(&rb);
+    assert(slot && slot->id == next++);
+    rb_release(&rb, slot);
+    while(rb_take(&rb, &m))
+        assert(m.id == next++);
+    assert(next == 120);
+    //drained: enough segments for soft elements are kept
+    assert(rb.seg_count == 3 && rb.used == 0);
+    assert(segment_pool_count() >= pool + 10 ||
+            segment_pool_count() == SEGMENT_POOL_MAX);
+    buffer_free(&rb);
+    //soft == 0 gives every segment back
+    assert(buffer_init_growable(&rb, 0, 0, sizeof(seg_msg_t)) == 0);
+    for(m.id = 0; m.id < 1000; m.id++)
+        assert(rb_write(&rb, &m, 0));
+    for(i = 0; i < 1000; i++)
+        assert(rb_take(&rb, &m) && m.id == i);
+    assert(rb.seg_count == 0);
+    buffer_free(&rb);
+    //heap
+    assert(heap_init_growable(&rb, 8, 64, sizeof(seg_msg_t), 3) == EINVAL);
+    assert(heap_init_growable(&rb, 8, 64, sizeof(seg_msg_t), 4) == 0);
+    for(i = 0; i < 64; i++){
+        m.id = (i * 37) % 64;
+        assert(hb_write(&rb, &m, m.id));
+    }
+    assert(!hb_write(&rb, &m, 0));
+    assert(rb.seg_count == 8);
+    for(i = 63; i >= 0; i--){
+        assert(hb_take(&rb, &m) && m.id == i);
+        if(i) assert(rb.seg_count == 8);
+    }
+    assert(rb.seg_count == 1);
+    buffer_free(&rb);
+    printf("OK\n");
+}
+
+void test_growable_queue(void){
+    printf("%s: \n", __func__);
+    int i, v;
+    queue_t * q = queue_new_growable(0, 5000, sizeof(int));
+    //the elements only live in the segments
+    assert(q->rb.buffer == NULL);
+    assert(q);
+    for(i = 0; i < 5000; i++)
+        assert(queue_try_put(q, &i) == 0);
+    assert(queue_try_put(q, &i) == EAGAIN);
+    assert(queue_put_for(q, &i, 1000000) == ETIMEDOUT);
+    for(i = 0; i < 5000; i++)
+        assert(queue_try_take(q, &v) == 0 && v == i);
+    assert(queue_try_take(q, &v) == EAGAIN);
+    queue_free(q);
+    priority_queue_t * pq = priority_queue_new_growable(0, 0, sizeof(int), 2);
+    assert(pq && pq->rb.buffer == NULL);
+    //growable heaps are not stable
+    assert(priority_queue_new_growable(0, 0, sizeof(int), 2 | 0x100) == NULL);
+    for(i = 0; i < 10000; i++){
+        v = (i * 7919) % 10000;
+        assert(priority_queue_try_put(pq, &v, v) == 0);
+    }
+    for(i = 9999; i >= 0; i--)
+        assert(priority_queue_try_take(pq, &v) == 0 && v == i);
+    priority_queue_free(pq);
+    printf("OK\n");
+}
+
 void dummy_callback(queue_t *q, void * data){
     (void)q;
     int * i = (int *) data;
@@ -285,6 +547,415 @@ void test_callback(void){
     printf("OK\n");
 }
 
+void reentrant_callback(queue_t *q, void * data){
+    //runs without the queue lock, it can take from the queue
+    int v;
+    if(queue_try_take(q, &v) == 0)
+        *(int*)data += v;
+}
+
+void test_edge_callback(void){
+    printf("%s: \n", __func__);
+    queue_t * q = queue_new(3, sizeof(int));
+    int i, v, level = 0, not_empty = 0, not_full = 0;
+    notification_callback_t * l =
+        queue_append_not_empty_callback(q, dummy_callback, &level);
+    notification_callback_t * e =
+        queue_append_not_empty_edge_callback(q, dummy_callback, &not_empty);
+    notification_callback_t * f =
+        queue_append_not_full_edge_callback(q, dummy_callback, &not_full);
+    for(i = 0; i < 3; i++)
+        assert(queue_try_put(q, &i) == 0);
+    assert(level == 3 && not_empty == 1);
+    assert(queue_try_take(q, &v) == 0 && not_full == 1);
+    assert(queue_try_take(q, &v) == 0 && not_full == 1);
+    assert(queue_try_put(q, &i) == 0 && not_empty == 1);
+    while(queue_try_take(q, &v) == 0);
+    assert(queue_try_put(q, &i) == 0 && not_empty == 2);
+    assert(queue_close(q) == 0);
+    assert(not_empty == 3 && not_full == 2);
+    queue_remove_callback(l);
+    queue_remove_callback(e);
+    queue_remove_callback(f);
+    queue_free(q);
+    //callbacks may use the queue they are called for
+    q = queue_new(4, sizeof(int));
+    int sum = 0;
+    l = queue_append_not_empty_callback(q, reentrant_callback, &sum);
+    for(i = 1; i <= 10; i++)
+        assert(queue_put(q, &i) == 0);
+    assert(sum == 55 && queue_try_take(q, &v) == EAGAIN);
+    queue_remove_callback(l);
+    queue_free(q);
+    printf("OK\n");
+}
+
+/*
+* callbacks are added and removed while other threads put and take,
+* the data of a removed callback is freed right away
+*/
+#define CALLBACK_ROUNDS 2000
+
+void atomic_callback(queue_t *q, void * data){
+    (void)q;
+    atomic_fetch_add((atomic_int*)data, 1);
+}
+
+void * callback_churn_thread(void * arg){
+    queue_t * q = (queue_t*)arg;
+    int i;
+    for(i = 0; i < CALLBACK_ROUNDS; i++){
+        atomic_int * d = calloc(1, sizeof(atomic_int));
+        notification_callback_t * nc = i % 2 ?
+            queue_append_not_empty_callback(q, atomic_callback, d) :
+            queue_append_not_full_edge_callback(q, atomic_callback, d);
+        sched_yield();
+        queue_remove_callback(nc);
+        free(d);
+    }
+    return NULL;
+}
+
+void * callback_traffic_thread(void * arg){
+    queue_t * q = (queue_t*)arg;
+    int i, v = 0;
+    for(i = 0; i < 20*CALLBACK_ROUNDS; i++){
+        queue_put(q, &v);
+        queue_take(q, &v);
+    }
+    return NULL;
+}
+
+void test_callback_removal(void){
+    printf("%s: \n", __func__);
+    queue_t * qs[2] = {queue_new(2, sizeof(int)),
+        queue_new_mpmc(2, sizeof(int))};
+    int k;
+    for(k = 0; k < 2; k++){
+        pthread_t churn[2], traffic[2];
+        int i;
+        for(i = 0; i < 2; i++){
+            pthread_create(&churn[i], NULL, callback_churn_thread, qs[k]);
+            pthread_create(&traffic[i], NULL, callback_traffic_thread, qs[k]);
+        }
+        for(i = 0; i < 2; i++){
+            pthread_join(churn[i], NULL);
+            pthread_join(traffic[i], NULL);
+        }
+        queue_free(qs[k]);
+    }
+    printf("OK\n");
+}
+
+// 1 if fd is readable, clears it
+int eventfd_fired(int fd){
+    struct pollfd p = {fd, POLLIN, 0};
+    uint64_t c;
+    if(poll(&p, 1, 0) != 1)
+        return 0;
+    assert(read(fd, &c, sizeof(c)) == sizeof(c));
+    return 1;
+}
+
+void * eventfd_put_thread(void * arg){
+    int v = 42;
+    usleep(50000);
+    queue_put((queue_t*)arg, &v);
+    return NULL;
+}
+
+void test_queue_eventfd(void){
+    printf("%s: \n", __func__);
+    queue_t * q = queue_new(2, sizeof(int));
+    int i, v;
+    int e = queue_eventfd_not_empty(q);
+    assert(e >= 0 && queue_eventfd_not_empty(q) == e);
+    assert(!eventfd_fired(e));
+    //only the empty to not empty transitions signal it
+    assert(queue_try_put(q, &v) == 0);
+    assert(eventfd_fired(e));
+    assert(queue_try_put(q, &v) == 0);
+    assert(!eventfd_fired(e));
+    int f = queue_eventfd_not_full(q);
+    assert(f >= 0 && f != e && !eventfd_fired(f));
+    assert(queue_try_take(q, &v) == 0);
+    assert(eventfd_fired(f));
+    assert(queue_try_take(q, &v) == 0);
+    assert(!eventfd_fired(f));
+    //a consumer sleeping in poll
+    pthread_t t;
+    struct pollfd p = {e, POLLIN, 0};
+    pthread_create(&t, NULL, eventfd_put_thread, q);
+    assert(poll(&p, 1, 2000) == 1);
+    assert(eventfd_fired(e));
+    while(queue_try_take(q, &v) == 0)
+        assert(v == 42);
+    pthread_join(t, NULL);
+    assert(queue_close(q) == 0);
+    assert(eventfd_fired(e) && eventfd_fired(f));
+    queue_free(q);
+    //already not empty when requested, and on a lock free queue
+    q = queue_new_spsc(4, sizeof(int));
+    for(i = 0; i < 2; i++)
+        assert(queue_try_put(q, &i) == 0);
+    e = queue_eventfd_not_empty(q);
+    assert(eventfd_fired(e));
+    assert(queue_try_put(q, &i) == 0);
+    assert(eventfd_fired(e));
+    queue_free(q);
+    printf("OK\n");
+}
+
+atomic_int pool_count;
+
+void pool_count_task(void * arg){
+    (void)arg;
+    atomic_fetch_add(&pool_count, 1);
+}
+
+typedef struct {
+    channel_pool_t * pool;
+    int depth;
+}fan_out_t;
+
+fan_out_t fan_out_args[16];
+
+// every task of depth d submits two of depth d - 1 from its worker
+void pool_fan_out_task(void * arg){
+    fan_out_t * f = (fan_out_t*)arg;
+    atomic_fetch_add(&pool_count, 1);
+    if(f->depth == 0)
+        return;
+    assert(channel_pool_submit(f->pool, pool_fan_out_task,
+                &fan_out_args[f->depth - 1]) == 0);
+    assert(channel_pool_submit(f->pool, pool_fan_out_task,
+                &fan_out_args[f->depth - 1]) == 0);
+}
+
+atomic_int pool_gate;
+int pool_order[8];
+
+void pool_gate_task(void * arg){
+    (void)arg;
+    atomic_store(&pool_gate, 1);
+    while(atomic_load(&pool_gate) == 1)
+        sched_yield();
+}
+
+void pool_order_task(void * arg){
+    pool_order[atomic_fetch_add(&pool_count, 1)] = (int)(intptr_t)arg;
+}
+
+void test_channel_pool(void){
+    printf("%s: \n", __func__);
+    int i, depth = 12;
+    assert(channel_pool_new(0, 0) == NULL);
+    assert(channel_pool_new(1, BUCKET_MAX_LEVELS + 1) == NULL);
+    //external submits go through the injection queue
+    channel_pool_t * pool = channel_pool_new(4, 0);
+    assert(pool);
+    atomic_store(&pool_count, 0);
+    for(i = 0; i < 10000; i++)
+        assert(channel_pool_submit(pool, pool_count_task, NULL) == 0);
+    assert(channel_pool_wait(pool) == 0);
+    assert(atomic_load(&pool_count) == 10000);
+    assert(channel_pool_submit_priority(pool, pool_count_task, NULL, 0)
+            == EINVAL);
+    //tasks submitted by tasks go through the deques and get stolen
+    atomic_store(&pool_count, 0);
+    for(i = 0; i <= depth; i++){
+        fan_out_args[i].pool = pool;
+        fan_out_args[i].depth = i;
+    }
+    assert(channel_pool_submit(pool, pool_fan_out_task,
+                &fan_out_args[depth]) == 0);
+    assert(channel_pool_wait(pool) == 0);
+    assert(atomic_load(&pool_count) == (1 << (depth + 1)) - 1);
+    //free runs the tasks left
+    atomic_store(&pool_count, 0);
+    for(i = 0; i < 1000; i++)
+        assert(channel_pool_submit(pool, pool_count_task, NULL) == 0);
+    channel_pool_free(pool);
+    assert(atomic_load(&pool_count) == 1000);
+    //priority lanes run first, highest first, while the only
+    //worker is held by the gate task
+    pool = channel_pool_new(1, 4);
+    assert(pool);
+    atomic_store(&pool_count, 0);
+    atomic_store(&pool_gate, 0);
+    assert(channel_pool_submit(pool, pool_gate_task, NULL) == 0);
+    while(atomic_load(&pool_gate) == 0)
+        sched_yield();
+    assert(channel_pool_submit(pool, pool_order_task, (void*)4) == 0);
+    int prio[4] = {3, 1, 2, 0};
+    for(i = 0; i < 4; i++)
+        assert(channel_pool_submit_priority(pool, pool_order_task,
+                    (void*)(intptr_t)(3 - prio[i]), prio[i]) == 0);
+    atomic_store(&pool_gate, 2);
+    assert(channel_pool_wait(pool) == 0);
+    assert(atomic_load(&pool_count) == 5);
+    for(i = 0; i < 5; i++)
+        assert(pool_order[i] == i);
+    channel_pool_free(pool);
+    printf("OK\n");
+}
+
+void * broadcast_put_thread(void * arg){
+    int v = 7;
+    usleep(50000);
+    broadcast_put((broadcast_t*)arg, &v);
+    return NULL;
+}
+
+void * broadcast_take_thread(void * arg){
+    int v;
+    usleep(50000);
+    queue_take((queue_t*)arg, &v);
+    return NULL;
+}
+
+typedef struct {
+    int v[3];
+}broadcast_elem_t;
+
+typedef struct {
+    queue_t * s;
+    long sum;
+    int count;
+}broadcast_reader_t;
+
+void * broadcast_stress_put(void * arg){
+    broadcast_elem_t e;
+    int i, from = *(int*)((void**)arg)[1];
+    for(i = from; i < from + 2000; i++){
+        e.v[0] = i, e.v[1] = 2*i, e.v[2] = 3*i;
+        assert(broadcast_put((broadcast_t*)((void**)arg)[0], &e) == 0);
+    }
+    return NULL;
+}
+
+void * broadcast_stress_take(void * arg){
+    broadcast_reader_t * r = (broadcast_reader_t*)arg;
+    broadcast_elem_t e;
+    while(queue_take(r->s, &e) == 0){
+        //a torn element would mix two puts
+        assert(e.v[1] == 2*e.v[0] && e.v[2] == 3*e.v[0]);
+        r->sum += e.v[0];
+        r->count++;
+    }
+    return NULL;
+}
+
+void test_broadcast(void){
+    printf("%s: \n", __func__);
+    int i, v, out[4];
+    unsigned int taken;
+    pthread_t t;
+    assert(broadcast_new(0, sizeof(int), BROADCAST_BLOCK) == NULL);
+    broadcast_t * b = broadcast_new(4, sizeof(int), BROADCAST_BLOCK);
+    //nobody subscribed, the elements are dropped
+    for(i = 0; i < 8; i++)
+        assert(broadcast_try_put(b, &i) == 0);
+    queue_t * s[3];
+    for(i = 0; i < 3; i++)
+        assert((s[i] = broadcast_subscribe(b)) != NULL);
+    assert(queue_try_take(s[0], &v) == EAGAIN);
+    assert(queue_put(s[0], &v) == EINVAL);
+    assert(queue_reset(s[0]) == EINVAL);
+    for(i = 0; i < 4; i++)
+        assert(broadcast_try_put(b, &i) == 0);
+    //the slowest subscriber holds the puts back
+    assert(broadcast_try_put(b, &i) == EAGAIN);
+    assert(broadcast_put_for(b, &i, 1000000) == ETIMEDOUT);
+    for(i = 0; i < 4; i++){
+        assert(queue_try_take(s[0], &v) == 0);
+        assert(v == i);
+    }
+    assert(queue_try_take(s[0], &v) == EAGAIN);
+    assert(broadcast_try_put(b, &i) == EAGAIN);
+    assert(queue_try_take_many(s[1], out, 4, &taken) == 0);
+    assert(taken == 4);
+    for(i = 0; i < 4; i++)
+        assert(out[i] == i);
+    pthread_create(&t, NULL, broadcast_take_thread, s[2]);
+    assert(broadcast_put(b, &i) == 0);
+    pthread_join(t, NULL);
+    //unsubscribing the slowest one makes room
+    assert(broadcast_try_put(b, &i) == EAGAIN);
+    queue_free(s[2]);
+    assert(broadcast_try_put(b, &i) == 0);
+    assert(queue_try_take(s[0], &v) == 0 && v == 4);
+    assert(queue_try_take(s[1], &v) == 0 && v == 4);
+    assert(queue_try_take(s[0], &v) == 0 && v == 4);
+    assert(queue_try_take(s[1], &v) == 0 && v == 4);
+    //a subscriber in a select, along with a plain queue
+    queue_t * q = queue_new(2, sizeof(int));
+    queue_t * sel[2] = {q, s[0]}, * sq[2];
+    int ns;
+    pthread_create(&t, NULL, broadcast_put_thread, b);
+    assert(queue_select_not_empty(sel, 2, sq, &ns) == 0);
+    pthread_join(t, NULL);
+    assert(ns == 1 && sq[0] == s[0]);
+    assert(queue_take(s[0], &v) == 0 && v == 7);
+    assert(queue_take(s[1], &v) == 0 && v == 7);
+    queue_free(q);
+    //close, the elements left are still taken
+    assert(broadcast_put(b, &i) == 0);
+    assert(broadcast_close(b) == 0);
+    assert(broadcast_put(b, &i) == EPIPE);
+    assert(queue_take(s[0], &v) == 0 && v == 4);
+    assert(queue_take(s[0], &v) == EPIPE);
+    assert(broadcast_free(b) == EBUSY);
+    queue_free(s[0]);
+    queue_free(s[1]);
+    assert(broadcast_free(b) == 0);
+    //overwrite, the subscribers left behind skip ahead
+    b = broadcast_new(4, sizeof(int), BROADCAST_OVERWRITE);
+    s[0] = broadcast_subscribe(b);
+    for(i = 0; i < 10; i++)
+        assert(broadcast_try_put(b, &i) == 0);
+    for(i = 6; i < 10; i++){
+        assert(queue_take(s[0], &v) == 0);
+        assert(v == i);
+    }
+    assert(broadcast_lagged(s[0]) == 6);
+    assert(broadcast_lagged(s[0]) == 0);
+    queue_free(s[0]);
+    assert(broadcast_free(b) == 0);
+    /*
+    * two publishers, two threads taking from the first subscriber and
+    * one from the second, every element is taken once per subscriber
+    */
+    b = broadcast_new(8, sizeof(broadcast_elem_t), BROADCAST_BLOCK);
+    broadcast_reader_t r[3];
+    pthread_t pt[2], rt[3];
+    int from[2] = {0, 2000};
+    void * pa[2][2] = {{b, &from[0]}, {b, &from[1]}};
+    s[0] = broadcast_subscribe(b);
+    s[1] = broadcast_subscribe(b);
+    //the takers of a subscriber spin like those of any queue
+    queue_set_spin(s[0], 1000);
+    for(i = 0; i < 3; i++){
+        r[i].s = s[i == 2];
+        r[i].sum = r[i].count = 0;
+        pthread_create(&rt[i], NULL, broadcast_stress_take, &r[i]);
+    }
+    for(i = 0; i < 2; i++)
+        pthread_create(&pt[i], NULL, broadcast_stress_put, pa[i]);
+    for(i = 0; i < 2; i++)
+        pthread_join(pt[i], NULL);
+    assert(broadcast_close(b) == 0);
+    for(i = 0; i < 3; i++)
+        pthread_join(rt[i], NULL);
+    assert(r[0].count + r[1].count == 4000 && r[2].count == 4000);
+    assert(r[0].sum + r[1].sum == 3999L*4000/2);
+    assert(r[2].sum == 3999L*4000/2);
+    queue_free(s[0]);
+    queue_free(s[1]);
+    assert(broadcast_free(b) == 0);
+    printf("OK\n");
+}
+
 typedef struct {
     int n;
     int ns;
@@ -390,6 +1061,857 @@ void test_try_take_put(void){
     printf("OK\n");
 }
 
+#define SPSC_COUNT 100000
+
+void * _spsc_producer(void * data){
+    queue_t * q = (queue_t*)data;
+    int i;
+    for(i = 0; i < SPSC_COUNT; i++)
+        queue_put(q, &i);
+    return NULL;
+}
+
+void test_spsc_threaded_take_put(void){
+    printf("%s: \n", __func__);
+    queue_t * q = queue_new_spsc(16, sizeof(int));
+    pthread_t tid;
+    pthread_create(&tid, NULL, &_spsc_producer, q);
+    int i;
+    for(i = 0; i < SPSC_COUNT; i++){
+        int j;
+        assert(queue_take(q, &j) == 0);
+        assert(j == i);
+    }
+    pthread_join(tid, NULL);
+    assert(queue_try_take(q, &i) == EAGAIN);
+    queue_free(q);
+    printf("OK\n");
+}
+
+void test_spsc_timeouts_select(void){
+    printf("%s: \n", __func__);
+    int i, n = 3;
+    queue_t * q = queue_new_spsc(n, sizeof(int));
+    for(i = 0; i < n+1; i++)
+	if(i < n)
+	    assert(queue_timed_put(q, &i, 1) == 0);
+	else
+	    assert(queue_try_put(q, &i) == EAGAIN);
+    queue_t * sq[1];
+    int ns;
+    (void)ns;
+    assert(queue_timed_select_not_empty(&q, 1, sq, &ns, 1) == 0);
+    assert(ns == 1 && sq[0] == q);
+    int j;
+    for(i = 0; i < n+1; i++)
+	if(i < n){
+	    assert(queue_timed_take(q, &j, 1) == 0);
+            assert(j == i);
+        }else
+	    assert(queue_timed_take(q, &j, 1) == ETIMEDOUT);
+    assert(queue_timed_select_not_empty(&q, 1, sq, &ns, 1) == ETIMEDOUT);
+    queue_free(q);
+    printf("OK\n");
+}
+
+#define MPMC_PRODUCERS 4
+#define MPMC_CONSUMERS 2
+
+typedef struct {
+    queue_t * q;
+    int id;
+    int count[MPMC_PRODUCERS];
+}mpmc_thread_t;
+
+void * _mpmc_producer(void * data){
+    mpmc_thread_t * t = (mpmc_thread_t*)data;
+    int i;
+    for(i = 0; i < SPSC_COUNT; i++){
+        dummy_t d = {t->id, i};
+        queue_put(t->q, &d);
+    }
+    return NULL;
+}
+
+void * _mpmc_consumer(void * data){
+    mpmc_thread_t * t = (mpmc_thread_t*)data;
+    int last[MPMC_PRODUCERS];
+    int i;
+    for(i = 0; i < MPMC_PRODUCERS; i++)
+        last[i] = -1;
+    while(1){
+        dummy_t d;
+        queue_take(t->q, &d);
+        if(d.i == -1) break;
+        //each consumer sees the elements of a producer in order
+        assert(d.j > last[d.i]);
+        last[d.i] = d.j;
+        t->count[d.i]++;
+    }
+    return NULL;
+}
+
+void test_mpmc_threaded_take_put(void){
+    printf("%s: \n", __func__);
+    queue_t * q = queue_new_mpmc(16, sizeof(dummy_t));
+    mpmc_thread_t p[MPMC_PRODUCERS], c[MPMC_CONSUMERS];
+    pthread_t pt[MPMC_PRODUCERS], ct[MPMC_CONSUMERS];
+    int i, j;
+    memset(c, 0, sizeof(c));
+    for(i = 0; i < MPMC_CONSUMERS; i++){
+        c[i].q = q;
+        pthread_create(&ct[i], NULL, &_mpmc_consumer, &c[i]);
+    }
+    for(i = 0; i < MPMC_PRODUCERS; i++){
+        p[i].q = q;
+        p[i].id = i;
+        pthread_create(&pt[i], NULL, &_mpmc_producer, &p[i]);
+    }
+    for(i = 0; i < MPMC_PRODUCERS; i++)
+        pthread_join(pt[i], NULL);
+    for(i = 0; i < MPMC_CONSUMERS; i++){
+        dummy_t d = {-1, -1};
+        queue_put(q, &d);
+    }
+    for(i = 0; i < MPMC_CONSUMERS; i++)
+        pthread_join(ct[i], NULL);
+    for(i = 0; i < MPMC_PRODUCERS; i++){
+        int total = 0;
+        for(j = 0; j < MPMC_CONSUMERS; j++)
+            total += c[j].count[i];
+        assert(total == SPSC_COUNT);
+    }
+    dummy_t d;
+    (void)d;
+    assert(queue_try_take(q, &d) == EAGAIN);
+    queue_free(q);
+    printf("OK\n");
+}
+
+void test_take_put_many(void){
+    printf("%s: \n", __func__);
+    queue_t * (*ctor[])(unsigned int, size_t) = {
+        queue_new, queue_new_spsc, queue_new_mpmc
+    };
+    unsigned int c;
+    for(c = 0; c < sizeof(ctor)/sizeof(ctor[0]); c++){
+        queue_t * q = ctor[c](5, sizeof(int));
+        int in[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+        int out[10];
+        unsigned int k;
+        (void)k;
+        assert(queue_try_take_many(q, out, 10, &k) == EAGAIN && k == 0);
+        assert(queue_put_many(q, in, 8, &k) == 0 && k == 5);
+        assert(queue_try_put_many(q, in, 1, &k) == EAGAIN && k == 0);
+        assert(queue_take_many(q, out, 3, &k) == 0 && k == 3);
+        assert(out[0] == 0 && out[1] == 1 && out[2] == 2);
+        //wraps around the end of the ring
+        assert(queue_timed_put_many(q, in + 5, 3, &k, 1) == 0 && k == 3);
+        assert(queue_take_many(q, out, 10, &k) == 0 && k == 5);
+        int i;
+        for(i = 0; i < 5; i++)
+            assert(out[i] == i + 3);
+        assert(queue_timed_take_many(q, out, 10, &k, 1) == ETIMEDOUT);
+        queue_free(q);
+    }
+    priority_queue_t * pq = priority_queue_new(N, sizeof(int));
+    int v[N] = {3, 4, 4, 5, 8, 7, 9};
+    int p[N] = {1, 9, 2, 10, 3, 6, 8};
+    int out[N];
+    unsigned int k;
+    assert(priority_queue_put_many(pq, v, p, N, &k) == 0 && k == N);
+    assert(priority_queue_try_put_many(pq, v, p, 1, &k) == EAGAIN);
+    assert(priority_queue_take_many(pq, out, 2, &k) == 0 && k == 2);
+    assert(out[0] == 5 && out[1] == 4);
+    assert(priority_queue_timed_take_many(pq, out, N, &k, 1) == 0 && k == N - 2);
+    assert(out[0] == 9 && out[N - 3] == 3);
+    assert(priority_queue_try_take_many(pq, out, N, &k) == EAGAIN);
+    priority_queue_free(pq);
+    printf("OK\n");
+}
+
+typedef struct {
+    int seq;
+    char payload[1020];
+}large_msg_t;
+
+void * _reserve_producer(void * data){
+    queue_t * q = (queue_t*)data;
+    int i;
+    for(i = 0; i < SPSC_COUNT; i++){
+        large_msg_t * m;
+        queue_reserve(q, (void**)&m);
+        m->seq = i;
+        m->payload[sizeof(m->payload) - 1] = (char)i;
+        queue_commit(q, m);
+    }
+    return NULL;
+}
+
+void test_reserve_commit(void){
+    printf("%s: \n", __func__);
+    queue_t * (*ctor[])(unsigned int, size_t) = {
+        queue_new, queue_new_spsc, queue_new_mpmc
+    };
+    unsigned int c;
+    for(c = 0; c < sizeof(ctor)/sizeof(ctor[0]); c++){
+        queue_t * q = ctor[c](4, sizeof(large_msg_t));
+        large_msg_t * m;
+        assert(queue_try_peek_acquire(q, (void**)&m) == EAGAIN);
+        pthread_t tid;
+        pthread_create(&tid, NULL, &_reserve_producer, q);
+        int i;
+        for(i = 0; i < SPSC_COUNT; i++){
+            assert(queue_peek_acquire(q, (void**)&m) == 0);
+            assert(m->seq == i);
+            assert(m->payload[sizeof(m->payload) - 1] == (char)i);
+            queue_release(q, m);
+        }
+        pthread_join(tid, NULL);
+        //in place and copying accesses can be mixed
+        large_msg_t msg = {42, {0}};
+        assert(queue_put(q, &msg) == 0);
+        assert(queue_try_peek_acquire(q, (void**)&m) == 0);
+        assert(m->seq == 42);
+        queue_release(q, m);
+        assert(queue_try_take(q, &msg) == EAGAIN);
+        queue_free(q);
+    }
+    printf("OK\n");
+}
+
+#define WAITERS 4
+
+void * _waiting_consumer(void * data){
+    queue_t * q = (queue_t*)data;
+    int i;
+    assert(queue_timed_take(q, &i, 5) == 0);
+    return NULL;
+}
+
+void test_wake_waiters(void){
+    printf("%s: \n", __func__);
+    queue_t * (*ctor[])(unsigned int, size_t) = {
+        queue_new, queue_new_spsc, queue_new_mpmc
+    };
+    unsigned int c;
+    //spsc queues only have one consumer
+    for(c = 0; c < sizeof(ctor)/sizeof(ctor[0]); c++){
+        int waiters = ctor[c] == queue_new_spsc ? 1 : WAITERS;
+        queue_t * q = ctor[c](WAITERS, sizeof(int));
+        pthread_t tid[WAITERS];
+        int i, in[WAITERS] = {0};
+        for(i = 0; i < waiters; i++)
+            pthread_create(&tid[i], NULL, &_waiting_consumer, q);
+        usleep(100000);
+        //a single batch wakes up every waiting consumer
+        unsigned int k;
+        assert(queue_put_many(q, in, waiters, &k) == 0);
+        for(i = 0; i < waiters; i++)
+            pthread_join(tid[i], NULL);
+        assert(queue_try_take(q, &i) == EAGAIN);
+        queue_free(q);
+    }
+    printf("OK\n");
+}
+
+void test_spin_take_put(void){
+    printf("%s: \n", __func__);
+    queue_t * (*ctor[])(unsigned int, size_t) = {
+        queue_new, queue_new_spsc, queue_new_mpmc
+    };
+    unsigned int c;
+    for(c = 0; c < sizeof(ctor)/sizeof(ctor[0]); c++){
+        int n = 3;
+        test_thread_t tt = {
+            ctor[c](n, sizeof(int)),
+            ctor[c](n, sizeof(int)),
+            10
+        };
+        queue_set_spin(tt.iq, 1000);
+        queue_set_spin(tt.oq, 1000);
+        pthread_t tid;
+        pthread_create(&tid, NULL, &_test_thread, &tt);
+        int i;
+        //ping pong, every take has to wait for the other thread
+        for(i = 0; i < SPSC_COUNT/10; i++){
+            int j;
+            queue_put(tt.iq, &i);
+            queue_take(tt.oq, &j);
+            assert(i + tt.state == j);
+        }
+        i = -1;
+        queue_put(tt.iq, &i);
+        pthread_join(tid, NULL);
+        queue_free(tt.iq);
+        queue_free(tt.oq);
+    }
+    printf("OK\n");
+}
+
+static double _elapsed(struct timespec * start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+void test_sub_second_timeouts(void){
+    printf("%s: \n", __func__);
+    queue_t * q = queue_new(1, sizeof(int));
+    priority_queue_t * pq = priority_queue_new(1, sizeof(int));
+    struct timespec start, deadline;
+    int i = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(queue_take_for(q, &i, 500000) == ETIMEDOUT);
+    assert(priority_queue_take_for(pq, &i, 500000) == ETIMEDOUT);
+    queue_t * sq[1];
+    int ns;
+    (void)ns;
+    assert(queue_select_not_empty_for(&q, 1, sq, &ns, 500000) == ETIMEDOUT);
+    assert(_elapsed(&start) < 0.5);
+    assert(queue_put_for(q, &i, 500000) == 0);
+    assert(priority_queue_put_for(pq, &i, 3, 500000) == 0);
+    //a single deadline shared by several calls
+    queue_deadline(&deadline, 2000000);
+    assert(queue_put_until(q, &i, &deadline) == ETIMEDOUT);
+    assert(priority_queue_put_until(pq, &i, 3, &deadline) == ETIMEDOUT);
+    assert(queue_select_not_full_until(&q, 1, sq, &ns, &deadline) == ETIMEDOUT);
+    assert(_elapsed(&start) < 0.5);
+    assert(queue_take_until(q, &i, &deadline) == 0);
+    assert(priority_queue_take_until(pq, &i, &deadline) == 0);
+    queue_free(q);
+    priority_queue_free(pq);
+    printf("OK\n");
+}
+
+#define SELECTED_QUEUES 200
+
+typedef struct {
+    queue_selector_t * sel;
+    queue_t * q;
+    int res;
+}selector_remove_t;
+
+void * selector_remove_thread(void * arg){
+    selector_remove_t * r = (selector_remove_t*)arg;
+    r->res = queue_selector_remove(r->sel, r->q);
+    return NULL;
+}
+
+void test_selector(void){
+    printf("%s: \n", __func__);
+    queue_t * qarray[SELECTED_QUEUES];
+    queue_t * sq[SELECTED_QUEUES];
+    int i, ns;
+    queue_selector_t * sel = queue_selector_new(SELECT_NOT_EMPTY);
+    for(i = 0; i < SELECTED_QUEUES; i++){
+        qarray[i] = i % 2 ? queue_new(3, sizeof(int)) :
+            queue_new_spsc(3, sizeof(int));
+        assert(queue_selector_add(sel, qarray[i]) == 0);
+    }
+    assert(queue_selector_wait_for(sel, sq, SELECTED_QUEUES, &ns,
+                1000000) == ETIMEDOUT);
+    //elements left in a returned queue are reported again
+    queue_put(qarray[7], &i);
+    queue_put(qarray[7], &i);
+    assert(queue_selector_wait(sel, sq, SELECTED_QUEUES, &ns) == 0);
+    assert(ns == 1 && sq[0] == qarray[7]);
+    assert(queue_try_take(qarray[7], &i) == 0);
+    assert(queue_selector_wait_for(sel, sq, SELECTED_QUEUES, &ns,
+                1000000) == 0);
+    assert(ns == 1 && sq[0] == qarray[7]);
+    assert(queue_try_take(qarray[7], &i) == 0);
+    assert(queue_selector_wait_for(sel, sq, SELECTED_QUEUES, &ns,
+                1000000) == ETIMEDOUT);
+    //queues ready before being registered
+    queue_t * q = queue_new(3, sizeof(int));
+    queue_put(q, &i);
+    assert(queue_selector_add(sel, q) == 0);
+    assert(queue_selector_wait(sel, sq, SELECTED_QUEUES, &ns) == 0);
+    assert(ns == 1 && sq[0] == q);
+    assert(queue_selector_remove(sel, q) == 0);
+    assert(queue_selector_remove(sel, q) == EINVAL);
+    assert(queue_selector_wait_for(sel, sq, SELECTED_QUEUES, &ns,
+                1000000) == ETIMEDOUT);
+    queue_free(q);
+    //queue_free unregisters a queue, even a ready one
+    q = queue_new(3, sizeof(int));
+    assert(queue_selector_add(sel, q) == 0);
+    queue_put(q, &i);
+    queue_free(q);
+    assert(queue_selector_wait_for(sel, sq, SELECTED_QUEUES, &ns,
+                1000000) == ETIMEDOUT);
+    //every element is seen
+    int total = 0;
+    for(i = 0; i < 1000; i++){
+        int k = rand() % SELECTED_QUEUES;
+        queue_put(qarray[k], &k);
+        if(i % 3 == 0){
+            int j, v;
+            assert(queue_selector_wait(sel, sq, SELECTED_QUEUES, &ns) == 0);
+            for(j = 0; j < ns; j++)
+                while(queue_try_take(sq[j], &v) == 0){
+                    assert(sq[j] == qarray[v]);
+                    total++;
+                }
+        }
+    }
+    while(queue_selector_wait_for(sel, sq, SELECTED_QUEUES, &ns,
+                1000000) == 0){
+        int j, v;
+        for(j = 0; j < ns; j++)
+            while(queue_try_take(sq[j], &v) == 0)
+                total++;
+    }
+    assert(total == 1000);
+    //concurrent removes of the same queue, only one of them succeeds
+    for(i = 0; i < 200; i++){
+        pthread_t t;
+        selector_remove_t r = {sel, qarray[i % SELECTED_QUEUES], 0};
+        assert(queue_selector_remove(sel, r.q) == 0);
+        assert(queue_selector_add(sel, r.q) == 0);
+        queue_put(r.q, &i);
+        pthread_create(&t, NULL, selector_remove_thread, &r);
+        int res = queue_selector_remove(sel, r.q);
+        pthread_join(t, NULL);
+        assert((res == 0) + (r.res == 0) == 1);
+        assert(res == EINVAL || r.res == EINVAL);
+        assert(queue_try_take(r.q, &res) == 0);
+        assert(queue_selector_add(sel, r.q) == 0);
+    }
+    queue_selector_free(sel);
+    for(i = 0; i < SELECTED_QUEUES; i++)
+        queue_free(qarray[i]);
+    printf("OK\n");
+}
+
+void * select_once_thread(void * arg){
+    queue_t * sq[2];
+    int ns;
+    queue_select_not_empty((queue_t**)arg, 2, sq, &ns);
+    return NULL;
+}
+
+void test_select_fairness(void){
+    printf("%s: \n", __func__);
+    int i, j, n = N;
+    queue_t * qarray[N];
+    queue_t * sq[N];
+    int ns;
+    for(i=0; i < n; i++){
+        qarray[i] = queue_new(3, sizeof(int));
+        queue_put(qarray[i], &i);
+    }
+    //every ready queue is reported, starting at a different queue
+    int first[N] = {0};
+    for(i = 0; i < n; i++){
+        assert(queue_select_not_empty(qarray, n, sq, &ns) == 0);
+        assert(ns == n);
+        for(j = 0; j < n; j++)
+            if(sq[0] == qarray[j]) first[j]++;
+    }
+    for(j = 0; j < n; j++)
+        assert(first[j] == 1);
+    //the selects of another thread do not change the rotation
+    queue_t * prev = NULL;
+    for(i = 0; i < 4; i++){
+        pthread_t t;
+        assert(queue_select_not_empty(qarray, 2, sq, &ns) == 0);
+        assert(ns == 2 && sq[0] != prev);
+        prev = sq[0];
+        pthread_create(&t, NULL, select_once_thread, qarray);
+        pthread_join(t, NULL);
+    }
+    //a selector hands out the ready queues in turn
+    queue_selector_t * sel = queue_selector_new(SELECT_NOT_EMPTY);
+    for(i = 0; i < n; i++)
+        queue_selector_add(sel, qarray[i]);
+    int seen[N] = {0};
+    for(i = 0; i < n; i++){
+        assert(queue_selector_wait(sel, sq, 1, &ns) == 0 && ns == 1);
+        for(j = 0; j < n; j++)
+            if(sq[0] == qarray[j]) seen[j]++;
+    }
+    for(j = 0; j < n; j++)
+        assert(seen[j] == 1);
+    queue_selector_free(sel);
+    for(i=0; i < n; i++)
+        queue_free(qarray[i]);
+    printf("OK\n");
+}
+
+void * _closed_consumer(void * data){
+    queue_t * q = (queue_t*)data;
+    int i;
+    assert(queue_timed_take(q, &i, 5) == EPIPE);
+    return NULL;
+}
+
+void * _closed_producer(void * data){
+    queue_t * q = (queue_t*)data;
+    int i = 0;
+    assert(queue_timed_put(q, &i, 5) == EPIPE);
+    return NULL;
+}
+
+void * reset_take_thread(void * arg){
+    int v;
+    return (void*)(long)queue_take_for((queue_t*)arg, &v, 2000000000ULL);
+}
+
+void * reset_put_thread(void * arg){
+    int v = 0;
+    return (void*)(long)queue_put_for((queue_t*)arg, &v, 2000000000ULL);
+}
+
+void test_queue_reset(void){
+    printf("%s: \n", __func__);
+    queue_t * q = queue_new(4, sizeof(int));
+    pthread_t t;
+    void * res;
+    void * slot;
+    int i, v;
+    for(i = 0; i < 3; i++)
+        assert(queue_try_put(q, &i) == 0);
+    assert(queue_reset(q) == 0);
+    assert(queue_try_take(q, &v) == EAGAIN);
+    //a blocked consumer is woken up with ECANCELED
+    pthread_create(&t, NULL, reset_take_thread, q);
+    usleep(100000);
+    assert(queue_reset(q) == 0);
+    pthread_join(t, &res);
+    assert((long)res == ECANCELED);
+    //and so is a blocked producer
+    for(i = 0; i < 4; i++)
+        assert(queue_try_put(q, &i) == 0);
+    pthread_create(&t, NULL, reset_put_thread, q);
+    usleep(100000);
+    assert(queue_reset(q) == 0);
+    pthread_join(t, &res);
+    assert((long)res == ECANCELED);
+    //the queue is usable again
+    for(i = 0; i < 4; i++)
+        assert(queue_try_put(q, &i) == 0);
+    assert(queue_try_take(q, &v) == 0 && v == 0);
+    assert(queue_reserve(q, &slot) == 0);
+    assert(queue_reset(q) == EBUSY);
+    assert(queue_commit(q, slot) == 0);
+    queue_free(q);
+    q = queue_new_spsc(4, sizeof(int));
+    assert(queue_reset(q) == EINVAL);
+    queue_free(q);
+    //heap and growable ring
+    priority_queue_t * pq = priority_queue_new(8, sizeof(int));
+    for(i = 0; i < 8; i++)
+        assert(priority_queue_try_put(pq, &i, i) == 0);
+    assert(queue_reset(pq) == 0);
+    for(i = 0; i < 8; i++)
+        assert(priority_queue_try_put(pq, &i, 7 - i) == 0);
+    for(i = 0; i < 8; i++)
+        assert(priority_queue_try_take(pq, &v) == 0 && v == i);
+    priority_queue_free(pq);
+    q = queue_new_growable(0, 0, sizeof(int));
+    for(i = 0; i < 10000; i++)
+        assert(queue_try_put(q, &i) == 0);
+    assert(queue_reset(q) == 0);
+    assert(queue_try_take(q, &v) == EAGAIN);
+    assert(queue_try_put(q, &i) == 0);
+    assert(queue_try_take(q, &v) == 0 && v == 10000);
+    queue_free(q);
+    //a full bytes queue signals not full once reset
+    q = queue_new_bytes(64);
+    while(queue_try_put_bytes(q, &i, sizeof(i)) == 0);
+    int f = queue_eventfd_not_full(q);
+    eventfd_fired(f);
+    assert(queue_reset(q) == 0);
+    assert(eventfd_fired(f));
+    assert(queue_try_put_bytes(q, &i, sizeof(i)) == 0);
+    queue_free(q);
+    printf("OK\n");
+}
+
+void * bytes_put_thread(void * arg){
+    usleep(50000);
+    queue_put_bytes((queue_t*)arg, "hello", 5);
+    return NULL;
+}
+
+void test_bytes_queue(void){
+    printf("%s: \n", __func__);
+    char in[64], out[64];
+    size_t len;
+    void * msg;
+    int i;
+    for(i = 0; i < 64; i++)
+        in[i] = i;
+    assert(queue_new_bytes(8) == NULL);
+    queue_t * q = queue_new_bytes(64);
+    //records of 16, 32 and 16 bytes fill it
+    assert(queue_try_put_bytes(q, in, 1) == 0);
+    assert(queue_try_put_bytes(q, in, 20) == 0);
+    assert(queue_try_put_bytes(q, in, 8) == 0);
+    assert(queue_try_put_bytes(q, in, 0) == EAGAIN);
+    assert(queue_try_put_bytes(q, in, 57) == EMSGSIZE);
+    assert(queue_try_take_bytes(q, out, 0, &len) == EMSGSIZE && len == 1);
+    assert(queue_try_take_bytes(q, out, 64, &len) == 0 && len == 1);
+    assert(out[0] == 0);
+    assert(queue_try_take_bytes(q, out, 64, &len) == 0 && len == 20);
+    assert(memcmp(in, out, 20) == 0);
+    //a record that does not fit before the end starts over at 0
+    assert(queue_try_put_bytes(q, in + 1, 24) == 0);
+    assert(queue_try_take_bytes(q, out, 64, &len) == 0 && len == 8);
+    assert(queue_try_take_bytes(q, out, 64, &len) == 0 && len == 24);
+    assert(memcmp(in + 1, out, 24) == 0);
+    assert(queue_try_take_bytes(q, out, 64, &len) == EAGAIN);
+    assert(queue_try_put_bytes(q, in, 56) == 0);
+    assert(queue_try_take_bytes(q, out, 64, &len) == 0 && len == 56);
+    //zero copy peek, the message stays until it is released
+    assert(queue_try_put_bytes(q, in + 3, 12) == 0);
+    assert(queue_try_peek_bytes(q, &msg, &len) == 0 && len == 12);
+    assert(((uintptr_t)msg & 7) == 0 && memcmp(msg, in + 3, 12) == 0);
+    assert(queue_try_take_bytes(q, out, 64, &len) == EAGAIN);
+    assert(queue_try_peek_bytes(q, &msg, &len) == EAGAIN);
+    assert(queue_release_bytes(q) == 0);
+    assert(queue_try_take_bytes(q, out, 64, &len) == EAGAIN);
+    //a consumer blocked until a producer puts
+    pthread_t t;
+    pthread_create(&t, NULL, bytes_put_thread, q);
+    assert(queue_take_bytes(q, out, 64, &len) == 0 && len == 5);
+    assert(memcmp(out, "hello", 5) == 0);
+    pthread_join(t, NULL);
+    assert(queue_take_bytes_for(q, out, 64, &len, 1000000) == ETIMEDOUT);
+    assert(queue_try_put_bytes(q, in, 4) == 0);
+    assert(queue_close(q) == 0);
+    assert(queue_put_bytes(q, in, 4) == EPIPE);
+    assert(queue_take_bytes(q, out, 64, &len) == 0 && len == 4);
+    assert(queue_take_bytes(q, out, 64, &len) == EPIPE);
+    queue_free(q);
+    //random lengths against a model of the fifo
+    unsigned int lens[256], head = 0, tail = 0, seq = 0, next = 0;
+    q = queue_new_bytes(256);
+    srand(3);
+    for(i = 0; i < 20000; i++){
+        if(rand() % 2){
+            unsigned int k, l = rand() % 60;
+            for(k = 0; k < l; k++)
+                in[k] = seq + k;
+            if(queue_try_put_bytes(q, in, l) == 0){
+                lens[head++ % 256] = l;
+                seq++;
+            }
+        }else if(queue_try_take_bytes(q, out, 64, &len) == 0){
+            unsigned int k;
+            assert(tail < head && len == lens[tail++ % 256]);
+            for(k = 0; k < len; k++)
+                assert(out[k] == (char)(next + k));
+            next++;
+        }else
+            assert(tail == head);
+    }
+    queue_free(q);
+    printf("OK\n");
+}
+
+void test_queue_init_at(void){
+    printf("%s: \n", __func__);
+    char mem[4096];
+    int i, v;
+    assert(queue_footprint(16, sizeof(int)) <= sizeof(mem));
+    queue_t * q = queue_init_at(mem + 1, 16, sizeof(int));
+    assert(q && (uintptr_t)q % CACHE_LINE_SIZE == 0);
+    for(i = 0; i < 16; i++)
+        assert(queue_try_put(q, &i) == 0);
+    assert(queue_try_put(q, &i) == EAGAIN);
+    for(i = 0; i < 16; i++)
+        assert(queue_try_take(q, &v) == 0 && v == i);
+    queue_free(q);
+    printf("OK\n");
+}
+
+void test_queue_pool(void){
+    printf("%s: \n", __func__);
+    queue_pool_t * pool = queue_pool_new(4, sizeof(int), 3);
+    queue_t * q[7];
+    int i, v;
+    assert(pool);
+    //an arena too large to be addressed
+    assert(queue_pool_new(1u << 31, 1 << 20, ~0u) == NULL);
+    //the last queues come from a second and third arena
+    for(i = 0; i < 7; i++){
+        q[i] = queue_pool_get(pool);
+        assert(q[i] && queue_try_take(q[i], &v) == EAGAIN);
+        v = i;
+        assert(queue_try_put(q[i], &v) == 0);
+    }
+    for(i = 0; i < 7; i++)
+        assert(queue_try_take(q[i], &v) == 0 && v == i);
+    assert(queue_pool_free(pool) == EBUSY);
+    //a recycled queue is empty and open again
+    v = 1;
+    assert(queue_try_put(q[0], &v) == 0);
+    assert(queue_close(q[0]) == 0);
+    //queue_free removes the callback, the recycled queue does not run it
+    assert(queue_append_not_empty_callback(q[0], dummy_callback, &v));
+    queue_free(q[0]);
+    queue_t * r = queue_pool_get(pool);
+    assert(r == q[0]);
+    assert(queue_try_take(r, &i) == EAGAIN && !queue_is_closed(r));
+    for(i = 0; i < 4; i++)
+        assert(queue_try_put(r, &i) == 0);
+    assert(queue_try_put(r, &i) == EAGAIN);
+    assert(v == 1);
+    queue_free(r);
+    for(i = 1; i < 7; i++)
+        queue_free(q[i]);
+    assert(queue_pool_free(pool) == 0);
+    printf("OK\n");
+}
+
+void test_queue_close(void){
+    printf("%s: \n", __func__);
+    queue_t * (*ctor[])(unsigned int, size_t) = {
+        queue_new, queue_new_spsc, queue_new_mpmc
+    };
+    unsigned int c;
+    for(c = 0; c < sizeof(ctor)/sizeof(ctor[0]); c++){
+        int waiters = ctor[c] == queue_new_spsc ? 1 : WAITERS;
+        queue_t * q = ctor[c](2, sizeof(int));
+        pthread_t tid[WAITERS];
+        int i, v;
+        //blocked consumers are woken up with EPIPE
+        for(i = 0; i < waiters; i++)
+            pthread_create(&tid[i], NULL, &_closed_consumer, q);
+        usleep(100000);
+        assert(queue_close(q) == 0);
+        assert(queue_is_closed(q));
+        for(i = 0; i < waiters; i++)
+            pthread_join(tid[i], NULL);
+        assert(queue_try_put(q, &i) == EPIPE);
+        queue_free(q);
+
+        //blocked producers are woken up with EPIPE and the elements
+        //left in the queue are still taken
+        q = ctor[c](2, sizeof(int));
+        for(i = 0; i < 2; i++)
+            assert(queue_put(q, &i) == 0);
+        for(i = 0; i < waiters; i++)
+            pthread_create(&tid[i], NULL, &_closed_producer, q);
+        usleep(100000);
+        assert(queue_close(q) == 0);
+        for(i = 0; i < waiters; i++)
+            pthread_join(tid[i], NULL);
+        assert(queue_take(q, &v) == 0);
+        assert(queue_take(q, &v) == 0);
+        assert(queue_take(q, &v) == EPIPE);
+        assert(queue_try_take(q, &v) == EPIPE);
+        queue_free(q);
+    }
+
+    priority_queue_t * pq = priority_queue_new(2, sizeof(int));
+    int v = 1;
+    assert(priority_queue_put(pq, &v, 1) == 0);
+    assert(queue_close(pq) == 0);
+    assert(priority_queue_try_put(pq, &v, 1) == EPIPE);
+    assert(priority_queue_take(pq, &v) == 0);
+    assert(priority_queue_timed_take(pq, &v, 5) == EPIPE);
+    queue_free(pq);
+
+    //select reports closed queues
+    queue_t * qarray[2];
+    queue_t * sq[2];
+    int ns;
+    qarray[0] = queue_new(1, sizeof(int));
+    qarray[1] = queue_new_mpmc(1, sizeof(int));
+    assert(queue_close(qarray[1]) == 0);
+    assert(queue_select_not_empty_for(qarray, 2, sq, &ns, 1000000) == 0);
+    assert(ns == 1 && sq[0] == qarray[1]);
+    queue_free(qarray[0]);
+    queue_free(qarray[1]);
+    printf("OK\n");
+}
+
+DECLARE_QUEUE(counter, long)
+
+static inline int dummy_priority(const dummy_t * d){
+    return d->i;
+}
+
+DECLARE_PRIORITY_QUEUE(dummy_prio, dummy_t, dummy_priority)
+
+void * _counter_producer(void * data){
+    counter_queue_t * q = (counter_queue_t*)data;
+    long i;
+    for(i = 0; i < SPSC_COUNT; i++)
+        assert(counter_queue_put(q, i) == 0);
+    return NULL;
+}
+
+void test_typed_queues(void){
+    printf("%s: \n", __func__);
+    counter_queue_t * (*ctor[])(unsigned int) = {
+        counter_queue_new, counter_queue_new_spsc, counter_queue_new_mpmc
+    };
+    unsigned int c;
+    for(c = 0; c < sizeof(ctor)/sizeof(ctor[0]); c++){
+        counter_queue_t * q = ctor[c](100);
+        long i, v;
+        pthread_t tid;
+        (void)v;
+        pthread_create(&tid, NULL, &_counter_producer, q);
+        for(i = 0; i < SPSC_COUNT; i++){
+            assert(counter_queue_take(q, &v) == 0);
+            assert(v == i);
+        }
+        pthread_join(tid, NULL);
+        assert(counter_queue_try_take(q, &v) == EAGAIN);
+        assert(counter_queue_take_for(q, &v, 1000000) == ETIMEDOUT);
+        //the capacity is rounded up to 128
+        for(i = 0; i < 128; i++)
+            assert(counter_queue_try_put(q, i) == 0);
+        assert(counter_queue_try_put(q, i) == EAGAIN);
+        assert(counter_queue_put_for(q, i, 1000000) == ETIMEDOUT);
+        assert(queue_close(counter_queue_base(q)) == 0);
+        assert(counter_queue_put(q, i) == EPIPE);
+        counter_queue_free(q);
+    }
+
+    //the inlined puts and takes still run the callbacks
+    int put = 0, took = 0;
+    long v;
+    counter_queue_t * q = counter_queue_new(2);
+    notification_callback_t * ncs[] = {
+        queue_append_not_empty_edge_callback(counter_queue_base(q),
+                dummy_callback, &put),
+        queue_append_not_full_edge_callback(counter_queue_base(q),
+                dummy_callback, &took),
+    };
+    assert(counter_queue_put(q, 1) == 0 && counter_queue_put(q, 2) == 0);
+    assert(counter_queue_take(q, &v) == 0 && counter_queue_take(q, &v) == 0);
+    assert(put == 1 && took == 1);
+    queue_remove_callback(ncs[0]);
+    queue_remove_callback(ncs[1]);
+    counter_queue_free(q);
+
+    dummy_prio_queue_t * pq = dummy_prio_queue_new(4);
+    dummy_t d[] = {{2, 0}, {7, 1}, {5, 2}, {1, 3}};
+    int i, expected[] = {7, 5, 2, 1};
+    ncs[0] = queue_append_not_empty_callback(dummy_prio_queue_base(pq),
+            dummy_callback, &put);
+    for(i = 0; i < 4; i++)
+        assert(dummy_prio_queue_try_put(pq, d[i]) == 0);
+    assert(dummy_prio_queue_put_for(pq, d[0], 1000000) == ETIMEDOUT);
+    for(i = 0; i < 4; i++){
+        dummy_t r;
+        assert(dummy_prio_queue_take(pq, &r) == 0);
+        assert(r.i == expected[i]);
+    }
+    assert(dummy_prio_queue_try_take(pq, d) == EAGAIN);
+    assert(put == 5);
+    queue_remove_callback(ncs[0]);
+    dummy_prio_queue_free(pq);
+    printf("OK\n");
+}
+
 int main(int argc, char ** argv){
     (void)argc;
     (void)argv;
@@ -397,16 +1919,44 @@ int main(int argc, char ** argv){
     test_rb_write_success();
     test_rb_take_success();
     test_rb_write_take_full_failure();
+    test_specialized_buffer();
     test_new_channel();
     test_new_dummy_channel();
     test_threaded_take_put();
     test_take_put_timeouts();
     test_hb_write_take();
+    test_hb_large_payload();
     test_priority_queue_write_take();
+    test_priority_queue_dary();
+    test_priority_queue_stable();
+    test_priority_queue_bucketed();
+    test_growable_buffer();
+    test_growable_queue();
     test_callback();
+    test_edge_callback();
+    test_callback_removal();
+    test_queue_eventfd();
+    test_channel_pool();
+    test_broadcast();
+    test_bytes_queue();
     test_select();
     test_timed_select();
     test_try_take_put();
+    test_spsc_threaded_take_put();
+    test_spsc_timeouts_select();
+    test_mpmc_threaded_take_put();
+    test_take_put_many();
+    test_reserve_commit();
+    test_wake_waiters();
+    test_spin_take_put();
+    test_sub_second_timeouts();
+    test_selector();
+    test_select_fairness();
+    test_queue_close();
+    test_queue_pool();
+    test_queue_reset();
+    test_queue_init_at();
+    test_typed_queues();
     return 0;
 }
 